@@ -0,0 +1,253 @@
+#ifndef BANDQUEUE
+#define BANDQUEUE
+
+#include "ppmr.h"
+#include "ezthread.h"
+#include "ezmem.h"
+#include "trace.h"
+
+#define BAND_SLOTS 8 // decoded bands the decoder may run ahead by
+
+// A run of decoded rows.
+typedef struct Band {
+  Pixel *pixels;             // NULL with LAYOUT_RGB_HALF
+  unsigned char *data;       // the rows in the queue's layout
+  int    firstRow, rows;
+} Band;
+
+// Lock-free single-producer/single-consumer queue of row bands. A decoder
+// thread fills slots from a PpmReader and the render loop drains them, so
+// the image shows up while it is still being read. head is only written by
+// the decoder and tail only by the consumer; each publishes its slot with a
+// release store. A decoder that runs a full ring ahead sleeps on freed
+// until the consumer hands a band back.
+typedef struct BandQueue {
+  Band       bands[BAND_SLOTS];
+  int        bandRows;
+  PixelLayout layout;        // LAYOUT_RGB, LAYOUT_RGBX, LAYOUT_RGB_HALF or
+                             // LAYOUT_GRAY
+  PpmReader *reader;         // NULL until started
+  unsigned short *half;      // LAYOUT_RGB_HALF: sample to half float
+  PixelConvert convert;      // LAYOUT_RGBX and LAYOUT_GRAY: pixels to data
+  void     (*notify)(void);  // called after each band, may be NULL
+  ezThread   thread;
+  int        running;        // thread needs joining
+  volatile long head;        // bands decoded
+  volatile long tail;        // bands consumed
+  volatile long state;       // BAND_DECODING, BAND_DONE or BAND_ERROR
+  volatile long cancel;      // set by the consumer to stop the decoder
+  ezSignal   freed;          // notified when tail moves or on cancel
+} BandQueue;
+
+#define BAND_DECODING 0
+#define BAND_DONE     1
+#define BAND_ERROR    2
+
+/* Function Prototypes */
+static inline  int    bandQueueStart(BandQueue *queue, PpmReader *reader,
+                                       size_t bandBytes, PixelLayout layout,
+                                       void (*notify)(void));
+static inline  Band  *bandQueuePeek(BandQueue *queue);
+static inline  void   bandQueuePop(BandQueue *queue);
+static inline  int    bandQueueState(BandQueue *queue);
+static inline  void   bandQueueStop(BandQueue *queue);
+
+static EZTHREAD_FUNC(bandDecoder, arg)
+{
+  BandQueue *queue = (BandQueue *) arg;
+  long head = 0;
+
+  while (!ezAtomicLoad(&queue->cancel))
+  {
+    Band *band;
+    int rows;
+    double start;
+    long seen = ezSignalPeek(&queue->freed);
+
+    // wait for the consumer to free a slot
+    if (head - ezAtomicLoad(&queue->tail) == BAND_SLOTS)
+    {
+      if (!ezAtomicLoad(&queue->cancel))
+      {
+        ezSignalWait(&queue->freed, seen);
+      }
+      continue;
+    }
+
+    band = &queue->bands[head % BAND_SLOTS];
+    band->firstRow = queue->reader->row;
+    start = traceBegin();
+    if (queue->layout == LAYOUT_RGB_HALF)
+    {
+      rows = ppmReadRows16(queue->reader, (unsigned short *) band->data,
+                           queue->bandRows);
+    }
+    else
+    {
+      rows = ppmReadRows(queue->reader, band->pixels, queue->bandRows);
+    }
+    if (rows <= 0)
+    {
+      ezAtomicStore(&queue->state, rows == 0 ? BAND_DONE : BAND_ERROR);
+      break;
+    }
+    band->rows = rows;
+    if (queue->convert != NULL)
+    {
+      queue->convert(band->pixels, band->data,
+                     (size_t) rows * queue->reader->width);
+    }
+    else if (queue->layout == LAYOUT_RGB_HALF)
+    {
+      unsigned short *h = (unsigned short *) band->data;
+      size_t i, n = (size_t) 3 * rows * queue->reader->width;
+      for (i = 0; i < n; i++)
+      {
+        h[i] = queue->half[h[i]];
+      }
+    }
+    traceEnd("decode band", start);
+
+    ezAtomicStore(&queue->head, ++head);
+    if (queue->notify != NULL)
+    {
+      queue->notify();
+    }
+  }
+
+  if (queue->notify != NULL)
+  {
+    queue->notify();
+  }
+  return EZTHREAD_RETURN;
+}
+
+// start decoding the rest of reader on a worker thread, in bands of about
+// bandBytes. With LAYOUT_RGBX the decoder also widens every band, so the
+// consumer gets rows it can upload as GL_RGBA, and with LAYOUT_RGB_HALF it
+// hands out half-float RGB at the file's full precision. LAYOUT_GRAY bands
+// of gray images are a byte per pixel for GL_LUMINANCE. Returns 1 when out
+// of memory or no thread could be started.
+static inline int bandQueueStart(BandQueue *queue, PpmReader *reader,
+                                   size_t bandBytes, PixelLayout layout,
+                                   void (*notify)(void))
+{
+  int i;
+
+  memset(queue, 0, sizeof(BandQueue));
+  ezSignalInit(&queue->freed);
+  queue->reader = reader;
+  queue->layout = layout;
+  queue->notify = notify;
+  if (layout == LAYOUT_RGBX || layout == LAYOUT_GRAY)
+  {
+    queue->convert = pixelConverter(layout);
+  }
+  queue->bandRows = (int) (bandBytes / (sizeof(Pixel) * reader->width));
+  if (queue->bandRows < 1)
+  {
+    queue->bandRows = 1;
+  }
+
+  if (layout == LAYOUT_RGB_HALF)
+  {
+    queue->half = ppmrHalfTable(reader->maxColor);
+    if (queue->half == NULL)
+    {
+      bandQueueStop(queue);
+      return 1;
+    }
+  }
+
+  // half-float bands are read straight into data and have no pixels
+  for (i = 0; i < BAND_SLOTS; i++)
+  {
+    if (layout != LAYOUT_RGB_HALF)
+    {
+      queue->bands[i].pixels = ezBufferAlloc(sizeof(Pixel) * reader->width *
+                                      (size_t) queue->bandRows);
+      if (queue->bands[i].pixels == NULL)
+      {
+        bandQueueStop(queue);
+        return 1;
+      }
+    }
+
+    queue->bands[i].data = (unsigned char *) queue->bands[i].pixels;
+    if (layout != LAYOUT_RGB)
+    {
+      queue->bands[i].data = ezBufferAlloc((size_t) (layout == LAYOUT_RGBX ? 4 :
+                                              layout == LAYOUT_GRAY ? 1 : 6) *
+                                    reader->width * queue->bandRows);
+      if (queue->bands[i].data == NULL)
+      {
+        bandQueueStop(queue);
+        return 1;
+      }
+    }
+  }
+
+  if (ezThreadCreate(&queue->thread, bandDecoder, queue))
+  {
+    bandQueueStop(queue);
+    return 1;
+  }
+  queue->running = 1;
+  return 0;
+}
+
+// oldest decoded band, NULL when the decoder hasn't got further
+static inline Band *bandQueuePeek(BandQueue *queue)
+{
+  if (queue->tail == ezAtomicLoad(&queue->head))
+  {
+    return NULL;
+  }
+  return &queue->bands[queue->tail % BAND_SLOTS];
+}
+
+// hand the band from bandQueuePeek back to the decoder
+static inline void bandQueuePop(BandQueue *queue)
+{
+  ezAtomicStore(&queue->tail, queue->tail + 1);
+  ezSignalNotify(&queue->freed);
+}
+
+// BAND_DONE or BAND_ERROR once the decoder has stopped, BAND_DECODING before
+static inline int bandQueueState(BandQueue *queue)
+{
+  return (int) ezAtomicLoad(&queue->state);
+}
+
+// stop the decoder if it is still going, then free the bands
+static inline void bandQueueStop(BandQueue *queue)
+{
+  int i;
+
+  if (queue->running)
+  {
+    ezAtomicStore(&queue->cancel, 1);
+    ezSignalNotify(&queue->freed);
+    ezThreadJoin(queue->thread);
+    queue->running = 0;
+  }
+  for (i = 0; i < BAND_SLOTS; i++)
+  {
+    if (queue->bands[i].data != (unsigned char *) queue->bands[i].pixels)
+    {
+      ezBufferFree(queue->bands[i].data);
+    }
+    ezBufferFree(queue->bands[i].pixels);
+    queue->bands[i].pixels = NULL;
+    queue->bands[i].data = NULL;
+  }
+  free(queue->half);
+  queue->half = NULL;
+  if (queue->reader != NULL)
+  {
+    ezSignalDestroy(&queue->freed);
+    queue->reader = NULL;
+  }
+}
+
+#endif
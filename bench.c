@@ -0,0 +1,504 @@
+#define GLFW_DLL 1
+
+#define GL_GLEXT_PROTOTYPES
+#include <GLES2/gl2.h>
+#include <GLFW/glfw3.h>
+
+#include "linmath.h"
+#include "ppmr.h"
+#include "ezpool.h"
+#include "warp.h"
+#include "mipmap.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+// Benchmarks for the PPM readers and the render paths. Synthetic P3 and P6
+// images are generated at a few sizes, every step is timed over several
+// runs, and the results go out as JSON so runs can be compared between
+// builds. Files are read from the OS cache after the first run, so the
+// numbers are for decoding, not the disk.
+
+#define BENCH_MAX_SIZES 16
+#define BENCH_FRAME_W   1920 // headless frame size
+#define BENCH_FRAME_H   1080
+#define BENCH_HEADERS   1000 // parseH runs per sample
+
+typedef struct BenchStats {
+  double min, p50, p90, p99, mean;
+} BenchStats;
+
+static FILE *json;
+static int results = 0;
+static volatile unsigned sink; // keeps reads the compiler could drop
+
+static int compareTimes(const void *a, const void *b)
+{
+  double x = *(const double *) a, y = *(const double *) b;
+  return x < y ? -1 : x > y;
+}
+
+// nearest-rank percentiles of count run times
+static void benchStats(double *times, int count, BenchStats *stats)
+{
+  int i;
+
+  qsort(times, count, sizeof(double), compareTimes);
+  stats->min = times[0];
+  stats->p50 = times[(count * 50 + 99) / 100 - 1];
+  stats->p90 = times[(count * 90 + 99) / 100 - 1];
+  stats->p99 = times[(count * 99 + 99) / 100 - 1];
+  stats->mean = 0;
+  for (i = 0; i < count; i++)
+  {
+    stats->mean += times[i] / count;
+  }
+}
+
+// write one result. bytes and pixels are what a single run moves, the
+// rates are taken at the median.
+static void benchReport(const char *name, const char *format, int width,
+                        int height, double bytes, double pixels,
+                        double *times, int count)
+{
+  BenchStats stats;
+
+  benchStats(times, count, &stats);
+  fprintf(json, "%s\n    {\"name\": \"%s\", \"format\": \"%s\", "
+                "\"width\": %d, \"height\": %d, \"runs\": %d,\n"
+                "     \"seconds\": {\"min\": %.6g, \"p50\": %.6g, "
+                "\"p90\": %.6g, \"p99\": %.6g, \"mean\": %.6g},\n"
+                "     \"MBps\": %.6g, \"pixelsPerSecond\": %.6g}",
+          results++ ? "," : "", name, format, width, height, count,
+          stats.min, stats.p50, stats.p90, stats.p99, stats.mean,
+          bytes / 1e6 / stats.p50, pixels / stats.p50);
+  fprintf(stderr, "%-16s %s %5dx%-5d p50 %9.3f ms %10.1f MB/s\n", name,
+          format, width, height, stats.p50 * 1e3, bytes / 1e6 / stats.p50);
+}
+
+// gradients with some noise, so P3 numbers come in all lengths
+static void benchImage(Pixel *pixels, int width, int height)
+{
+  unsigned seed = 12345;
+  int x, y;
+
+  for (y = 0; y < height; y++)
+  {
+    for (x = 0; x < width; x++)
+    {
+      Pixel *p = &pixels[(size_t) y * width + x];
+      seed = seed * 1103515245 + 12345;
+      p->r = (unsigned char) (x * 255 / width);
+      p->g = (unsigned char) (y * 255 / height);
+      p->b = (unsigned char) (seed >> 24);
+    }
+  }
+}
+
+// rewind in and parse its header, returns 1 on failure
+static int benchRewind(FILE *in, int *width, int *height, int *maxColor)
+{
+  int version;
+
+  rewind(in);
+  return parseH(in, width, height, maxColor, &version);
+}
+
+// a file just written couldn't be read back, the timings would be garbage
+static void benchFail(const char *format)
+{
+  fprintf(stderr, "Error: Could not read back the %s image\n", format);
+  exit(1);
+}
+
+// time the readers on one file
+static void benchRead(FILE *in, const char *format, Pixel *buffer,
+                      int width, int height, int runs, double *times)
+{
+  double bytes, pixels = (double) width * height;
+  int w, h, maxColor, i, bandRows;
+  PpmReader reader;
+  double start;
+
+  fseek(in, 0, SEEK_END);
+  bytes = (double) ftell(in);
+
+  for (i = 0; i < runs; i++)
+  {
+    int j;
+    start = ezSeconds();
+    for (j = 0; j < BENCH_HEADERS; j++)
+    {
+      if (benchRewind(in, &w, &h, &maxColor))
+      {
+        benchFail(format);
+      }
+    }
+    times[i] = (ezSeconds() - start) / BENCH_HEADERS;
+  }
+  benchReport("parseH", format, width, height, 0, 0, times, runs);
+
+  for (i = 0; i < runs; i++)
+  {
+    start = ezSeconds();
+    if (benchRewind(in, &w, &h, &maxColor) ||
+        (format[1] == '3' ? readP3(in, buffer, &w, &h, &maxColor) :
+                            readP6(in, buffer, &w, &h, &maxColor)))
+    {
+      benchFail(format);
+    }
+    times[i] = ezSeconds() - start;
+  }
+  benchReport(format[1] == '3' ? "readP3" : "readP6", format, width, height,
+              bytes, pixels, times, runs);
+
+  if (format[1] == '3')
+  {
+    for (i = 0; i < runs; i++)
+    {
+      start = ezSeconds();
+      if (benchRewind(in, &w, &h, &maxColor) ||
+          readP3Threaded(in, buffer, &w, &h, &maxColor, ezCpuCount()))
+      {
+        benchFail(format);
+      }
+      times[i] = ezSeconds() - start;
+    }
+    benchReport("readP3Threaded", format, width, height, bytes, pixels,
+                times, runs);
+  }
+  else
+  {
+    for (i = 0; i < runs; i++)
+    {
+      PixelMap map;
+      unsigned sum = 0;
+      size_t k, length;
+
+      start = ezSeconds();
+      if (benchRewind(in, &w, &h, &maxColor))
+      {
+        benchFail(format);
+      }
+      if (mapP6(in, &map, &w, &h))
+      {
+        break;
+      }
+      // touch every page, mapping alone reads nothing
+      length = sizeof(Pixel) * (size_t) w * h;
+      for (k = 0; k < length; k += 4096)
+      {
+        sum += ((const unsigned char *) map.pixels)[k];
+      }
+      unmapP6(&map);
+      times[i] = ezSeconds() - start;
+      sink += sum;
+    }
+    if (i == runs)
+    {
+      benchReport("mapP6", format, width, height, bytes, pixels, times,
+                  runs);
+    }
+  }
+
+  // streaming reader in 1 MiB bands, as the viewer uses it
+  bandRows = (1 << 20) / (int) (sizeof(Pixel) * width);
+  bandRows = bandRows < 1 ? 1 : bandRows;
+  for (i = 0; i < runs; i++)
+  {
+    start = ezSeconds();
+    rewind(in);
+    if (ppmOpen(&reader, in))
+    {
+      benchFail(format);
+    }
+    while (ppmReadRows(&reader, buffer + (size_t) reader.row * width,
+                       bandRows) > 0)
+    {
+      // keep going to the end of the image
+    }
+    ppmClose(&reader);
+    if (reader.row != height)
+    {
+      benchFail(format);
+    }
+    times[i] = ezSeconds() - start;
+  }
+  benchReport("ppmReadRows", format, width, height, bytes, pixels, times,
+              runs);
+}
+
+// time CPU frames of a rotated, scaled image
+static void benchFrame(const Pixel *image, int width, int height, int runs,
+                       double *times, ezPool *pool)
+{
+  Pixel *frame = malloc(sizeof(Pixel) * BENCH_FRAME_W * BENCH_FRAME_H);
+  mat4x4 mvp, scale;
+  int i;
+
+  if (frame == NULL)
+  {
+    return;
+  }
+  mat4x4_identity(mvp);
+  mat4x4_rotate_Z(mvp, mvp, 0.5f);
+  mat4x4_identity(scale);
+  scale[0][0] = scale[1][1] = 0.8f;
+  mat4x4_mul(mvp, mvp, scale);
+
+  for (i = 0; i < runs; i++)
+  {
+    double start = ezSeconds();
+    warpImagePool(image, width, height, frame, BENCH_FRAME_W, BENCH_FRAME_H,
+                  mvp, pool);
+    times[i] = ezSeconds() - start;
+  }
+  benchReport("headlessFrame", "RGB", width, height,
+              (double) sizeof(Pixel) * BENCH_FRAME_W * BENCH_FRAME_H,
+              (double) BENCH_FRAME_W * BENCH_FRAME_H, times, runs);
+  free(frame);
+}
+
+// time building the whole mip chain, bytes are what the levels take
+static void benchMipmaps(const Pixel *image, int width, int height, int runs,
+                         double *times, ezPool *pool)
+{
+  MipChain chain;
+  int i;
+
+  for (i = 0; i < runs; i++)
+  {
+    double start = ezSeconds();
+    if (mipBuild(&chain, image, width, height, pool))
+    {
+      return;
+    }
+    times[i] = ezSeconds() - start;
+    mipFree(&chain);
+  }
+  benchReport("mipBuild", "RGB", width, height,
+              (double) sizeof(Pixel) * width * height / 3,
+              (double) width * height / 3, times, runs);
+}
+
+// time the P3 and P6 writers into a scratch file, warm in the OS cache
+static void benchWrite(const Pixel *image, int width, int height, int runs,
+                       double *times)
+{
+  FILE *out = tmpfile();
+  int version, i;
+
+  if (out == NULL)
+  {
+    return;
+  }
+  for (version = 3; version <= 6; version += 3)
+  {
+    for (i = 0; i < runs; i++)
+    {
+      double start = ezSeconds();
+      rewind(out);
+      if (version == 3 ? writeP3(out, image, width, height) :
+                         writeP6(out, image, width, height))
+      {
+        fclose(out);
+        return;
+      }
+      times[i] = ezSeconds() - start;
+    }
+    benchReport(version == 3 ? "writeP3" : "writeP6",
+                version == 3 ? "P3" : "P6", width, height, (double) ftell(out),
+                (double) width * height, times, runs);
+  }
+  fclose(out);
+}
+
+// time whole-image texture uploads, glFinish waits for the driver
+static void benchUpload(const Pixel *image, int width, int height, int runs,
+                        double *times)
+{
+  GLint maxTexture;
+  GLuint texture;
+  int i;
+
+  glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxTexture);
+  if (width > maxTexture || height > maxTexture)
+  {
+    fprintf(stderr, "textureUpload    skipped, over GL_MAX_TEXTURE_SIZE\n");
+    return;
+  }
+
+  glGenTextures(1, &texture);
+  glBindTexture(GL_TEXTURE_2D, texture);
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+  for (i = 0; i < runs; i++)
+  {
+    double start = ezSeconds();
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB,
+                 GL_UNSIGNED_BYTE, image);
+    glFinish();
+    times[i] = ezSeconds() - start;
+  }
+  glDeleteTextures(1, &texture);
+  benchReport("textureUpload", "RGB", width, height,
+              (double) sizeof(Pixel) * width * height,
+              (double) width * height, times, runs);
+}
+
+// hidden window for the upload benchmark, NULL when there is no GL
+static GLFWwindow *benchContext(void)
+{
+  GLFWwindow *window;
+
+  if (!glfwInit())
+  {
+    return NULL;
+  }
+  glfwDefaultWindowHints();
+  glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+  glfwWindowHint(GLFW_CONTEXT_CREATION_API, GLFW_EGL_CONTEXT_API);
+  glfwWindowHint(GLFW_CLIENT_API, GLFW_OPENGL_ES_API);
+  glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 2);
+  glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 0);
+  window = glfwCreateWindow(64, 64, "bench", NULL, NULL);
+  if (window == NULL)
+  {
+    glfwTerminate();
+    return NULL;
+  }
+  glfwMakeContextCurrent(window);
+  return window;
+}
+
+int main(int argc, char *argv[])
+{
+  double sizes[BENCH_MAX_SIZES] = {1, 16, 100};
+  int sizeCount = 3, runs = 0, gl = 1, i;
+  const char *outPath = NULL;
+  GLFWwindow *window = NULL;
+  ezPool *pool;
+
+  for (i = 1; i < argc; i++)
+  {
+    if (strcmp(argv[i], "-mp") == 0 && i + 1 < argc)
+    {
+      // comma separated megapixel counts
+      char *p = argv[++i];
+      sizeCount = 0;
+      while (*p != '\0' && sizeCount < BENCH_MAX_SIZES)
+      {
+        sizes[sizeCount] = strtod(p, &p);
+        if (sizes[sizeCount] > 0)
+          sizeCount++;
+        if (*p == ',')
+          p++;
+        else
+          break;
+      }
+    }
+    else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+    {
+      runs = atoi(argv[++i]);
+    }
+    else if (strcmp(argv[i], "-nogl") == 0)
+    {
+      gl = 0;
+    }
+    else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+    {
+      outPath = argv[++i];
+    }
+    else
+    {
+      fprintf(stderr, "Error: Usage bench [-mp 1,16,100] [-n runs] [-nogl] "
+                      "[-o results.json]\n");
+      exit(1);
+    }
+  }
+
+  if (sizeCount == 0)
+  {
+    fprintf(stderr, "Error: -mp has no size above 0 megapixels\n");
+    exit(1);
+  }
+  json = outPath != NULL ? fopen(outPath, "w") : stdout;
+  if (json == NULL)
+  {
+    fprintf(stderr, "Error: Could not open %s\n", outPath);
+    exit(1);
+  }
+  if (gl)
+  {
+    window = benchContext();
+    if (window == NULL)
+      fprintf(stderr, "No GL context, skipping texture uploads\n");
+  }
+  pool = ezPoolCreate(0);
+
+  fprintf(json, "{\n  \"cpus\": %d, \"frameWidth\": %d, "
+                "\"frameHeight\": %d, \"textureUpload\": %s,\n"
+                "  \"results\": [", ezCpuCount(), BENCH_FRAME_W,
+          BENCH_FRAME_H, window != NULL ? "true" : "false");
+
+  for (i = 0; i < sizeCount; i++)
+  {
+    int width = (int) (sqrt(sizes[i] * 1e6 * 4 / 3) + 0.5);
+    int height = (int) (sizes[i] * 1e6 / width + 0.5);
+    int n = runs > 0 ? runs : (int) (64 / sizes[i]);
+    Pixel *image = malloc(sizeof(Pixel) * (size_t) width * height);
+    Pixel *buffer = malloc(sizeof(Pixel) * (size_t) width * height);
+    FILE *p3 = tmpfile(), *p6 = tmpfile();
+    double *times;
+
+    n = n < 3 ? 3 : n > 50 ? 50 : n;
+    times = malloc(sizeof(double) * n);
+    if (image == NULL || buffer == NULL || times == NULL || p3 == NULL ||
+        p6 == NULL)
+    {
+      fprintf(stderr, "Error: Not enough memory or disk for %gMP\n",
+              sizes[i]);
+      exit(1);
+    }
+
+    benchImage(image, width, height);
+    if (writeP3(p3, image, width, height) ||
+        writeP6(p6, image, width, height))
+    {
+      fprintf(stderr, "Error: Could not write the %gMP images\n", sizes[i]);
+      exit(1);
+    }
+
+    benchRead(p3, "P3", buffer, width, height, n, times);
+    benchRead(p6, "P6", buffer, width, height, n, times);
+    if (memcmp(image, buffer, sizeof(Pixel) * (size_t) width * height))
+    {
+      fprintf(stderr, "Error: %gMP image read back wrong\n", sizes[i]);
+      exit(1);
+    }
+    benchFrame(image, width, height, n, times, pool);
+    benchMipmaps(image, width, height, n, times, pool);
+    benchWrite(image, width, height, n, times);
+    if (window != NULL)
+    {
+      benchUpload(image, width, height, n, times);
+    }
+
+    fclose(p3);
+    fclose(p6);
+    free(image);
+    free(buffer);
+    free(times);
+  }
+
+  fprintf(json, "\n  ]\n}\n");
+  if (outPath != NULL)
+    fclose(json);
+  ezPoolDestroy(pool);
+  if (window != NULL)
+  {
+    glfwDestroyWindow(window);
+    glfwTerminate();
+  }
+  return 0;
+}
@@ -0,0 +1,438 @@
+#ifndef DISKCACHE
+#define DISKCACHE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <direct.h>
+#include <sys/utime.h>
+#else
+#include <dirent.h>
+#include <utime.h>
+#include <unistd.h>
+#endif
+
+#include "ppmr.h"
+#include "ezthread.h"
+
+#define DISKCACHE_VERSION 1
+#define DISKCACHE_RASTER  4096      // raster offset in an entry, page aligned
+#define DISKCACHE_CAP     (1 << 30) // default size cap, see -cachecap
+#define DISKCACHE_SAMPLES 16        // blocks of the source hashed
+#define DISKCACHE_BLOCK   4096
+
+// On-disk cache of decoded rasters. Decoding P3 text (or rescaling odd
+// maxvals) is redone every time a file is opened; an entry keeps the
+// decoded 8-bit RGB raster in a file that is simply mapped and uploaded
+// next time. Entries are named after the source's full path, size and
+// modification time, so editing a file moves it to a new entry, and each
+// entry also records a hash of sampled blocks of the source that is
+// checked on every hit. Old entries are evicted least recently used first
+// once the directory goes over its size cap; a hit counts as a use. Any
+// thread may use the cache, entries are written to a temporary file and
+// renamed into place.
+
+typedef struct DiskCache {
+  char   dir[1024];
+  size_t cap;                 // bytes of entries kept
+} DiskCache;
+
+// What identifies a source file.
+typedef struct DiskCacheKey {
+  unsigned long long size;
+  long long          mtime;
+  unsigned long long content; // hash of sampled blocks
+  unsigned long long name;    // hash of path, size and mtime
+} DiskCacheKey;
+
+// Start of every entry, the raster follows at DISKCACHE_RASTER.
+typedef struct DiskCacheHeader {
+  char               magic[4]; // "EZVC"
+  int                version;
+  int                width, height;
+  unsigned long long sourceSize;
+  long long          sourceTime;
+  unsigned long long content;
+} DiskCacheHeader;
+
+/* Function Prototypes */
+static inline  int    diskCacheInit(DiskCache *cache, const char *dir,
+                                      size_t cap);
+static inline  int    diskCacheWorth(const PpmReader *reader);
+static inline  int    diskCacheLoad(DiskCache *cache, const char *path,
+                                      PixelMap *map, int *width,
+                                      int *height);
+static inline  int    diskCacheStore(DiskCache *cache, const char *path,
+                                       const Pixel *pixels, int width,
+                                       int height);
+
+// FNV-1a
+static inline unsigned long long diskCacheHash(unsigned long long hash,
+                                                 const void *data,
+                                                 size_t size)
+{
+  const unsigned char *p = (const unsigned char *) data;
+  size_t i;
+
+  for (i = 0; i < size; i++)
+  {
+    hash = (hash ^ p[i]) * 1099511628211ULL;
+  }
+  return hash;
+}
+
+// create dir and any missing parents, returns 1 when it still isn't there
+static inline int diskCacheMkdir(char *dir)
+{
+  char *p;
+  struct stat info;
+
+  for (p = dir + 1; *p != '\0'; p++)
+  {
+    if (*p == '/' || *p == '\\')
+    {
+      char c = *p;
+      *p = '\0';
+#ifdef _WIN32
+      _mkdir(dir);
+#else
+      mkdir(dir, 0755);
+#endif
+      *p = c;
+    }
+  }
+#ifdef _WIN32
+  _mkdir(dir);
+#else
+  mkdir(dir, 0755);
+#endif
+  return stat(dir, &info) != 0 || !(info.st_mode & S_IFDIR);
+}
+
+// use dir for the cache, NULL for the default: $EZVIEW_CACHE, else the
+// user's cache directory. Returns 1 when there is no usable directory.
+static inline int diskCacheInit(DiskCache *cache, const char *dir,
+                                  size_t cap)
+{
+  const char *base;
+  int n;
+
+  memset(cache, 0, sizeof(DiskCache));
+  cache->cap = cap;
+  if (dir == NULL)
+  {
+    dir = getenv("EZVIEW_CACHE");
+  }
+  if (dir != NULL)
+  {
+    n = snprintf(cache->dir, sizeof(cache->dir), "%s", dir);
+  }
+#ifdef _WIN32
+  else if ((base = getenv("LOCALAPPDATA")) != NULL)
+  {
+    n = snprintf(cache->dir, sizeof(cache->dir), "%s\\ezview", base);
+  }
+#else
+  else if ((base = getenv("XDG_CACHE_HOME")) != NULL && base[0] != '\0')
+  {
+    n = snprintf(cache->dir, sizeof(cache->dir), "%s/ezview", base);
+  }
+  else if ((base = getenv("HOME")) != NULL)
+  {
+    n = snprintf(cache->dir, sizeof(cache->dir), "%s/.cache/ezview", base);
+  }
+#endif
+  else
+  {
+    return 1;
+  }
+  if (n <= 0 || (size_t) n >= sizeof(cache->dir) - 32)
+  {
+    return 1;
+  }
+  return diskCacheMkdir(cache->dir);
+}
+
+// text images and odd maxvals cost a decode that is worth saving. 8-bit
+// binary ones (and bitmaps) decode about as fast as the saved copy maps.
+static inline int diskCacheWorth(const PpmReader *reader)
+{
+  return reader->version <= 3 ||
+         (reader->maxColor != 255 && reader->version != 4);
+}
+
+// work out the key of the file at path, returns 1 when it can't be read
+static inline int diskCacheKey(const char *path, DiskCacheKey *key)
+{
+  unsigned char block[DISKCACHE_BLOCK];
+  char full[1024];
+  FILE *in;
+  int i;
+#ifdef _WIN32
+  struct _stat64 info;
+
+  if (_stat64(path, &info) != 0 || _fullpath(full, path, sizeof(full)) == NULL)
+  {
+    return 1;
+  }
+#else
+  struct stat info;
+
+  if (stat(path, &info) != 0 || realpath(path, full) == NULL)
+  {
+    return 1;
+  }
+#endif
+  key->size = (unsigned long long) info.st_size;
+  key->mtime = (long long) info.st_mtime;
+
+  key->name = diskCacheHash(14695981039346656037ULL, full, strlen(full));
+  key->name = diskCacheHash(key->name, &key->size, sizeof(key->size));
+  key->name = diskCacheHash(key->name, &key->mtime, sizeof(key->mtime));
+
+  // blocks spread evenly over the file, the first one holds the header
+  in = fopen(path, "rb");
+  if (in == NULL)
+  {
+    return 1;
+  }
+  key->content = 14695981039346656037ULL;
+  for (i = 0; i < DISKCACHE_SAMPLES; i++)
+  {
+    unsigned long long offset = key->size > DISKCACHE_BLOCK ?
+        (key->size - DISKCACHE_BLOCK) / (DISKCACHE_SAMPLES - 1) * i : 0;
+    size_t got;
+
+    if (ppmrSeek(in, (long long) offset, SEEK_SET) != 0)
+    {
+      break;
+    }
+    got = fread(block, 1, sizeof(block), in);
+    key->content = diskCacheHash(key->content, block, got);
+    if (key->size <= DISKCACHE_BLOCK)
+    {
+      break;
+    }
+  }
+  fclose(in);
+  return 0;
+}
+
+// path of the entry for key
+static inline void diskCacheEntry(const DiskCache *cache,
+                                    const DiskCacheKey *key, char *entry,
+                                    size_t size)
+{
+  snprintf(entry, size, "%s/%016llx.ezc", cache->dir, key->name);
+}
+
+// Map the cached raster of the file at path. Returns 0 on a hit with the
+// raster in map->pixels (release it with unmapP6), 1 on a miss. A stale or
+// damaged entry is deleted.
+static inline int diskCacheLoad(DiskCache *cache, const char *path,
+                                  PixelMap *map, int *width, int *height)
+{
+  DiskCacheKey key;
+  DiskCacheHeader header;
+  char entry[1100];
+  FILE *in;
+  int status = 1;
+
+  memset(map, 0, sizeof(PixelMap));
+  if (diskCacheKey(path, &key))
+  {
+    return 1;
+  }
+  diskCacheEntry(cache, &key, entry, sizeof(entry));
+  in = fopen(entry, "rb");
+  if (in == NULL)
+  {
+    return 1;
+  }
+
+  if (fread(&header, sizeof(header), 1, in) == 1 &&
+      memcmp(header.magic, "EZVC", 4) == 0 &&
+      header.version == DISKCACHE_VERSION &&
+      header.sourceSize == key.size && header.sourceTime == key.mtime &&
+      header.content == key.content && header.width > 0 &&
+      header.height > 0 && fseek(in, DISKCACHE_RASTER, SEEK_SET) == 0)
+  {
+    *width = header.width;
+    *height = header.height;
+    status = mapP6(in, map, width, height);
+  }
+  fclose(in);
+
+  if (status)
+  {
+    remove(entry);
+    return 1;
+  }
+  utime(entry, NULL); // mark it used for eviction
+  return 0;
+}
+
+typedef struct DiskCacheFile {
+  char      name[64];
+  long long size, mtime;
+} DiskCacheFile;
+
+static inline int diskCacheOlder(const void *a, const void *b)
+{
+  const DiskCacheFile *x = (const DiskCacheFile *) a;
+  const DiskCacheFile *y = (const DiskCacheFile *) b;
+  return x->mtime < y->mtime ? -1 : x->mtime > y->mtime;
+}
+
+// delete the least recently used entries until the cache fits its cap,
+// keeping the one named keep
+static inline void diskCacheEvict(DiskCache *cache, const char *keep)
+{
+  DiskCacheFile *files = NULL, *grown;
+  int count = 0, capacity = 0, i;
+  unsigned long long total = 0;
+  char entry[1100];
+#ifdef _WIN32
+  WIN32_FIND_DATAA found;
+  HANDLE find;
+
+  snprintf(entry, sizeof(entry), "%s\\*.ezc", cache->dir);
+  find = FindFirstFileA(entry, &found);
+  if (find == INVALID_HANDLE_VALUE)
+  {
+    return;
+  }
+  do
+  {
+    ULARGE_INTEGER time;
+    if (strlen(found.cFileName) >= 64)
+    {
+      continue;
+    }
+    if (count == capacity)
+    {
+      capacity = capacity ? 2 * capacity : 64;
+      grown = realloc(files, sizeof(DiskCacheFile) * capacity);
+      if (grown == NULL)
+      {
+        break;
+      }
+      files = grown;
+    }
+    strcpy(files[count].name, found.cFileName);
+    files[count].size = ((long long) found.nFileSizeHigh << 32) |
+                        found.nFileSizeLow;
+    time.LowPart = found.ftLastWriteTime.dwLowDateTime;
+    time.HighPart = found.ftLastWriteTime.dwHighDateTime;
+    files[count].mtime = (long long) time.QuadPart;
+    total += files[count++].size;
+  } while (FindNextFileA(find, &found));
+  FindClose(find);
+#else
+  struct dirent *item;
+  struct stat info;
+  DIR *dir = opendir(cache->dir);
+
+  if (dir == NULL)
+  {
+    return;
+  }
+  while ((item = readdir(dir)) != NULL)
+  {
+    size_t len = strlen(item->d_name);
+    if (len < 5 || len >= 64 || strcmp(item->d_name + len - 4, ".ezc") != 0)
+    {
+      continue;
+    }
+    snprintf(entry, sizeof(entry), "%s/%s", cache->dir, item->d_name);
+    if (stat(entry, &info) != 0)
+    {
+      continue;
+    }
+    if (count == capacity)
+    {
+      capacity = capacity ? 2 * capacity : 64;
+      grown = realloc(files, sizeof(DiskCacheFile) * capacity);
+      if (grown == NULL)
+      {
+        break;
+      }
+      files = grown;
+    }
+    strcpy(files[count].name, item->d_name);
+    files[count].size = (long long) info.st_size;
+    files[count].mtime = (long long) info.st_mtime;
+    total += files[count++].size;
+  }
+  closedir(dir);
+#endif
+
+  qsort(files, count, sizeof(DiskCacheFile), diskCacheOlder);
+  for (i = 0; i < count && total > cache->cap; i++)
+  {
+    snprintf(entry, sizeof(entry), "%s/%s", cache->dir, files[i].name);
+    if (strcmp(entry, keep) != 0 && remove(entry) == 0)
+    {
+      total -= files[i].size;
+    }
+  }
+  free(files);
+}
+
+// Save the decoded raster of the file at path, then trim the cache. Returns
+// 1 when the entry couldn't be written, which only costs the next open.
+static inline int diskCacheStore(DiskCache *cache, const char *path,
+                                   const Pixel *pixels, int width, int height)
+{
+  static const char zeros[DISKCACHE_RASTER];
+  DiskCacheKey key;
+  DiskCacheHeader header;
+  char entry[1100], temp[1200];
+  size_t count = (size_t) width * height;
+  FILE *out;
+  int status;
+
+  if (sizeof(Pixel) * count + DISKCACHE_RASTER > cache->cap ||
+      diskCacheKey(path, &key))
+  {
+    return 1;
+  }
+  diskCacheEntry(cache, &key, entry, sizeof(entry));
+  snprintf(temp, sizeof(temp), "%s.%lx.tmp", entry, ezThreadId());
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, "EZVC", 4);
+  header.version = DISKCACHE_VERSION;
+  header.width = width;
+  header.height = height;
+  header.sourceSize = key.size;
+  header.sourceTime = key.mtime;
+  header.content = key.content;
+
+  out = fopen(temp, "wb");
+  if (out == NULL)
+  {
+    return 1;
+  }
+  status = fwrite(&header, sizeof(header), 1, out) != 1 ||
+           fwrite(zeros, DISKCACHE_RASTER - sizeof(header), 1, out) != 1 ||
+           fwrite(pixels, sizeof(Pixel), count, out) != count;
+  status |= fclose(out) != 0;
+
+  // rename doesn't replace an existing file on Windows
+  remove(entry);
+  if (status || rename(temp, entry) != 0)
+  {
+    remove(temp);
+    return 1;
+  }
+  diskCacheEvict(cache, entry);
+  return 0;
+}
+
+#endif
@@ -0,0 +1,381 @@
+#include "linmath.h"
+#include "ppmr.h"
+#include "ezpool.h"
+#include "warp.h"
+#include "ezmem.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include <direct.h>
+#endif
+
+// Batch converter for many PPMs at once: any PNM or PAM to 8-bit P6 (or
+// P3), optionally through the viewer's transform, every image of a
+// multi-image stream in turn. Every file is one task. The
+// tasks go to a pool with every core claiming the next file as soon as it
+// is done with one, biggest files first so a large one doesn't start last
+// and hold up the end. Each worker reads, converts and writes its own file,
+// so one waiting on the disk leaves the others computing. Plain conversion
+// streams a band of rows at a time and never holds a whole image. A file's
+// buffers come from its own arena, which is reset between the images of a
+// stream and goes back to the shared pool for the next file.
+
+#define BATCH_BAND   (1 << 20) // bytes of rows converted per step
+#define BATCH_BUFFER (1 << 20) // stdio buffer of every input and output
+
+typedef struct BatchFile {
+  const char *path;
+  long long   size;
+} BatchFile;
+
+typedef struct BatchJob {
+  BatchFile  *files;
+  int         count;
+  const char *outDir;
+  int         transform;      // any of -size -t -r -s -k given
+  mat4x4      mvp;
+  int         ow, oh;         // 0 x 0 for the input's size
+  int         mipmaps;
+  int         version;        // of the outputs, 3 or 6
+  ezPool     *pool;           // rows of a file, when there is only one
+  volatile long failed;
+  volatile long bytesIn, bytesOut;
+} BatchJob;
+
+// bytes in the file at path, -1 when it can't be read
+static long long batchSize(const char *path)
+{
+#ifdef _WIN32
+  struct _stat64 info;
+  return _stat64(path, &info) == 0 ? (long long) info.st_size : -1;
+#else
+  struct stat info;
+  return stat(path, &info) == 0 ? (long long) info.st_size : -1;
+#endif
+}
+
+// biggest first
+static int batchCompareSizes(const void *a, const void *b)
+{
+  long long x = ((const BatchFile *) a)->size;
+  long long y = ((const BatchFile *) b)->size;
+  return x < y ? 1 : x > y ? -1 : 0;
+}
+
+// the file name at the end of path
+static const char *batchName(const char *path)
+{
+  const char *name = path, *p;
+
+  for (p = path; *p != '\0'; p++)
+  {
+    if (*p == '/' || *p == '\\')
+      name = p + 1;
+  }
+  return name;
+}
+
+// by file name, the way the file system compares them
+static int batchCompareNames(const void *a, const void *b)
+{
+  const char *x = batchName(((const BatchFile *) a)->path);
+  const char *y = batchName(((const BatchFile *) b)->path);
+#ifdef _WIN32
+  return _stricmp(x, y);
+#else
+  return strcmp(x, y);
+#endif
+}
+
+// where the converted path goes: outDir plus its file name
+static void batchOutPath(const BatchJob *job, const char *path, char *out,
+                         size_t size)
+{
+  snprintf(out, size, "%s/%s", job->outDir, batchName(path));
+}
+
+// true when a and b name the same existing file
+static int batchSameFile(const char *a, const char *b)
+{
+#ifdef _WIN32
+  char fa[1024], fb[1024];
+  return _fullpath(fa, a, sizeof(fa)) != NULL &&
+         _fullpath(fb, b, sizeof(fb)) != NULL && _stricmp(fa, fb) == 0;
+#else
+  struct stat x, y;
+  return stat(a, &x) == 0 && stat(b, &y) == 0 && x.st_dev == y.st_dev &&
+         x.st_ino == y.st_ino;
+#endif
+}
+
+// copy the image across a band of rows at a time
+static int batchStream(PpmReader *reader, PpmWriter *writer, ezArena *arena)
+{
+  int bandRows = BATCH_BAND / (int) (sizeof(Pixel) * reader->width);
+  Pixel *band;
+  int rows, status = 0;
+
+  bandRows = bandRows < 1 ? 1 : bandRows;
+  band = ezArenaAlloc(arena, sizeof(Pixel) * (size_t) reader->width *
+                             bandRows);
+  if (band == NULL)
+  {
+    return 1;
+  }
+  while (!status && (rows = ppmReadRows(reader, band, bandRows)) > 0)
+  {
+    status = ppmWriteRows(writer, band, rows);
+  }
+  return status || reader->row != reader->height;
+}
+
+// decode the whole image and write the transformed frame
+static int batchTransform(const BatchJob *job, PpmReader *reader,
+                          PpmWriter *writer, ezPool *pool, ezArena *arena)
+{
+  size_t pixels = (size_t) reader->width * reader->height;
+  Pixel *image = ezArenaAlloc(arena, sizeof(Pixel) * pixels);
+  Pixel *frame = ezArenaAlloc(arena, sizeof(Pixel) * (size_t) writer->width *
+                                     writer->height);
+
+  return image == NULL || frame == NULL ||
+         ppmReadRows(reader, image, reader->height) != reader->height ||
+         warpRender(image, reader->width, reader->height, frame,
+                    writer->width, writer->height, (vec4 *) job->mvp,
+                    job->mipmaps, pool) ||
+         ppmWriteRows(writer, frame, writer->height);
+}
+
+// convert one file, returns 1 on failure with the reason printed
+static int batchFile(BatchJob *job, const BatchFile *file, ezPool *pool)
+{
+  char outPath[1024];
+  PpmReader reader;
+  PpmWriter writer;
+  ezArena arena;
+  FILE *in, *out;
+  int ow, oh, status;
+
+  batchOutPath(job, file->path, outPath, sizeof(outPath));
+  if (batchSameFile(file->path, outPath))
+  {
+    fprintf(stderr, "Error: %s would overwrite itself\n", file->path);
+    return 1;
+  }
+
+  in = fopen(file->path, "rb");
+  if (in == NULL)
+  {
+    fprintf(stderr, "Error: Could not open %s\n", file->path);
+    return 1;
+  }
+  setvbuf(in, NULL, _IOFBF, BATCH_BUFFER);
+  if (ppmOpen(&reader, in))
+  {
+    fprintf(stderr, "Error: Bad header in %s\n", file->path);
+    fclose(in);
+    return 1;
+  }
+
+  out = fopen(outPath, "wb");
+  if (out == NULL)
+  {
+    fprintf(stderr, "Error: Could not create %s\n", outPath);
+    ppmClose(&reader);
+    fclose(in);
+    return 1;
+  }
+  setvbuf(out, NULL, _IOFBF, BATCH_BUFFER);
+
+  // the images of a stream go to the output one after another
+  ezArenaInit(&arena);
+  do
+  {
+    ow = job->ow > 0 ? job->ow : reader.width;
+    oh = job->oh > 0 ? job->oh : reader.height;
+    ezArenaReset(&arena);
+    status = ppmWriterOpen(&writer, out, ow, oh, job->version) ||
+             (job->transform ?
+                  batchTransform(job, &reader, &writer, pool, &arena) :
+                  batchStream(&reader, &writer, &arena));
+    status |= ppmWriterClose(&writer);
+  } while (!status && !ppmNextImage(&reader));
+  ezArenaFree(&arena);
+  ppmClose(&reader);
+  fclose(in);
+  status |= fclose(out) != 0;
+
+  if (status)
+  {
+    fprintf(stderr, "Error: Could not convert %s\n", file->path);
+    remove(outPath);
+    return 1;
+  }
+  ezAtomicAdd(&job->bytesIn, (long) (file->size >> 10));
+  ezAtomicAdd(&job->bytesOut, (long) (batchSize(outPath) >> 10));
+  return 0;
+}
+
+static void batchFiles(void *ctx, int begin, int end)
+{
+  BatchJob *job = (BatchJob *) ctx;
+  int i;
+
+  for (i = begin; i < end; i++)
+  {
+    if (batchFile(job, &job->files[i], NULL))
+    {
+      ezAtomicAdd(&job->failed, 1);
+    }
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  BatchJob job;
+  float tx = 0, ty = 0, rotate = 0, scale = 1, kx = 0, ky = 0;
+  int threads = 0, i;
+  double start;
+  struct stat info;
+
+  memset(&job, 0, sizeof(job));
+  job.mipmaps = 1;
+  job.version = 6;
+  job.files = malloc(sizeof(BatchFile) * (argc > 1 ? argc : 1));
+  if (job.files == NULL)
+  {
+    fprintf(stderr, "Error: Not enough memory\n");
+    return 1;
+  }
+
+  for (i = 1; i < argc; i++)
+  {
+    if (strcmp(argv[i], "-d") == 0 && i + 1 < argc)
+    {
+      job.outDir = argv[++i];
+    }
+    else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc)
+    {
+      threads = atoi(argv[++i]);
+    }
+    else if (strcmp(argv[i], "-p3") == 0)
+    {
+      job.version = 3;
+    }
+    else if (strcmp(argv[i], "-nomip") == 0)
+    {
+      job.mipmaps = 0;
+    }
+    else if (strcmp(argv[i], "-size") == 0 && i + 2 < argc)
+    {
+      job.ow = atoi(argv[++i]);
+      job.oh = atoi(argv[++i]);
+      job.transform = 1;
+    }
+    else if (strcmp(argv[i], "-t") == 0 && i + 2 < argc)
+    {
+      tx = (float) atof(argv[++i]);
+      ty = (float) atof(argv[++i]);
+      job.transform = 1;
+    }
+    else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc)
+    {
+      rotate = (float) (atof(argv[++i]) * 3.141592 / 180);
+      job.transform = 1;
+    }
+    else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc)
+    {
+      scale = (float) atof(argv[++i]);
+      job.transform = 1;
+    }
+    else if (strcmp(argv[i], "-k") == 0 && i + 2 < argc)
+    {
+      kx = (float) atof(argv[++i]);
+      ky = (float) atof(argv[++i]);
+      job.transform = 1;
+    }
+    else if (argv[i][0] == '-')
+    {
+      job.count = 0;
+      break;
+    }
+    else
+    {
+      job.files[job.count].path = argv[i];
+      job.files[job.count].size = batchSize(argv[i]);
+      job.count++;
+    }
+  }
+  if (job.outDir == NULL || job.count == 0)
+  {
+    fprintf(stderr, "Error: Usage ezbatch -d outDir [-j threads] "
+                    "[-size w h] [-t x y] [-r degrees] [-s scale] "
+                    "[-k x y] [-nomip] [-p3] input.ppm...\n");
+    return 1;
+  }
+
+  // outputs are named after the inputs' file names alone, so two inputs
+  // of the same name would be written to the same file at once
+  qsort(job.files, job.count, sizeof(BatchFile), batchCompareNames);
+  for (i = 1; i < job.count; i++)
+  {
+    if (batchCompareNames(&job.files[i - 1], &job.files[i]) == 0)
+    {
+      fprintf(stderr, "Error: %s and %s would both be written to %s/%s\n",
+              job.files[i - 1].path, job.files[i].path, job.outDir,
+              batchName(job.files[i].path));
+      free(job.files);
+      return 1;
+    }
+  }
+
+  if (stat(job.outDir, &info) != 0)
+  {
+#ifdef _WIN32
+    _mkdir(job.outDir);
+#else
+    mkdir(job.outDir, 0755);
+#endif
+  }
+  if (stat(job.outDir, &info) != 0 || !(info.st_mode & S_IFDIR))
+  {
+    fprintf(stderr, "Error: Could not create %s\n", job.outDir);
+    return 1;
+  }
+
+  // the same transform ezview -o renders
+  mat4x4_affine2d(job.mvp, tx, ty, rotate, scale, kx, ky);
+  qsort(job.files, job.count, sizeof(BatchFile), batchCompareSizes);
+
+  start = ezSeconds();
+  ezMemStart(0);
+  job.pool = ezPoolCreate(threads);
+  if (job.count == 1)
+  {
+    // a lone file spreads its rows over the pool instead
+    if (batchFile(&job, &job.files[0], job.pool))
+      job.failed++;
+  }
+  else
+  {
+    ezPoolFor(job.pool, job.count, 1, batchFiles, &job);
+  }
+  ezPoolDestroy(job.pool);
+
+  fprintf(stderr, "Converted %d of %d files, %.1f MiB in, %.1f MiB out, "
+                  "in %.2f s\n", job.count - (int) job.failed, job.count,
+          job.bytesIn / 1024.0, job.bytesOut / 1024.0, ezSeconds() - start);
+  {
+    char text[256];
+    if (ezMemStatsText(text, sizeof(text)))
+      fprintf(stderr, "Memory: %s\n", text);
+  }
+  ezMemStop();
+  free(job.files);
+  return job.failed != 0;
+}
@@ -0,0 +1,517 @@
+#ifndef EZMEM
+#define EZMEM
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/mman.h>
+#include <sys/resource.h>
+#endif
+
+#include "ezthread.h"
+
+// Memory for decoded images and scratch space. Image-sized buffers come
+// from a pool of size classes, four to every power of two, so a buffer freed
+// when the viewer pages on or a batch worker finishes a file is handed to
+// the next image of about the same size instead of going back to the heap.
+// Buffers of EZMEM_HUGE_MIN or more are mapped on their own, on huge pages
+// where the system has them: reserved ones (MAP_HUGETLB) first, else a
+// 2 MiB aligned mapping marked for transparent huge pages, which cuts the
+// page faults and TLB misses of walking a large raster. An ezArena hands out
+// scratch memory for one job from a few pooled chunks and takes it all back
+// in O(1). There is one pool per program, and any thread may use it once
+// ezMemStart has run; before that buffers are allocated and freed directly.
+
+#define EZMEM_ALIGN       64          // buffers start on this boundary
+#define EZMEM_MIN_CLASS   12          // the smallest class is 2^12 bytes
+#define EZMEM_CLASSES     (4 * (48 - EZMEM_MIN_CLASS))
+#define EZMEM_HUGE_MIN    (2 << 20)   // buffers mapped on their own
+#define EZMEM_HUGE_PAGE   (2 << 20)
+#define EZMEM_ARENA_CHUNK (1 << 16)   // first chunk of an arena
+#define EZMEM_CACHE_CAP   (128 << 20) // default bytes of free buffers kept
+
+#define EZMEM_HEAP   0 // from malloc
+#define EZMEM_MAPPED 1 // mapped on its own, transparent huge pages if any
+#define EZMEM_HUGE   2 // mapped on reserved huge pages
+
+// Sits in the EZMEM_ALIGN bytes in front of every buffer.
+typedef struct ezBuffer {
+  struct ezBuffer *next;  // in its class's free list
+  void   *base;           // start of the allocation
+  size_t  size;           // usable bytes, the class size
+  size_t  mapped;         // bytes of the allocation
+  int     kind;           // EZMEM_HEAP, EZMEM_MAPPED or EZMEM_HUGE
+  int     sizeClass;
+  long    epoch;          // pool start it is counted in use by, 0 for none
+} ezBuffer;
+
+typedef char ezBufferFits[sizeof(ezBuffer) <= EZMEM_ALIGN ? 1 : -1];
+
+typedef struct ezMem {
+  int       started;
+  long      epoch;        // ezMemStart calls so far
+  ezMutex   lock;
+  ezBuffer *free[EZMEM_CLASSES];
+  size_t    cap;          // bytes of free buffers kept at most
+  size_t    cached;       // bytes in the free lists
+  size_t    inUse, peakInUse;
+  long      hits, misses; // allocations served from the free lists or not
+  long      huge;         // buffers mapped on reserved huge pages
+} ezMem;
+
+static ezMem ezmem;
+
+// A chunk of an arena, its memory follows EZMEM_ALIGN bytes in.
+typedef struct ezArenaChunk {
+  struct ezArenaChunk *next;
+  size_t size;
+} ezArenaChunk;
+
+// Bump allocator for the scratch memory of one job.
+typedef struct ezArena {
+  ezArenaChunk *first, *current;
+  size_t used;            // bytes of current handed out
+} ezArena;
+
+typedef struct ezMemStats {
+  size_t peakRss;         // bytes, 0 when the system doesn't say
+  long   faults;          // page faults of the process so far
+  long   majorFaults;     //   those that went to the disk, -1 if unknown
+  size_t inUse, peakInUse, cached;
+  long   hits, misses, huge;
+} ezMemStats;
+
+/* Function Prototypes */
+static inline  void   ezMemStart(size_t cap);
+static inline  void   ezMemStop(void);
+static inline  void  *ezBufferAlloc(size_t size);
+static inline  void   ezBufferFree(void *buffer);
+static inline  void   ezBufferTrim(void);
+static inline  void   ezArenaInit(ezArena *arena);
+static inline  void  *ezArenaAlloc(ezArena *arena, size_t size);
+static inline  void   ezArenaReset(ezArena *arena);
+static inline  void   ezArenaFree(ezArena *arena);
+static inline  void   ezMemGetStats(ezMemStats *stats);
+static inline  int    ezMemStatsText(char *text, size_t size);
+
+// start pooling, keeping up to cap bytes of free buffers (0 for the
+// default)
+static inline void ezMemStart(size_t cap)
+{
+  long epoch = ezmem.epoch + 1;
+
+  memset(&ezmem, 0, sizeof(ezMem));
+  ezmem.epoch = epoch;
+  ezMutexInit(&ezmem.lock);
+  ezmem.cap = cap > 0 ? cap : EZMEM_CACHE_CAP;
+  ezmem.started = 1;
+}
+
+// give the free buffers back, buffers still in use are freed directly
+static inline void ezMemStop(void)
+{
+  if (!ezmem.started)
+  {
+    return;
+  }
+  ezBufferTrim();
+  ezmem.started = 0;
+  ezMutexDestroy(&ezmem.lock);
+}
+
+// the smallest class holding size bytes
+static inline int ezMemClass(size_t size)
+{
+  size_t quarter;
+  int k = EZMEM_MIN_CLASS, n;
+
+  if (size <= ((size_t) 1 << EZMEM_MIN_CLASS))
+  {
+    return 0;
+  }
+  // 2^k < size <= 2^(k+1), in quarters of 2^k
+  while (((size - 1) >> (k + 1)) != 0)
+  {
+    k++;
+  }
+  quarter = (size_t) 1 << (k - 2);
+  n = (int) ((size + quarter - 1) / quarter);
+  return n == 8 ? 4 * (k + 1 - EZMEM_MIN_CLASS) :
+                  4 * (k - EZMEM_MIN_CLASS) + n - 4;
+}
+
+static inline size_t ezMemClassSize(int sizeClass)
+{
+  return ((size_t) 1 << (EZMEM_MIN_CLASS + sizeClass / 4)) *
+         (4 + sizeClass % 4) / 4;
+}
+
+// map size bytes (a multiple of EZMEM_HUGE_PAGE) on huge pages if the
+// system lets us, returns NULL when out of memory
+static inline void *ezMemMap(size_t size, int *kind)
+{
+#ifdef _WIN32
+  // large pages need SeLockMemoryPrivilege, which the viewer doesn't ask
+  // for, so these are ordinary pages
+  *kind = EZMEM_MAPPED;
+  return VirtualAlloc(NULL, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+#else
+  unsigned char *p, *aligned;
+  size_t head;
+
+#ifdef MAP_HUGETLB
+  p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+           MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  if (p != MAP_FAILED)
+  {
+    *kind = EZMEM_HUGE;
+    return p;
+  }
+#endif
+  // no reserved huge pages, line the mapping up on a huge page boundary so
+  // the kernel can back it with transparent ones
+  p = mmap(NULL, size + EZMEM_HUGE_PAGE, PROT_READ | PROT_WRITE,
+           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED)
+  {
+    return NULL;
+  }
+  aligned = (unsigned char *) (((size_t) p + EZMEM_HUGE_PAGE - 1) &
+                               ~(size_t) (EZMEM_HUGE_PAGE - 1));
+  head = (size_t) (aligned - p);
+  if (head > 0)
+  {
+    munmap(p, head);
+  }
+  if (EZMEM_HUGE_PAGE - head > 0)
+  {
+    munmap(aligned + size, EZMEM_HUGE_PAGE - head);
+  }
+#ifdef MADV_HUGEPAGE
+  madvise(aligned, size, MADV_HUGEPAGE);
+#endif
+  *kind = EZMEM_MAPPED;
+  return aligned;
+#endif
+}
+
+static inline ezBuffer *ezBufferNew(int sizeClass)
+{
+  size_t size = ezMemClassSize(sizeClass);
+  ezBuffer *buffer;
+  unsigned char *base;
+  size_t mapped;
+  int kind = EZMEM_HEAP;
+
+  if (size >= EZMEM_HUGE_MIN)
+  {
+    mapped = (size + EZMEM_ALIGN + EZMEM_HUGE_PAGE - 1) &
+             ~(size_t) (EZMEM_HUGE_PAGE - 1);
+    base = (unsigned char *) ezMemMap(mapped, &kind);
+    buffer = (ezBuffer *) base;
+  }
+  else
+  {
+    mapped = size + 2 * EZMEM_ALIGN;
+    base = (unsigned char *) malloc(mapped);
+    buffer = (ezBuffer *) (((size_t) base + EZMEM_ALIGN - 1) &
+                           ~(size_t) (EZMEM_ALIGN - 1));
+  }
+  if (base == NULL)
+  {
+    return NULL;
+  }
+  buffer->next = NULL;
+  buffer->base = base;
+  buffer->size = size;
+  buffer->mapped = mapped;
+  buffer->kind = kind;
+  buffer->sizeClass = sizeClass;
+  return buffer;
+}
+
+static inline void ezBufferRelease(ezBuffer *buffer)
+{
+  if (buffer->kind == EZMEM_HEAP)
+  {
+    free(buffer->base);
+    return;
+  }
+#ifdef _WIN32
+  VirtualFree(buffer->base, 0, MEM_RELEASE);
+#else
+  munmap(buffer->base, buffer->mapped);
+#endif
+}
+
+// size bytes starting on an EZMEM_ALIGN boundary, free with ezBufferFree.
+// Returns NULL when out of memory.
+static inline void *ezBufferAlloc(size_t size)
+{
+  int sizeClass = ezMemClass(size > 0 ? size : 1);
+  ezBuffer *buffer = NULL;
+
+  if (sizeClass >= EZMEM_CLASSES)
+  {
+    return NULL;
+  }
+  if (ezmem.started)
+  {
+    ezMutexLock(&ezmem.lock);
+    buffer = ezmem.free[sizeClass];
+    if (buffer != NULL)
+    {
+      ezmem.free[sizeClass] = buffer->next;
+      ezmem.cached -= buffer->size;
+      ezmem.hits++;
+    }
+    else
+    {
+      ezmem.misses++;
+    }
+    ezMutexUnlock(&ezmem.lock);
+  }
+
+  if (buffer == NULL)
+  {
+    buffer = ezBufferNew(sizeClass);
+    if (buffer == NULL)
+    {
+      return NULL;
+    }
+  }
+
+  buffer->epoch = 0;
+  if (ezmem.started)
+  {
+    ezMutexLock(&ezmem.lock);
+    buffer->epoch = ezmem.epoch;
+    ezmem.inUse += buffer->size;
+    if (ezmem.inUse > ezmem.peakInUse)
+    {
+      ezmem.peakInUse = ezmem.inUse;
+    }
+    if (buffer->kind == EZMEM_HUGE)
+    {
+      ezmem.huge++;
+    }
+    ezMutexUnlock(&ezmem.lock);
+  }
+  return (unsigned char *) buffer + EZMEM_ALIGN;
+}
+
+// hand a buffer back to its class, or to the system once the pool holds
+// its cap
+static inline void ezBufferFree(void *memory)
+{
+  ezBuffer *buffer;
+
+  if (memory == NULL)
+  {
+    return;
+  }
+  buffer = (ezBuffer *) ((unsigned char *) memory - EZMEM_ALIGN);
+  if (ezmem.started)
+  {
+    int kept = 0;
+
+    ezMutexLock(&ezmem.lock);
+    // buffers from before this start were never counted
+    if (buffer->epoch == ezmem.epoch)
+    {
+      ezmem.inUse -= buffer->size;
+      if (buffer->kind == EZMEM_HUGE)
+      {
+        ezmem.huge--;
+      }
+      buffer->epoch = 0;
+    }
+    if (ezmem.cached + buffer->size <= ezmem.cap)
+    {
+      buffer->next = ezmem.free[buffer->sizeClass];
+      ezmem.free[buffer->sizeClass] = buffer;
+      ezmem.cached += buffer->size;
+      kept = 1;
+    }
+    ezMutexUnlock(&ezmem.lock);
+    if (kept)
+    {
+      return;
+    }
+  }
+  ezBufferRelease(buffer);
+}
+
+// give every free buffer back to the system
+static inline void ezBufferTrim(void)
+{
+  int i;
+
+  if (!ezmem.started)
+  {
+    return;
+  }
+  ezMutexLock(&ezmem.lock);
+  for (i = 0; i < EZMEM_CLASSES; i++)
+  {
+    while (ezmem.free[i] != NULL)
+    {
+      ezBuffer *buffer = ezmem.free[i];
+      ezmem.free[i] = buffer->next;
+      ezBufferRelease(buffer);
+    }
+  }
+  ezmem.cached = 0;
+  ezMutexUnlock(&ezmem.lock);
+}
+
+static inline void ezArenaInit(ezArena *arena)
+{
+  memset(arena, 0, sizeof(ezArena));
+}
+
+// size bytes on an EZMEM_ALIGN boundary, good until the arena is reset.
+// Returns NULL when out of memory.
+static inline void *ezArenaAlloc(ezArena *arena, size_t size)
+{
+  ezArenaChunk *chunk;
+  void *memory;
+
+  size = (size + EZMEM_ALIGN - 1) & ~(size_t) (EZMEM_ALIGN - 1);
+  // move on through the chunks kept from before the last reset
+  while (arena->current != NULL && arena->used + size > arena->current->size &&
+         arena->current->next != NULL)
+  {
+    arena->current = arena->current->next;
+    arena->used = 0;
+  }
+
+  if (arena->current == NULL || arena->used + size > arena->current->size)
+  {
+    size_t bytes = arena->current != NULL ? 2 * arena->current->size :
+                                            EZMEM_ARENA_CHUNK;
+    bytes = bytes < size ? size : bytes;
+    chunk = (ezArenaChunk *) ezBufferAlloc(bytes + EZMEM_ALIGN);
+    if (chunk == NULL)
+    {
+      return NULL;
+    }
+    chunk->next = NULL;
+    chunk->size = bytes;
+    if (arena->current != NULL)
+    {
+      arena->current->next = chunk;
+    }
+    else
+    {
+      arena->first = chunk;
+    }
+    arena->current = chunk;
+    arena->used = 0;
+  }
+
+  memory = (unsigned char *) arena->current + EZMEM_ALIGN + arena->used;
+  arena->used += size;
+  return memory;
+}
+
+// take back everything the arena handed out, keeping its chunks
+static inline void ezArenaReset(ezArena *arena)
+{
+  arena->current = arena->first;
+  arena->used = 0;
+}
+
+// give the arena's chunks back to the pool
+static inline void ezArenaFree(ezArena *arena)
+{
+  ezArenaChunk *chunk = arena->first;
+
+  while (chunk != NULL)
+  {
+    ezArenaChunk *next = chunk->next;
+    ezBufferFree(chunk);
+    chunk = next;
+  }
+  memset(arena, 0, sizeof(ezArena));
+}
+
+// the process's peak resident set and page faults, and the pool's counters
+static inline void ezMemGetStats(ezMemStats *stats)
+{
+  memset(stats, 0, sizeof(ezMemStats));
+  stats->majorFaults = -1;
+#ifdef _WIN32
+  {
+    PROCESS_MEMORY_COUNTERS counters;
+
+    // Windows counts soft and hard faults together
+    if (GetProcessMemoryInfo(GetCurrentProcess(), &counters,
+                             sizeof(counters)))
+    {
+      stats->peakRss = counters.PeakWorkingSetSize;
+      stats->faults = (long) counters.PageFaultCount;
+    }
+  }
+#else
+  {
+    struct rusage usage;
+
+    if (getrusage(RUSAGE_SELF, &usage) == 0)
+    {
+#ifdef __APPLE__
+      stats->peakRss = (size_t) usage.ru_maxrss;
+#else
+      stats->peakRss = (size_t) usage.ru_maxrss << 10;
+#endif
+      stats->faults = usage.ru_minflt + usage.ru_majflt;
+      stats->majorFaults = usage.ru_majflt;
+    }
+  }
+#endif
+
+  if (ezmem.started)
+  {
+    ezMutexLock(&ezmem.lock);
+    stats->inUse = ezmem.inUse;
+    stats->peakInUse = ezmem.peakInUse;
+    stats->cached = ezmem.cached;
+    stats->hits = ezmem.hits;
+    stats->misses = ezmem.misses;
+    stats->huge = ezmem.huge;
+    ezMutexUnlock(&ezmem.lock);
+  }
+}
+
+// one line of memory statistics for the stats view, returns the length
+static inline int ezMemStatsText(char *text, size_t size)
+{
+  ezMemStats stats;
+  int n;
+
+  ezMemGetStats(&stats);
+  n = snprintf(text, size, "peak rss %.1f MiB, %ld faults",
+               stats.peakRss / 1048576.0, stats.faults);
+  if (n >= 0 && (size_t) n < size && stats.majorFaults >= 0)
+  {
+    n += snprintf(text + n, size - n, " (%ld major)", stats.majorFaults);
+  }
+  if (n >= 0 && (size_t) n < size && ezmem.started)
+  {
+    n += snprintf(text + n, size - n, ", pool %.1f/%.1f MiB used/free, "
+                  "%ld hits/%ld misses", stats.inUse / 1048576.0,
+                  stats.cached / 1048576.0, stats.hits, stats.misses);
+  }
+  if (n >= 0 && (size_t) n < size && stats.huge > 0)
+  {
+    n += snprintf(text + n, size - n, ", %ld on huge pages", stats.huge);
+  }
+  return n < 0 ? 0 : n;
+}
+
+#endif
@@ -0,0 +1,183 @@
+#ifndef EZPOOL
+#define EZPOOL
+
+#include <stdlib.h>
+
+#include "ezthread.h"
+
+// Fixed set of worker threads for data-parallel loops. ezPoolFor splits an
+// index range into grains that the workers (and the calling thread) claim
+// one at a time with an atomic counter, so uneven rows balance out.
+
+typedef void (*ezTaskFunc)(void *ctx, int begin, int end);
+
+typedef struct ezPool {
+  ezThread  *threads;
+  int        count;       // worker threads, not counting the caller
+  ezMutex    lock;
+  ezCond     wake;        // a new job was posted, or quit
+  ezCond     done;        // the last worker left the job
+  ezTaskFunc func;
+  void      *ctx;
+  int        total, grain;
+  volatile long next;     // next index to hand out
+  long       generation;  // bumped for every job
+  int        busy;        // workers still inside the current job
+  int        quit;
+} ezPool;
+
+/* Function Prototypes */
+static inline  ezPool *ezPoolCreate(int threads);
+static inline  void    ezPoolFor(ezPool *pool, int total, int grain,
+                                   ezTaskFunc func, void *ctx);
+static inline  void    ezPoolDestroy(ezPool *pool);
+
+// claim grains of the current job until none are left
+static inline void ezPoolRun(ezPool *pool)
+{
+  long begin;
+
+  while ((begin = ezAtomicAdd(&pool->next, pool->grain)) < pool->total)
+  {
+    long end = begin + pool->grain;
+    pool->func(pool->ctx, (int) begin,
+               end < pool->total ? (int) end : pool->total);
+  }
+}
+
+static EZTHREAD_FUNC(ezPoolWorker, arg)
+{
+  ezPool *pool = (ezPool *) arg;
+  long seen = 0;
+
+  for (;;)
+  {
+    ezMutexLock(&pool->lock);
+    while (!pool->quit && pool->generation == seen)
+    {
+      ezCondWait(&pool->wake, &pool->lock);
+    }
+    if (pool->quit)
+    {
+      ezMutexUnlock(&pool->lock);
+      break;
+    }
+    seen = pool->generation;
+    ezMutexUnlock(&pool->lock);
+
+    ezPoolRun(pool);
+
+    ezMutexLock(&pool->lock);
+    if (--pool->busy == 0)
+    {
+      ezCondBroadcast(&pool->done);
+    }
+    ezMutexUnlock(&pool->lock);
+  }
+  return EZTHREAD_RETURN;
+}
+
+// start a pool, threads <= 0 means one thread per CPU. The calling thread
+// counts as one of them. Returns NULL when out of memory.
+static inline ezPool *ezPoolCreate(int threads)
+{
+  ezPool *pool = calloc(1, sizeof(ezPool));
+  int i;
+
+  if (pool == NULL)
+  {
+    return NULL;
+  }
+  if (threads <= 0)
+  {
+    threads = ezCpuCount();
+  }
+
+  ezMutexInit(&pool->lock);
+  ezCondInit(&pool->wake);
+  ezCondInit(&pool->done);
+
+  pool->threads = malloc(sizeof(ezThread) * threads);
+  if (pool->threads == NULL)
+  {
+    ezPoolDestroy(pool);
+    return NULL;
+  }
+  for (i = 0; i < threads - 1; i++)
+  {
+    if (ezThreadCreate(&pool->threads[i], ezPoolWorker, pool))
+    {
+      break; // run with the workers we got
+    }
+    pool->count++;
+  }
+  return pool;
+}
+
+// call func(ctx, begin, end) over [0, total) in grain sized pieces, spread
+// over the pool, and return once all of it has run. A NULL pool runs
+// everything on the calling thread.
+static inline void ezPoolFor(ezPool *pool, int total, int grain,
+                               ezTaskFunc func, void *ctx)
+{
+  if (grain < 1)
+  {
+    grain = 1;
+  }
+  if (pool == NULL || pool->count == 0 || total <= grain)
+  {
+    if (total > 0)
+    {
+      func(ctx, 0, total);
+    }
+    return;
+  }
+
+  ezMutexLock(&pool->lock);
+  pool->func = func;
+  pool->ctx = ctx;
+  pool->total = total;
+  pool->grain = grain;
+  ezAtomicStore(&pool->next, 0);
+  pool->busy = pool->count;
+  pool->generation++;
+  ezCondBroadcast(&pool->wake);
+  ezMutexUnlock(&pool->lock);
+
+  ezPoolRun(pool);
+
+  ezMutexLock(&pool->lock);
+  while (pool->busy > 0)
+  {
+    ezCondWait(&pool->done, &pool->lock);
+  }
+  ezMutexUnlock(&pool->lock);
+}
+
+static inline void ezPoolDestroy(ezPool *pool)
+{
+  int i;
+
+  if (pool == NULL)
+  {
+    return;
+  }
+
+  ezMutexLock(&pool->lock);
+  pool->quit = 1;
+  ezCondBroadcast(&pool->wake);
+  ezMutexUnlock(&pool->lock);
+
+  for (i = 0; i < pool->count; i++)
+  {
+    ezThreadJoin(pool->threads[i]);
+  }
+
+  ezCondDestroy(&pool->wake);
+  ezCondDestroy(&pool->done);
+  ezMutexDestroy(&pool->lock);
+  free(pool->threads);
+  free(pool);
+}
+
+#endif
@@ -0,0 +1,281 @@
+#ifndef EZTHREAD
+#define EZTHREAD
+
+// Thin portability layer over Win32 threads and pthreads.
+
+#ifdef _WIN32
+#include <windows.h>
+
+typedef HANDLE ezThread;
+typedef CRITICAL_SECTION ezMutex;
+typedef CONDITION_VARIABLE ezCond;
+#define EZTHREAD_FUNC(name, arg) DWORD WINAPI name(LPVOID arg)
+#define EZTHREAD_RETURN 0
+#else
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+
+typedef pthread_t ezThread;
+typedef pthread_mutex_t ezMutex;
+typedef pthread_cond_t ezCond;
+#define EZTHREAD_FUNC(name, arg) void *name(void *arg)
+#define EZTHREAD_RETURN NULL
+#endif
+
+#ifdef _WIN32
+typedef LPTHREAD_START_ROUTINE ezThreadFunc;
+#else
+typedef void *(*ezThreadFunc)(void *);
+#endif
+
+// Lets threads sleep until another thread changes something they watch,
+// such as a ring index. A waiter takes the count with ezSignalPeek, checks
+// its condition, and only then calls ezSignalWait, which returns at once if
+// there has been an ezSignalNotify since the peek. So a change made between
+// the check and the wait is never missed.
+typedef struct ezSignal {
+  ezMutex mutex;
+  ezCond  cond;
+  volatile long count;  // notifies so far
+} ezSignal;
+
+/* Function Prototypes */
+static inline  int    ezThreadCreate(ezThread *thread, ezThreadFunc func,
+                                       void *arg);
+static inline  void   ezThreadJoin(ezThread thread);
+static inline  int    ezCpuCount(void);
+static inline  void   ezSleepMs(int ms);
+static inline  double ezSeconds(void);
+static inline  unsigned long ezThreadId(void);
+static inline  long   ezAtomicLoad(volatile long *value);
+static inline  void   ezAtomicStore(volatile long *value, long to);
+static inline  long   ezAtomicAdd(volatile long *value, long by);
+static inline  void   ezMutexInit(ezMutex *mutex);
+static inline  void   ezMutexLock(ezMutex *mutex);
+static inline  void   ezMutexUnlock(ezMutex *mutex);
+static inline  void   ezMutexDestroy(ezMutex *mutex);
+static inline  void   ezCondInit(ezCond *cond);
+static inline  void   ezCondWait(ezCond *cond, ezMutex *mutex);
+static inline  void   ezCondBroadcast(ezCond *cond);
+static inline  void   ezCondDestroy(ezCond *cond);
+static inline  void   ezSignalInit(ezSignal *signal);
+static inline  long   ezSignalPeek(ezSignal *signal);
+static inline  void   ezSignalWait(ezSignal *signal, long seen);
+static inline  void   ezSignalNotify(ezSignal *signal);
+static inline  void   ezSignalDestroy(ezSignal *signal);
+
+// start func(arg) on a new thread, returns 1 on failure
+static inline int ezThreadCreate(ezThread *thread, ezThreadFunc func, void *arg)
+{
+#ifdef _WIN32
+  *thread = CreateThread(NULL, 0, func, arg, 0, NULL);
+  return *thread == NULL;
+#else
+  return pthread_create(thread, NULL, func, arg) != 0;
+#endif
+}
+
+static inline void ezThreadJoin(ezThread thread)
+{
+#ifdef _WIN32
+  WaitForSingleObject(thread, INFINITE);
+  CloseHandle(thread);
+#else
+  pthread_join(thread, NULL);
+#endif
+}
+
+// number of online processors, at least 1
+static inline int ezCpuCount(void)
+{
+#ifdef _WIN32
+  SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  return info.dwNumberOfProcessors > 0 ? (int) info.dwNumberOfProcessors : 1;
+#else
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return n > 0 ? (int) n : 1;
+#endif
+}
+
+static inline void ezSleepMs(int ms)
+{
+#ifdef _WIN32
+  Sleep(ms);
+#else
+  struct timespec ts;
+  ts.tv_sec = ms / 1000;
+  ts.tv_nsec = (ms % 1000) * 1000000L;
+  nanosleep(&ts, NULL);
+#endif
+}
+
+// monotonic clock in seconds, for timing
+static inline double ezSeconds(void)
+{
+#ifdef _WIN32
+  LARGE_INTEGER count, frequency;
+  QueryPerformanceCounter(&count);
+  QueryPerformanceFrequency(&frequency);
+  return (double) count.QuadPart / (double) frequency.QuadPart;
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+#endif
+}
+
+// number identifying the calling thread
+static inline unsigned long ezThreadId(void)
+{
+#ifdef _WIN32
+  return (unsigned long) GetCurrentThreadId();
+#else
+  return (unsigned long) pthread_self();
+#endif
+}
+
+// load with acquire ordering, pairs with ezAtomicStore
+static inline long ezAtomicLoad(volatile long *value)
+{
+#ifdef _WIN32
+  return InterlockedCompareExchange(value, 0, 0);
+#else
+  return __atomic_load_n(value, __ATOMIC_ACQUIRE);
+#endif
+}
+
+// store with release ordering, everything written before it is visible to
+// a thread that sees the new value
+static inline void ezAtomicStore(volatile long *value, long to)
+{
+#ifdef _WIN32
+  InterlockedExchange(value, to);
+#else
+  __atomic_store_n(value, to, __ATOMIC_RELEASE);
+#endif
+}
+
+// add by to value, returns what value held before
+static inline long ezAtomicAdd(volatile long *value, long by)
+{
+#ifdef _WIN32
+  return InterlockedExchangeAdd(value, by);
+#else
+  return __atomic_fetch_add(value, by, __ATOMIC_ACQ_REL);
+#endif
+}
+
+static inline void ezMutexInit(ezMutex *mutex)
+{
+#ifdef _WIN32
+  InitializeCriticalSection(mutex);
+#else
+  pthread_mutex_init(mutex, NULL);
+#endif
+}
+
+static inline void ezMutexLock(ezMutex *mutex)
+{
+#ifdef _WIN32
+  EnterCriticalSection(mutex);
+#else
+  pthread_mutex_lock(mutex);
+#endif
+}
+
+static inline void ezMutexUnlock(ezMutex *mutex)
+{
+#ifdef _WIN32
+  LeaveCriticalSection(mutex);
+#else
+  pthread_mutex_unlock(mutex);
+#endif
+}
+
+static inline void ezMutexDestroy(ezMutex *mutex)
+{
+#ifdef _WIN32
+  DeleteCriticalSection(mutex);
+#else
+  pthread_mutex_destroy(mutex);
+#endif
+}
+
+static inline void ezCondInit(ezCond *cond)
+{
+#ifdef _WIN32
+  InitializeConditionVariable(cond);
+#else
+  pthread_cond_init(cond, NULL);
+#endif
+}
+
+// wait on cond, mutex must be held and is held again on return
+static inline void ezCondWait(ezCond *cond, ezMutex *mutex)
+{
+#ifdef _WIN32
+  SleepConditionVariableCS(cond, mutex, INFINITE);
+#else
+  pthread_cond_wait(cond, mutex);
+#endif
+}
+
+static inline void ezCondBroadcast(ezCond *cond)
+{
+#ifdef _WIN32
+  WakeAllConditionVariable(cond);
+#else
+  pthread_cond_broadcast(cond);
+#endif
+}
+
+static inline void ezCondDestroy(ezCond *cond)
+{
+#ifdef _WIN32
+  (void) cond; // condition variables need no cleanup on Windows
+#else
+  pthread_cond_destroy(cond);
+#endif
+}
+
+static inline void ezSignalInit(ezSignal *signal)
+{
+  ezMutexInit(&signal->mutex);
+  ezCondInit(&signal->cond);
+  signal->count = 0;
+}
+
+static inline long ezSignalPeek(ezSignal *signal)
+{
+  return ezAtomicLoad(&signal->count);
+}
+
+// sleep until there has been an ezSignalNotify since the peek that gave seen
+static inline void ezSignalWait(ezSignal *signal, long seen)
+{
+  ezMutexLock(&signal->mutex);
+  while (signal->count == seen)
+  {
+    ezCondWait(&signal->cond, &signal->mutex);
+  }
+  ezMutexUnlock(&signal->mutex);
+}
+
+// wake every thread in ezSignalWait
+static inline void ezSignalNotify(ezSignal *signal)
+{
+  ezMutexLock(&signal->mutex);
+  ezAtomicAdd(&signal->count, 1);
+  ezCondBroadcast(&signal->cond);
+  ezMutexUnlock(&signal->mutex);
+}
+
+static inline void ezSignalDestroy(ezSignal *signal)
+{
+  ezCondDestroy(&signal->cond);
+  ezMutexDestroy(&signal->mutex);
+}
+
+#endif
@@ -2,10 +2,21 @@
 
 #define GL_GLEXT_PROTOTYPES
 #include <GLES2/gl2.h>
+#include <GLES2/gl2ext.h>
 #include <GLFW/glfw3.h>
 
 #include "linmath.h"
 #include "ppmr.h"
+#include "tilecache.h"
+#include "bandqueue.h"
+#include "warp.h"
+#include "session.h"
+#include "playback.h"
+#include "trace.h"
+#include "diskcache.h"
+#include "mipmap.h"
+#include "ezmem.h"
+#include "motion.h"
 
 #include <stdlib.h>
 #include <stdio.h>
@@ -16,13 +27,6 @@ typedef struct {
   float TexCoord[2];
 } Vertex;
 
-typedef struct {
-  float scale;
-  float rotate;
-  float translate[2]; // 0 -> x, 1 -> y
-  float shear[2];     // 0 -> x, 1 -> y
-} transvals;
-
 // (-1, 1)  (1, 1)
 // (-1, -1) (1, -1)
 const GLubyte Indices[] = {
@@ -30,7 +34,14 @@ const GLubyte Indices[] = {
   2, 3, 0
 };
 
-transvals *trans;
+transvals trans[1];
+Motion motion; // eases trans toward where input sends it
+int dirty = 1; // the frame on screen is out of date
+int page = 0;  // images to page forward (or back) in a session
+
+#define BAND_BYTES  (1 << 20)   // decoded rows held while streaming a texture
+#define GPU_QUERIES 4           // draw timings in flight on the GPU
+#define TILE_BUDGET (256 << 20) // default tile texture budget, see -b
 
 Vertex vertexes[] = {
   {{1, -1}, {0.99999, 0.99999}},
@@ -63,51 +74,449 @@ static void error_callback(int error, const char* description)
     fprintf(stderr, "Error: %s\n", description);
 }
 
+// the control a key moves while held, -1 for none
+static int keyControl(int key)
+{
+    switch (key)
+    {
+      case GLFW_KEY_W:     return MOTION_UP;
+      case GLFW_KEY_A:     return MOTION_LEFT;
+      case GLFW_KEY_S:     return MOTION_DOWN;
+      case GLFW_KEY_D:     return MOTION_RIGHT;
+      case GLFW_KEY_R:     return MOTION_ZOOM_IN;
+      case GLFW_KEY_F:     return MOTION_ZOOM_OUT;
+      case GLFW_KEY_UP:    return MOTION_SHEAR_UP;
+      case GLFW_KEY_DOWN:  return MOTION_SHEAR_DOWN;
+      case GLFW_KEY_LEFT:  return MOTION_SHEAR_LEFT;
+      case GLFW_KEY_RIGHT: return MOTION_SHEAR_RIGHT;
+    }
+    return -1;
+}
+
 static void key_callback(GLFWwindow* window, int key, int scancode, int action, int mods)
 {
+    int control = keyControl(key);
+
     if (key == GLFW_KEY_ESCAPE && action == GLFW_PRESS)
         glfwSetWindowShouldClose(window, GLFW_TRUE);
 
-    //Translation
-    if (key == GLFW_KEY_W && action == GLFW_PRESS)
-      trans[0].translate[1] += 0.1;
+    // Translate, scale and shear, moving on while the key is held
+    if (control >= 0 && action != GLFW_REPEAT)
+      motionKey(&motion, control, action == GLFW_PRESS);
 
-    if (key == GLFW_KEY_A && action == GLFW_PRESS)
-    	trans[0].translate[0] -= 0.1;
+    // Rotate a quarter turn, again on every key repeat
+    if (key == GLFW_KEY_Q && action != GLFW_RELEASE)
+      motionTurn(&motion, 1);
 
-    if (key == GLFW_KEY_S && action == GLFW_PRESS)
-      trans[0].translate[1] -= 0.1;
+    if (key == GLFW_KEY_E && action != GLFW_RELEASE)
+      motionTurn(&motion, -1);
 
-    if (key == GLFW_KEY_D && action == GLFW_PRESS)
-      trans[0].translate[0] += 0.1;
+    // Page through a session
+    if ((key == GLFW_KEY_N || key == GLFW_KEY_PAGE_DOWN) &&
+        action != GLFW_RELEASE)
+      page++;
 
-    // Scale
-    if (key == GLFW_KEY_R && action == GLFW_PRESS)
-      trans[0].scale *= 1.1;
+    if ((key == GLFW_KEY_P || key == GLFW_KEY_PAGE_UP) &&
+        action != GLFW_RELEASE)
+      page--;
 
-    if (key == GLFW_KEY_F && action == GLFW_PRESS)
-    	trans[0].scale /= 1.1;
+    if (action == GLFW_PRESS)
+      dirty = 1;
+}
 
-    // Rotate Left
-    if (key == GLFW_KEY_Q && action == GLFW_PRESS)
-      trans[0].rotate += (90 * 3.141592) / 180;
+// a cursor position in the window to normalized device coordinates
+static void cursorNdc(GLFWwindow* window, double x, double y, double ndc[2])
+{
+    int width, height;
 
-    if (key == GLFW_KEY_E && action == GLFW_PRESS)
-      trans[0].rotate -= (90 * 3.141592) / 180;
+    glfwGetWindowSize(window, &width, &height);
+    ndc[0] = width > 0 ? 2 * x / width - 1 : 0;
+    ndc[1] = height > 0 ? 1 - 2 * y / height : 0;
+}
 
-    // Shear
-    if (key == GLFW_KEY_UP && action == GLFW_PRESS)
-    	trans[0].shear[1] += 0.1;
+// Drag with the left button to pan
+static void mouse_button_callback(GLFWwindow* window, int button, int action, int mods)
+{
+    double x, y, ndc[2];
+
+    if (button != GLFW_MOUSE_BUTTON_LEFT)
+      return;
 
-    if (key == GLFW_KEY_DOWN && action == GLFW_PRESS)
-    	trans[0].shear[1] -= 0.1;
+    glfwGetCursorPos(window, &x, &y);
+    cursorNdc(window, x, y, ndc);
+    motionGrab(&motion, &trans[0], ndc[0], ndc[1], action == GLFW_PRESS,
+               glfwGetTime());
+    dirty = 1;
+}
 
-    if (key == GLFW_KEY_LEFT && action == GLFW_PRESS)
-    	trans[0].shear[0] -= 0.1;
+static void cursor_position_callback(GLFWwindow* window, double x, double y)
+{
+    double ndc[2];
+
+    if (!motion.dragging)
+      return;
+
+    cursorNdc(window, x, y, ndc);
+    motionDrag(&motion, &trans[0], ndc[0], ndc[1], glfwGetTime());
+    dirty = 1;
+}
+
+// Scroll to zoom about the cursor
+static void scroll_callback(GLFWwindow* window, double xoffset, double yoffset)
+{
+    double x, y, ndc[2];
+
+    glfwGetCursorPos(window, &x, &y);
+    cursorNdc(window, x, y, ndc);
+    motionZoom(&motion, ndc[0], ndc[1], yoffset);
+    dirty = 1;
+}
+
+static void framebuffer_size_callback(GLFWwindow* window, int width, int height)
+{
+    dirty = 1;
+}
+
+static void refresh_callback(GLFWwindow* window)
+{
+    dirty = 1;
+}
 
-    if (key == GLFW_KEY_RIGHT && action == GLFW_PRESS)
-      trans[0].shear[0] += 0.1;
+// Compose the MVP for a set of transform values
+// translate * rotate * scale * shear, composed in closed form
+static void buildMvp(mat4x4 mvp, transvals *t)
+{
+    mat4x4_affine2d(mvp, t->translate[0], t->translate[1], t->rotate,
+                    t->scale, t->shear[0], t->shear[1]);
+}
+
+// GPU time of the draw calls through GL_EXT_disjoint_timer_query. Results
+// come back a few frames late, so queries go round a small ring.
+static PFNGLGENQUERIESEXTPROC gpuGenQueries;
+static PFNGLBEGINQUERYEXTPROC gpuBeginQuery;
+static PFNGLENDQUERYEXTPROC gpuEndQuery;
+static PFNGLGETQUERYOBJECTUIVEXTPROC gpuQueryAvailable;
+static PFNGLGETQUERYOBJECTUI64VEXTPROC gpuQueryResult;
+static GLuint gpuQueries[GPU_QUERIES];
+static double gpuIssued[GPU_QUERIES]; // CPU time each query began
+static int gpuHead = 0, gpuTail = 0;  // queries issued and collected
+
+static void gpuTimerInit(void)
+{
+    if (!glfwExtensionSupported("GL_EXT_disjoint_timer_query"))
+      return;
+
+    gpuGenQueries = (PFNGLGENQUERIESEXTPROC)
+        glfwGetProcAddress("glGenQueriesEXT");
+    gpuBeginQuery = (PFNGLBEGINQUERYEXTPROC)
+        glfwGetProcAddress("glBeginQueryEXT");
+    gpuEndQuery = (PFNGLENDQUERYEXTPROC) glfwGetProcAddress("glEndQueryEXT");
+    gpuQueryAvailable = (PFNGLGETQUERYOBJECTUIVEXTPROC)
+        glfwGetProcAddress("glGetQueryObjectuivEXT");
+    gpuQueryResult = (PFNGLGETQUERYOBJECTUI64VEXTPROC)
+        glfwGetProcAddress("glGetQueryObjectui64vEXT");
+    if (gpuGenQueries == NULL || gpuBeginQuery == NULL ||
+        gpuEndQuery == NULL || gpuQueryAvailable == NULL ||
+        gpuQueryResult == NULL)
+    {
+      gpuGenQueries = NULL;
+      return;
+    }
+    gpuGenQueries(GPU_QUERIES, gpuQueries);
+}
+
+// start timing, returns 0 when there is no timer or the ring is full
+static int gpuTimerBegin(void)
+{
+    if (gpuGenQueries == NULL || !tracer.enabled ||
+        gpuHead - gpuTail == GPU_QUERIES)
+      return 0;
+
+    gpuIssued[gpuHead % GPU_QUERIES] = ezSeconds();
+    gpuBeginQuery(GL_TIME_ELAPSED_EXT, gpuQueries[gpuHead % GPU_QUERIES]);
+    return 1;
+}
+
+static void gpuTimerEnd(void)
+{
+    gpuEndQuery(GL_TIME_ELAPSED_EXT);
+    gpuHead++;
+}
+
+// hand the finished timings to the tracer, dropping any the driver marks
+// as disjoint (clock changes, power states)
+static void gpuTimerCollect(void)
+{
+    GLint disjoint = 0;
+
+    if (gpuGenQueries == NULL)
+      return;
+
+    glGetIntegerv(GL_GPU_DISJOINT_EXT, &disjoint);
+    while (gpuTail != gpuHead)
+    {
+      GLuint query = gpuQueries[gpuTail % GPU_QUERIES], available = 0;
+      GLuint64 elapsed;
+
+      gpuQueryAvailable(query, GL_QUERY_RESULT_AVAILABLE_EXT, &available);
+      if (!available)
+        break;
+      gpuQueryResult(query, GL_QUERY_RESULT_EXT, &elapsed);
+      if (!disjoint)
+        traceAdd("gpu draw", gpuIssued[gpuTail % GPU_QUERIES], elapsed * 1e-9);
+      gpuTail++;
+    }
+}
+
+// Draw the image with the current transform and present it. Returns 1 when
+// a tiled image still has tiles to upload.
+static int drawFrame(GLFWwindow* window, GLuint program, GLint mvp_location,
+                     TileCache *tiles)
+{
+    int pending = 0, timed;
+    float ratio;
+    int width, height;
+    mat4x4 mvp;
+    double frame = traceBegin(), start;
+
+    glfwGetFramebufferSize(window, &width, &height);
+    ratio = width / (float) height;
+
+    glViewport(0, 0, width, height);
+    glClear(GL_COLOR_BUFFER_BIT);
+//DO STUFFS
+    start = traceBegin();
+    buildMvp(mvp, &trans[0]);
+    traceEnd("build mvp", start);
+
+    start = traceBegin();
+    timed = gpuTimerBegin();
+    glUseProgram(program);
+    if (tiles != NULL)
+    {
+      pending = tileCacheDraw(tiles, mvp, mvp_location, width, height);
+    }
+    else
+    {
+      glUniformMatrix4fv(mvp_location, 1, GL_FALSE, (const GLfloat*) mvp);
+      //glDrawArrays(GL_TRIANGLES, 0, 3);
+
+      glDrawElements(GL_TRIANGLES,
+                     sizeof(Indices) / sizeof(GLubyte),
+                     GL_UNSIGNED_BYTE, 0);
+    }
+    if (timed)
+      gpuTimerEnd();
+    traceEnd("draw", start);
+
+    start = traceBegin();
+    glfwSwapBuffers(window);
+    traceEnd("swap", start);
+    traceEnd("frame", frame);
+    gpuTimerCollect();
+    return pending;
+}
+
+// Upload the bands the decoder has finished into the bound texture, and
+// copy their RGB rows into keep when it isn't NULL. Returns 0 once the
+// whole image is in.
+static int uploadBands(BandQueue *queue, int iw, Pixel *keep)
+{
+    Band *band;
+    int half = queue->layout == LAYOUT_RGB_HALF;
+    GLenum format = half ? GL_RGB :
+                    queue->layout == LAYOUT_GRAY ? GL_LUMINANCE : GL_RGBA;
+
+    while ((band = bandQueuePeek(queue)) != NULL)
+    {
+      double start = traceBegin();
+      glTexSubImage2D(GL_TEXTURE_2D, 0, 0, band->firstRow, iw, band->rows,
+                      format, half ? GL_HALF_FLOAT_OES : GL_UNSIGNED_BYTE, band->data);
+      traceEnd("upload band", start);
+      if (keep != NULL)
+        memcpy(keep + (size_t) band->firstRow * iw, band->pixels,
+               sizeof(Pixel) * (size_t) band->rows * iw);
+      bandQueuePop(queue);
+      dirty = 1;
+    }
+
+    switch (bandQueueState(queue))
+    {
+      case BAND_DECODING:
+        return 1;
+      case BAND_ERROR:
+        fprintf(stderr, "Error: Image data is truncated or corrupt\n");
+        return 0;
+    }
+    // the decoder may have published more bands before it finished
+    return bandQueuePeek(queue) != NULL;
+}
+
+// Build the image's mip chain on the CPU and upload levels 1 and up into the
+// bound texture in level 0's format (GL_RGB, GL_RGBA or GL_LUMINANCE), then
+// switch it to trilinear filtering. Out of memory it stays GL_LINEAR.
+static void uploadMipmaps(const Pixel *image, int iw, int ih, GLenum format)
+{
+    MipChain chain;
+    unsigned char *rows = NULL;
+    ezPool *pool = ezPoolCreate(0);
+    int level, failed;
+    double start = traceBegin();
+
+    failed = mipBuild(&chain, image, iw, ih, pool);
+    ezPoolDestroy(pool);
+    traceEnd("build mipmaps", start);
+    if (failed || chain.count < 2)
+    {
+      mipFree(&chain);
+      return;
+    }
+    if (format != GL_RGB)
+    {
+      rows = ezBufferAlloc(4 * (size_t) chain.levels[1].width *
+                    chain.levels[1].height);
+      if (rows == NULL)
+      {
+        mipFree(&chain);
+        return;
+      }
+    }
+
+    start = traceBegin();
+    for (level = 1; level < chain.count; level++)
+    {
+      const MipLevel *mip = &chain.levels[level];
+      if (format != GL_RGB)
+      {
+        if (format == GL_LUMINANCE)
+          pixelsToGray(mip->pixels, rows, (size_t) mip->width * mip->height);
+        else
+          pixelsToRGBX(mip->pixels, rows, (size_t) mip->width * mip->height);
+        glTexImage2D(GL_TEXTURE_2D, level, format, mip->width, mip->height,
+                     0, format, GL_UNSIGNED_BYTE, rows);
+      }
+      else
+        glTexImage2D(GL_TEXTURE_2D, level, GL_RGB, mip->width, mip->height,
+                     0, GL_RGB, GL_UNSIGNED_BYTE, mip->pixels);
+    }
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER,
+                    GL_LINEAR_MIPMAP_LINEAR);
+    traceEnd("upload mipmaps", start);
+    ezBufferFree(rows);
+    mipFree(&chain);
+}
+
+// Render the transformed image on the CPU and save it, no window needed.
+// An output size of 0 x 0 means the size of the input image.
+static int renderHeadless(const char *path, const char *outPath, int ow,
+                          int oh, int mipmaps)
+{
+    PpmReader reader;
+    Pixel *image = NULL, *frame = NULL;
+    mat4x4 mvp;
+    ezPool *pool = NULL;
+    FILE *fr, *fw;
+    int status = 1;
+    double start = traceBegin();
+
+    memset(&reader, 0, sizeof(reader));
+    fr = fopen(path, "rb");
+    if (fr == NULL)
+    {
+      fprintf(stderr, "%s\n", "Error: input file type not found.");
+      return 1;
+    }
+    if (ppmOpen(&reader, fr))
+    {
+      fprintf(stderr, "Error: Header parsing unsuccessful\n");
+      goto cleanup;
+    }
+    traceEnd("parse header", start);
+    if (ow <= 0 || oh <= 0)
+    {
+      ow = reader.width;
+      oh = reader.height;
+    }
+
+    image = ezBufferAlloc(sizeof(Pixel) * (size_t) reader.width *
+                          reader.height);
+    frame = ezBufferAlloc(sizeof(Pixel) * (size_t) ow * oh);
+    if (image == NULL || frame == NULL)
+    {
+      fprintf(stderr, "Error: Not enough memory for image\n");
+      goto cleanup;
+    }
+    start = traceBegin();
+    if (ppmReadRows(&reader, image, reader.height) != reader.height)
+    {
+      fprintf(stderr, "Error: Image data is truncated or corrupt\n");
+      goto cleanup;
+    }
+    traceEnd("decode raster", start);
+
+    buildMvp(mvp, &trans[0]);
+    pool = ezPoolCreate(0);
+
+    // zoomed out, the frame is filtered from the mipmaps like on the GPU
+    start = traceBegin();
+    if (warpRender(image, reader.width, reader.height, frame, ow, oh, mvp,
+                   mipmaps, pool))
+    {
+      fprintf(stderr, "Error: Not enough memory for image\n");
+      goto cleanup;
+    }
+    traceEnd("render frame", start);
+
+    start = traceBegin();
+    fw = fopen(outPath, "wb");
+    status = fw == NULL || writeP6(fw, frame, ow, oh);
+    if (fw != NULL && fclose(fw))
+      status = 1;
+    if (status)
+    {
+      fprintf(stderr, "Error: Could not write %s\n", outPath);
+      goto cleanup;
+    }
+    traceEnd("write frame", start);
+
+cleanup:
+    ezPoolDestroy(pool);
+    ezBufferFree(image);
+    ezBufferFree(frame);
+    ppmClose(&reader);
+    fclose(fr);
+    return status;
+}
+
+// Bring the current session image on screen once it is cached: bind its
+// texture, or build a tile cache over it when it is too big for one.
+// Returns the tile cache to draw with, or NULL.
+static TileCache *showSessionImage(GLFWwindow* window, Session *session,
+                                   SessionImage *image, TileCache *cache,
+                                   size_t budget)
+{
+    char title[300];
+
+    if (image->texture != 0)
+    {
+      glBindTexture(GL_TEXTURE_2D, image->texture);
+      cache = NULL;
+    }
+    else if (tileCacheInit(cache, image->pixels, image->width, image->height,
+                           session->maxTexture, budget))
+    {
+      fprintf(stderr, "Error: Not enough memory for image\n");
+      cache = NULL;
+    }
 
+    if (image->index > 0)
+      snprintf(title, sizeof(title), "EZVIEW - %s [%d] (%d/%d)", image->path,
+               image->index, session->current + 1, session->count);
+    else
+      snprintf(title, sizeof(title), "EZVIEW - %s (%d/%d)", image->path,
+               session->current + 1, session->count);
+    glfwSetWindowTitle(window, title);
+    return cache;
 }
 
 void glCompileShaderOrDie(GLuint shader) {
@@ -132,46 +541,222 @@ void glCompileShaderOrDie(GLuint shader) {
 int main(int argc, char *argv[])
 {
 
-  if (argc != 2)
+  const char *path = NULL, *outPath = NULL;
+  size_t budget = TILE_BUDGET, cacheBudget = SESSION_BUDGET;
+  double fps = 0, start;
+  const char *tracePath = NULL;
+  int stats = 0;
+  const char *cacheDir = NULL;
+  size_t cacheCap = DISKCACHE_CAP;
+  int useDisk = 1;
+  DiskCache disk;
+  int useMips = 1;
+  Session session;
+  int ow = 0, oh = 0;
+  int inputs = 0, multi;
+  int i;
+
+  memset(&session, 0, sizeof(session));
+
+  trans[0].translate[0] = 0.0;
+  trans[0].translate[1] = 0.0;
+  trans[0].shear[0] = 0.0;
+  trans[0].shear[1] = 0.0;
+  trans[0].rotate = 0.0;
+  trans[0].scale = 1.0;
+
+  for (i = 1; i < argc; i++)
   {
-    fprintf(stderr, "Error: Usage ezview input.ppm\n", argc);
+    if (strcmp(argv[i], "-b") == 0 && i + 1 < argc)
+    {
+      budget = (size_t) atoi(argv[++i]) << 20;
+    }
+    else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc)
+    {
+      cacheBudget = (size_t) atoi(argv[++i]) << 20;
+    }
+    else if (strcmp(argv[i], "-nomip") == 0)
+    {
+      useMips = 0;
+    }
+    else if (strcmp(argv[i], "-nocache") == 0)
+    {
+      useDisk = 0;
+    }
+    else if (strcmp(argv[i], "-cachedir") == 0 && i + 1 < argc)
+    {
+      cacheDir = argv[++i];
+    }
+    else if (strcmp(argv[i], "-cachecap") == 0 && i + 1 < argc)
+    {
+      cacheCap = (size_t) atoi(argv[++i]) << 20;
+    }
+    else if (strcmp(argv[i], "-stats") == 0)
+    {
+      stats = 1;
+    }
+    else if (strcmp(argv[i], "-trace") == 0 && i + 1 < argc)
+    {
+      tracePath = argv[++i];
+    }
+    else if (strcmp(argv[i], "-fps") == 0 && i + 1 < argc)
+    {
+      fps = atof(argv[++i]);
+    }
+    else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+    {
+      outPath = argv[++i];
+    }
+    else if (strcmp(argv[i], "-size") == 0 && i + 2 < argc)
+    {
+      ow = atoi(argv[++i]);
+      oh = atoi(argv[++i]);
+    }
+    else if (strcmp(argv[i], "-t") == 0 && i + 2 < argc)
+    {
+      trans[0].translate[0] = (float) atof(argv[++i]);
+      trans[0].translate[1] = (float) atof(argv[++i]);
+    }
+    else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc)
+    {
+      trans[0].rotate = (float) (atof(argv[++i]) * 3.141592 / 180);
+    }
+    else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc)
+    {
+      trans[0].scale = (float) atof(argv[++i]);
+    }
+    else if (strcmp(argv[i], "-k") == 0 && i + 2 < argc)
+    {
+      trans[0].shear[0] = (float) atof(argv[++i]);
+      trans[0].shear[1] = (float) atof(argv[++i]);
+    }
+    else
+    {
+      if (path == NULL)
+        path = argv[i];
+      inputs++;
+      if (sessionAddPath(&session, argv[i]))
+      {
+        fprintf(stderr, "Error: Could not list %s\n", argv[i]);
+        exit(1);
+      }
+    }
+  }
+  if (path == NULL || (outPath != NULL && inputs > 1))
+  {
+    fprintf(stderr, "Error: Usage ezview [-b tileBudgetMiB] [-c "
+                    "cacheBudgetMiB] [-nomip] [-nocache] [-cachedir dir] "
+                    "[-cachecap MiB] "
+                    "[-fps rate] [-stats] [-trace out.json] "
+                    "[-o out.ppm [-size w h]] [-t x y] [-r degrees] "
+                    "[-s scale] [-k x y] input.ppm...\n");
+    exit(1);
+  }
+
+  if (stats || tracePath != NULL)
+    traceStart(tracePath != NULL);
+
+  // Image buffers freed as the session pages on are kept for the next ones
+  ezMemStart(0);
+
+  // Batch mode: render the transformed frame to a file and quit
+  if (outPath != NULL)
+  {
+    char text[1024];
+    int status = renderHeadless(path, outPath, ow, oh, useMips);
+
+    if (stats && traceStats(text, sizeof(text)))
+      printf("%s\n", text);
+    if (stats && ezMemStatsText(text, sizeof(text)))
+      printf("%s\n", text);
+    if (tracePath != NULL && traceWrite(tracePath))
+      fprintf(stderr, "Error: Could not write %s\n", tracePath);
+    exit(status);
+  }
+
+  // Decoded text and odd-maxval images are kept on disk for the next run. An
+  // unusable cache directory only costs the speedup.
+  if (useDisk && diskCacheInit(&disk, cacheDir, cacheCap))
+  {
+    fprintf(stderr, "Warning: No image cache, could not create %s\n",
+            disk.dir[0] != '\0' ? disk.dir : "a cache directory");
+    useDisk = 0;
+  }
+  if (useDisk)
+    session.disk = &disk;
+
+  // Several files, a directory, or a multi-image file are paged through as
+  // a session
+  multi = inputs > 1 || session.count != 1 ||
+          strcmp(session.images[0].path, path) != 0;
+  if (!multi)
+    sessionStop(&session);
+  else if (session.count == 0)
+  {
+    fprintf(stderr, "Error: No PNM or PAM files in %s\n", path);
     exit(1);
   }
 
     GLFWwindow* window;
     GLuint vertex_buffer, vertex_shader, fragment_shader, program, index_buffer;
     GLint mvp_location, vpos_location, vcol_location;
-    Pixel *buffer;
-    int        iw, ih, cMax, version;
-
-    FILE* fr = fopen(argv[1], "r"); // File Read
-    //Check if input file exists
-    if(fr == NULL)
+    Pixel *buffer = NULL;
+    Pixel *keep = NULL; // rows streamed in, to go in the disk cache
+    int halfFloat;
+    int mipMode = MIP_NONE;
+    PixelMap map;
+    PpmReader reader;
+    TileCache cache, *tiles = NULL;
+    BandQueue queue;
+    int streaming = 0;
+    int moving = 0;    // the transform is still easing or coasting
+    GLint maxTexture;
+    int        iw = 0, ih = 0;
+    FILE* fr = NULL;
+    int shown = -1; // session image on screen
+    Playback play;
+    int playing = 0;
+    double lastStats = 0;
+    long reported = -1;
+
+    memset(&reader, 0, sizeof(reader));
+    memset(&map, 0, sizeof(map));
+    if (!multi)
+    {
+      fr = fopen(path, "rb"); // File Read
+      //Check if input file exists
+      if(fr == NULL)
+        {
+        fprintf(stderr, "%s\n", "Error: input file type not found.");
+        return(1);
+        }
+      start = traceBegin();
+      if(ppmOpen(&reader, fr))
       {
-      fprintf(stderr, "%s\n", "Error: input file type not found.");
-      return(1);
+        fprintf(stderr, "Error: Header parsing unsuccessful\n");
+        exit(1);
+      }
+      iw = reader.width;
+      ih = reader.height;
+      traceEnd("parse header", start);
+
+      // 8-bit RGB rasters (P6, or P7 of depth 3) are uploaded straight out
+      // of the page cache when possible, everything else is streamed into
+      // the texture a band at a time
+      start = traceBegin();
+      if ((reader.version == 6 ||
+           (reader.version == 7 && reader.depth == 3)) &&
+          reader.maxColor == 255 &&
+          !mapP6(fr, &map, &iw, &ih))
+      {
+        buffer = map.pixels;
+        traceEnd("map raster", start);
       }
-    if(parseH(fr,&iw,&ih,&cMax,&version))
-    {
-      fprintf(stderr, "Error: Header parsing unsuccessful\n", argc);
-      exit(1);
-    }
-
-    buffer = malloc(sizeof(Pixel) * iw * ih);
-
-    if (version == 3)
-    {
-      readP3(fr, buffer, &iw, &ih, &cMax);
-    }
-    else
-    {
-      readP6(fr, buffer, &iw, &ih, &cMax);
     }
-    fclose(fr);
-
 
     //GLFW SETUP
     glfwSetErrorCallback(error_callback);
+    memset(&queue, 0, sizeof(queue));
 
     if (!glfwInit()) {
       fprintf(stderr, "Could not initialize GLFW.\n");
@@ -193,9 +778,16 @@ int main(int argc, char *argv[])
     }
 
     glfwSetKeyCallback(window, key_callback);
+    glfwSetMouseButtonCallback(window, mouse_button_callback);
+    glfwSetCursorPosCallback(window, cursor_position_callback);
+    glfwSetScrollCallback(window, scroll_callback);
+    motionInit(&motion, &trans[0]);
+    glfwSetFramebufferSizeCallback(window, framebuffer_size_callback);
+    glfwSetWindowRefreshCallback(window, refresh_callback);
 
     glfwMakeContextCurrent(window);
     glfwSwapInterval(1);
+    gpuTimerInit();
 
     glGenBuffers(1, &vertex_buffer);
     glBindBuffer(GL_ARRAY_BUFFER, vertex_buffer);
@@ -242,70 +834,289 @@ int main(int argc, char *argv[])
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, iw, ih, 0, GL_RGB,
-		 GL_UNSIGNED_BYTE, buffer);
-
     glActiveTexture(GL_TEXTURE0);
     glBindTexture(GL_TEXTURE_2D, texID);
     glUniform1i(tex_location, 0);
 
 
-    trans =(transvals *) malloc(sizeof(transvals));
-    trans[0].translate[0] = 0.0;
-    trans[0].translate[1] = 0.0;
-    trans[0].shear[0] = 0.0;
-    trans[0].shear[1] = 0.0;
-    trans[0].rotate = 0.0;
-    trans[0].scale = 1.0;
-
-    while (!glfwWindowShouldClose(window))
-    {
-        float ratio;
-        int width, height;
-        mat4x4 translate, rotate, scale, shear, mvp;
-
-        glfwGetFramebufferSize(window, &width, &height);
-        ratio = width / (float) height;
-
-        glViewport(0, 0, width, height);
-        glClear(GL_COLOR_BUFFER_BIT);
-//DO STUFFS
-        // Set the Transformation matrices
-        mat4x4_identity(translate);
-        mat4x4_translate(translate, trans[0].translate[0], trans[0].translate[1], 0);
-
-        mat4x4_identity(rotate);
-        mat4x4_rotate_Z(rotate, rotate, trans[0].rotate);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1); // Pixel rows are tightly packed
 
-        mat4x4_identity(scale);
-        scale[0][0] = scale[0][0] * trans[0].scale;
-        scale[1][1] = scale[1][1] * trans[0].scale;
+    // Images the driver can't hold as one texture, or that would blow the
+    // budget, are drawn from a tile pyramid instead
+    glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxTexture);
 
-        mat4x4_identity(shear);
-        shear[1][0] = trans[0].shear[0];
-        shear[0][1] = trans[0].shear[1];
+    // GLES2 has no 16-bit normalized textures, so 16-bit images keep their
+    // precision as half floats where the driver has them and are dithered
+    // to 8 bits otherwise
+    halfFloat = reader.maxColor > 255 &&
+                glfwExtensionSupported("GL_OES_texture_half_float") &&
+                glfwExtensionSupported("GL_OES_texture_half_float_linear");
 
-        mat4x4_mul(mvp,translate, rotate);
-        mat4x4_mul(mvp,mvp, scale);
-        mat4x4_mul(mvp,mvp, shear);
+    // Zoomed out images are filtered from mipmaps built on the CPU. Plain
+    // GLES2 only mipmaps power-of-two textures.
+    if (useMips)
+      mipMode = glfwExtensionSupported("GL_OES_texture_npot") ? MIP_ANY :
+                                                                MIP_POW2;
+    session.mipmaps = mipMode;
 
+    // an image decoded on an earlier run comes back out of the disk cache,
+    // unless it is about to be shown at more than 8 bits
+    if (!multi && buffer == NULL && useDisk && !halfFloat &&
+        diskCacheWorth(&reader))
+    {
+      int cw, ch;
+      start = traceBegin();
+      if (!diskCacheLoad(&disk, path, &map, &cw, &ch))
+      {
+        if (cw == iw && ch == ih)
+          buffer = map.pixels;
+        else
+          unmapP6(&map);
+      }
+      traceEnd("map cache", start);
+    }
 
+    if (multi)
+    {
+      // Images are decoded ahead on a worker thread and uploaded as they
+      // come in, see sessionUpdate
+      glDeleteTextures(1, &texID);
+      if (fps > 0)
+      {
+        // With a frame rate the images play as a looping flipbook, see
+        // playUpdate
+        if (playStart(&play, &session, fps, maxTexture, glfwPostEmptyEvent))
+        {
+          fprintf(stderr, "Error: Could not start decoding\n");
+          exit(1);
+        }
+        playing = 1;
+      }
+      else if (sessionStart(&session, cacheBudget, maxTexture,
+                            glfwPostEmptyEvent))
+      {
+        fprintf(stderr, "Error: Could not start decoding\n");
+        exit(1);
+      }
+    }
+    else if (iw > maxTexture || ih > maxTexture ||
+        (double) iw * ih * sizeof(Pixel) > (double) budget)
+    {
+      if (buffer == NULL)
+      {
+        buffer = ezBufferAlloc(sizeof(Pixel) * (size_t) iw * ih);
+        if (buffer == NULL)
+        {
+          fprintf(stderr, "Error: Not enough memory for image\n");
+          exit(1);
+        }
+        start = traceBegin();
+        if (ppmReadRows(&reader, buffer, ih) != ih)
+        {
+          fprintf(stderr, "Error: Image data is truncated or corrupt\n");
+          exit(1);
+        }
+        traceEnd("decode raster", start);
+        if (useDisk && diskCacheWorth(&reader))
+          diskCacheStore(&disk, path, buffer, iw, ih);
+      }
+      if (tileCacheInit(&cache, buffer, iw, ih, maxTexture, budget))
+      {
+        fprintf(stderr, "Error: Not enough memory for image\n");
+        exit(1);
+      }
+      tiles = &cache;
+      glDeleteTextures(1, &texID);
+    }
+    else if (buffer != NULL)
+    {
+      // gray images come back from the disk cache as RGB, they go up as
+      // GL_LUMINANCE at a third of the size
+      GLenum format = GL_RGB;
+      unsigned char *gray = NULL;
+
+      if (reader.depth < 3)
+        gray = ezBufferAlloc((size_t) iw * ih);
+      if (gray != NULL)
+      {
+        pixelsToGray(buffer, gray, (size_t) iw * ih);
+        format = GL_LUMINANCE;
+      }
+      start = traceBegin();
+      glTexImage2D(GL_TEXTURE_2D, 0, format, iw, ih, 0, format,
+		   GL_UNSIGNED_BYTE, gray != NULL ? (void *) gray : buffer);
+      traceEnd("upload texture", start);
+      ezBufferFree(gray);
+      if (mipAllowed(mipMode, iw, ih))
+        uploadMipmaps(buffer, iw, ih, format);
+      unmapP6(&map);
+    }
+    else
+    {
+      // Decode on a worker thread, the render loop uploads each band as it
+      // arrives so the image fills in from the top. The decoder widens the
+      // rows to RGBX, which drivers take without repacking, or narrows gray
+      // ones to a byte per pixel for GL_LUMINANCE.
+      PixelLayout layout = reader.depth < 3 ? LAYOUT_GRAY : LAYOUT_RGBX;
+      GLenum format = layout == LAYOUT_GRAY ? GL_LUMINANCE : GL_RGBA;
+
+      if (halfFloat)
+      {
+        layout = LAYOUT_RGB_HALF;
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, iw, ih, 0, GL_RGB,
+		     GL_HALF_FLOAT_OES, NULL);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 2);
+      }
+      else
+      {
+        glTexImage2D(GL_TEXTURE_2D, 0, format, iw, ih, 0, format,
+		     GL_UNSIGNED_BYTE, NULL);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, layout == LAYOUT_GRAY ? 1 : 4);
+        if ((useDisk && diskCacheWorth(&reader)) ||
+            mipAllowed(mipMode, iw, ih))
+          keep = ezBufferAlloc(sizeof(Pixel) * (size_t) iw * ih);
+      }
+      if (bandQueueStart(&queue, &reader, BAND_BYTES, layout,
+                         glfwPostEmptyEvent))
+      {
+        fprintf(stderr, "Error: Could not start decoding\n");
+        exit(1);
+      }
+      streaming = 1;
+    }
 
-        glUseProgram(program);
-        glUniformMatrix4fv(mvp_location, 1, GL_FALSE, (const GLfloat*) mvp);
-        //glDrawArrays(GL_TRIANGLES, 0, 3);
+    // Only redraw when something changed, otherwise sleep until an event
+    // (input, resize, or the decoder posting a band) comes in
+    while (!glfwWindowShouldClose(window))
+    {
+        if (streaming)
+        {
+          streaming = uploadBands(&queue, iw, keep);
+          if (!streaming && keep != NULL)
+          {
+            if (bandQueueState(&queue) == BAND_DONE)
+            {
+              if (useDisk && diskCacheWorth(&reader))
+                diskCacheStore(&disk, path, keep, iw, ih);
+              if (mipAllowed(mipMode, iw, ih))
+                uploadMipmaps(keep, iw, ih, queue.layout == LAYOUT_GRAY ?
+                                            GL_LUMINANCE : GL_RGBA);
+              dirty = 1;
+            }
+            ezBufferFree(keep);
+            keep = NULL;
+          }
+        }
+
+        if (playing)
+        {
+          if (playUpdate(&play, glfwGetTime()))
+            dirty = 1;
+
+          // keep the drop count in the title
+          if (play.dropped != reported)
+          {
+            char title[64];
+            snprintf(title, sizeof(title), "EZVIEW - %.4g fps, %ld dropped",
+                     fps, play.dropped);
+            glfwSetWindowTitle(window, title);
+            reported = play.dropped;
+          }
+        }
+        else if (multi)
+        {
+          SessionImage *image;
+
+          if (page != 0)
+          {
+            sessionShow(&session, session.current + page);
+            page = 0;
+          }
+          // the old image's tiles go before the cache can drop its pixels
+          if (shown != -1 && shown != session.current)
+          {
+            if (tiles != NULL)
+              tileCacheFree(tiles);
+            tiles = NULL;
+            glBindTexture(GL_TEXTURE_2D, 0);
+            shown = -1;
+            dirty = 1;
+          }
+          image = sessionUpdate(&session);
+          if (image != NULL && shown == -1)
+          {
+            tiles = showSessionImage(window, &session, image, &cache, budget);
+            shown = session.current;
+            dirty = 1;
+          }
+        }
+
+        // ease the transform by the time since the last frame
+        moving = motionStep(&motion, &trans[0], glfwGetTime());
+        if (moving)
+          dirty = 1;
+
+        if (dirty)
+          dirty = drawFrame(window, program, mvp_location, tiles);
+
+        // once a second, the mean/worst ms of every phase, then the peak
+        // RSS, page faults and buffer pool
+        if (stats && glfwGetTime() - lastStats >= 1)
+        {
+          char text[1024];
+          if (traceStats(text, sizeof(text)))
+          {
+            printf("%s\n", text);
+            glfwSetWindowTitle(window, text);
+            if (ezMemStatsText(text, sizeof(text)))
+              printf("%s\n", text);
+          }
+          lastStats = glfwGetTime();
+        }
+
+        if (dirty || moving)
+          glfwPollEvents();
+        else if (playing && playNextTime(&play) > glfwGetTime())
+          glfwWaitEventsTimeout(playNextTime(&play) - glfwGetTime());
+        else
+          glfwWaitEvents(); // a decoder posts an event for every frame
+    }
 
-        glDrawElements(GL_TRIANGLES,
-                       sizeof(Indices) / sizeof(GLubyte),
-                       GL_UNSIGNED_BYTE, 0);
+    bandQueueStop(&queue);
+    ezBufferFree(keep);
+    ppmClose(&reader);
+    if (fr != NULL)
+      fclose(fr);
 
-        glfwSwapBuffers(window);
-        glfwPollEvents();
+    if (playing)
+    {
+      playStop(&play);
+      printf("Played %ld frames, dropped %ld\n",
+             play.shown + 1 - play.dropped, play.dropped);
+    }
+    if (multi)
+    {
+      if (tiles != NULL)
+        tileCacheFree(tiles);
+      sessionStop(&session);
+    }
+    else if (tiles != NULL)
+    {
+      tileCacheFree(tiles);
+      if (map.base != NULL)
+        unmapP6(&map);
+      else
+        ezBufferFree(buffer);
     }
 
     glfwDestroyWindow(window);
 
     glfwTerminate();
+
+    if (tracePath != NULL && traceWrite(tracePath))
+      fprintf(stderr, "Error: Could not write %s\n", tracePath);
+    traceStop();
+    ezMemStop();
     exit(EXIT_SUCCESS);
 }
 
@@ -0,0 +1,113 @@
+#include "ppmr.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+
+// Fuzz target for the PNM/PAM reader. Each input is parsed once as a header
+// in memory with ppmParseHeader, then written to a temporary file and read
+// through a PpmReader, every image of a multi-image stream in turn, in
+// small bands as the viewer reads them. The last byte picks 8-bit rows or
+// 16-bit ones. A header the reader takes must parse the same in memory.
+//
+// With libFuzzer (make fuzz, or clang -fsanitize=fuzzer,address):
+//   ppmr_fuzz fuzz/corpus
+// Without it, building with PPMR_FUZZ_MAIN runs the target once over every
+// file named on the command line, to replay the corpus or a crash.
+
+#define FUZZ_IMAGES    16      // images of a stream read at most
+#define FUZZ_BAND      (1 << 16) // bytes of rows read at a time
+
+int LLVMFuzzerTestOneInput(const unsigned char *data, size_t size);
+
+// read what is left of the reader's image, returns 1 on bad data
+static int fuzzReadImage(PpmReader *reader, int wide)
+{
+  int bandRows = FUZZ_BAND / (6 * reader->width);
+  void *band;
+  int rows;
+
+  bandRows = bandRows < 1 ? 1 : bandRows;
+  band = malloc((size_t) 6 * reader->width * bandRows);
+  if (band == NULL)
+  {
+    return 1;
+  }
+  do
+  {
+    rows = wide ? ppmReadRows16(reader, (unsigned short *) band, bandRows) :
+                  ppmReadRows(reader, (Pixel *) band, bandRows);
+  } while (rows > 0);
+  free(band);
+  return rows < 0;
+}
+
+int LLVMFuzzerTestOneInput(const unsigned char *data, size_t size)
+{
+  PpmHeader header;
+  PpmReader reader;
+  size_t length = ppmParseHeader(data, size, &header);
+  int wide = size > 0 && (data[size - 1] & 1);
+  int images = 0;
+  FILE *in = tmpfile();
+
+  if (in == NULL)
+  {
+    return 0;
+  }
+  if (fwrite(data, 1, size, in) != size || fseek(in, 0, SEEK_SET) != 0)
+  {
+    fclose(in);
+    return 0;
+  }
+
+  if (!ppmOpen(&reader, in))
+  {
+    // the streaming and in-memory parsers must agree
+    if (length == 0 || header.width != reader.width ||
+        header.height != reader.height || header.version != reader.version)
+    {
+      abort();
+    }
+    do
+    {
+      if (fuzzReadImage(&reader, wide && reader.maxColor > 255))
+      {
+        break;
+      }
+    } while (++images < FUZZ_IMAGES && !ppmNextImage(&reader));
+  }
+  ppmClose(&reader);
+
+  rewind(in);
+  ppmCountImages(in);
+  fclose(in);
+  return 0;
+}
+
+#ifdef PPMR_FUZZ_MAIN
+int main(int argc, char *argv[])
+{
+  int i;
+
+  for (i = 1; i < argc; i++)
+  {
+    FILE *in = fopen(argv[i], "rb");
+    unsigned char *data = NULL;
+    long size;
+
+    if (in == NULL || fseek(in, 0, SEEK_END) != 0 || (size = ftell(in)) < 0 ||
+        fseek(in, 0, SEEK_SET) != 0 ||
+        (data = malloc(size > 0 ? size : 1)) == NULL ||
+        fread(data, 1, size, in) != (size_t) size)
+    {
+      fprintf(stderr, "Error: Could not read %s\n", argv[i]);
+      return 1;
+    }
+    fclose(in);
+    LLVMFuzzerTestOneInput(data, (size_t) size);
+    free(data);
+  }
+  printf("Ran %d inputs\n", argc - 1);
+  return 0;
+}
+#endif
@@ -7,6 +7,12 @@
 #define inline __inline
 #endif
 
+#if defined(__SSE__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define LINMATH_SSE
+#include <xmmintrin.h>
+#endif
+
 #define LINMATH_H_DEFINE_VEC(n) \
 typedef float vec##n[n]; \
 static inline void vec##n##_add(vec##n r, vec##n const a, vec##n const b) \
@@ -144,6 +150,19 @@ static inline void mat4x4_scale_aniso(mat4x4 M, mat4x4 a, float x, float y, floa
 }
 static inline void mat4x4_mul(mat4x4 M, mat4x4 a, mat4x4 b)
 {
+#ifdef LINMATH_SSE
+	/* column c of M is a's columns weighted by column c of b */
+	__m128 a0 = _mm_loadu_ps(a[0]), a1 = _mm_loadu_ps(a[1]);
+	__m128 a2 = _mm_loadu_ps(a[2]), a3 = _mm_loadu_ps(a[3]);
+	int c;
+	for(c=0; c<4; ++c) {
+		__m128 r = _mm_mul_ps(a0, _mm_set1_ps(b[c][0]));
+		r = _mm_add_ps(r, _mm_mul_ps(a1, _mm_set1_ps(b[c][1])));
+		r = _mm_add_ps(r, _mm_mul_ps(a2, _mm_set1_ps(b[c][2])));
+		r = _mm_add_ps(r, _mm_mul_ps(a3, _mm_set1_ps(b[c][3])));
+		_mm_storeu_ps(M[c], r);
+	}
+#else
 	mat4x4 temp;
 	int k, r, c;
 	for(c=0; c<4; ++c) for(r=0; r<4; ++r) {
@@ -152,15 +171,64 @@ static inline void mat4x4_mul(mat4x4 M, mat4x4 a, mat4x4 b)
 			temp[c][r] += a[k][r] * b[c][k];
 	}
 	mat4x4_dup(M, temp);
+#endif
 }
 static inline void mat4x4_mul_vec4(vec4 r, mat4x4 M, vec4 v)
 {
+#ifdef LINMATH_SSE
+	__m128 x = _mm_mul_ps(_mm_loadu_ps(M[0]), _mm_set1_ps(v[0]));
+	x = _mm_add_ps(x, _mm_mul_ps(_mm_loadu_ps(M[1]), _mm_set1_ps(v[1])));
+	x = _mm_add_ps(x, _mm_mul_ps(_mm_loadu_ps(M[2]), _mm_set1_ps(v[2])));
+	x = _mm_add_ps(x, _mm_mul_ps(_mm_loadu_ps(M[3]), _mm_set1_ps(v[3])));
+	_mm_storeu_ps(r, x);
+#else
 	int i, j;
 	for(j=0; j<4; ++j) {
 		r[j] = 0.f;
 		for(i=0; i<4; ++i)
 			r[j] += M[i][j] * v[i];
 	}
+#endif
+}
+/* R[i] = a * b[i] for n matrices, a composed onto each of b */
+static inline void mat4x4_mul_batch(mat4x4 *R, mat4x4 a, mat4x4 *b, int n)
+{
+#ifdef LINMATH_SSE
+	__m128 a0 = _mm_loadu_ps(a[0]), a1 = _mm_loadu_ps(a[1]);
+	__m128 a2 = _mm_loadu_ps(a[2]), a3 = _mm_loadu_ps(a[3]);
+	int i, c;
+	for(i=0; i<n; ++i) for(c=0; c<4; ++c) {
+		__m128 r = _mm_mul_ps(a0, _mm_set1_ps(b[i][c][0]));
+		r = _mm_add_ps(r, _mm_mul_ps(a1, _mm_set1_ps(b[i][c][1])));
+		r = _mm_add_ps(r, _mm_mul_ps(a2, _mm_set1_ps(b[i][c][2])));
+		r = _mm_add_ps(r, _mm_mul_ps(a3, _mm_set1_ps(b[i][c][3])));
+		_mm_storeu_ps(R[i][c], r);
+	}
+#else
+	int i;
+	for(i=0; i<n; ++i)
+		mat4x4_mul(R[i], a, b[i]);
+#endif
+}
+/* r[i] = M * v[i] for n vectors */
+static inline void mat4x4_mul_vec4_batch(vec4 *r, mat4x4 M, vec4 *v, int n)
+{
+#ifdef LINMATH_SSE
+	__m128 m0 = _mm_loadu_ps(M[0]), m1 = _mm_loadu_ps(M[1]);
+	__m128 m2 = _mm_loadu_ps(M[2]), m3 = _mm_loadu_ps(M[3]);
+	int i;
+	for(i=0; i<n; ++i) {
+		__m128 x = _mm_mul_ps(m0, _mm_set1_ps(v[i][0]));
+		x = _mm_add_ps(x, _mm_mul_ps(m1, _mm_set1_ps(v[i][1])));
+		x = _mm_add_ps(x, _mm_mul_ps(m2, _mm_set1_ps(v[i][2])));
+		x = _mm_add_ps(x, _mm_mul_ps(m3, _mm_set1_ps(v[i][3])));
+		_mm_storeu_ps(r[i], x);
+	}
+#else
+	int i;
+	for(i=0; i<n; ++i)
+		mat4x4_mul_vec4(r[i], M, v[i]);
+#endif
 }
 static inline void mat4x4_translate(mat4x4 T, float x, float y, float z)
 {
@@ -256,8 +324,79 @@ static inline void mat4x4_rotate_Z(mat4x4 Q, mat4x4 M, float angle)
 	};
 	mat4x4_mul(Q, M, R);
 }
+/* Translate(tx, ty) * rotate_Z(angle) * scale(k, k) * shear(kx, ky), where
+   the shear moves x by kx * y and y by ky * x, built in one go instead of
+   three matrix multiplies */
+static inline void mat4x4_affine2d(mat4x4 M, float tx, float ty, float angle, float k, float kx, float ky)
+{
+	float s = sinf(angle);
+	float c = cosf(angle);
+	mat4x4_identity(M);
+	M[0][0] = k * (c - s * ky);
+	M[0][1] = k * (s + c * ky);
+	M[1][0] = k * (c * kx - s);
+	M[1][1] = k * (s * kx + c);
+	M[3][0] = tx;
+	M[3][1] = ty;
+}
+#ifdef LINMATH_SSE
+#define LINMATH_SHUF(a, b, x, y, z, w) \
+	_mm_shuffle_ps(a, b, _MM_SHUFFLE(w, z, y, x))
+/* 2x2 blocks packed (m00 m01 m10 m11): A B, adj(A) B and A adj(B) */
+static inline __m128 mat2x2_mul_sse(__m128 a, __m128 b)
+{
+	return _mm_add_ps(_mm_mul_ps(a, LINMATH_SHUF(b, b, 0, 3, 0, 3)),
+		_mm_mul_ps(LINMATH_SHUF(a, a, 1, 0, 3, 2), LINMATH_SHUF(b, b, 2, 1, 2, 1)));
+}
+static inline __m128 mat2x2_adj_mul_sse(__m128 a, __m128 b)
+{
+	return _mm_sub_ps(_mm_mul_ps(LINMATH_SHUF(a, a, 3, 3, 0, 0), b),
+		_mm_mul_ps(LINMATH_SHUF(a, a, 1, 1, 2, 2), LINMATH_SHUF(b, b, 2, 3, 0, 1)));
+}
+static inline __m128 mat2x2_mul_adj_sse(__m128 a, __m128 b)
+{
+	return _mm_sub_ps(_mm_mul_ps(a, LINMATH_SHUF(b, b, 3, 0, 3, 0)),
+		_mm_mul_ps(LINMATH_SHUF(a, a, 1, 0, 3, 2), LINMATH_SHUF(b, b, 2, 1, 2, 1)));
+}
+#endif
 static inline void mat4x4_invert(mat4x4 T, mat4x4 M)
 {
+#ifdef LINMATH_SSE
+	/* Block inverse over the 2x2 sub-matrices | A B ; C D | of the
+	   columns, which gives the transposed inverse of the transpose,
+	   i.e. the inverse. Assumes it is invertible. */
+	__m128 c0 = _mm_loadu_ps(M[0]), c1 = _mm_loadu_ps(M[1]);
+	__m128 c2 = _mm_loadu_ps(M[2]), c3 = _mm_loadu_ps(M[3]);
+	__m128 A = _mm_movelh_ps(c0, c1), B = _mm_movehl_ps(c1, c0);
+	__m128 C = _mm_movelh_ps(c2, c3), D = _mm_movehl_ps(c3, c2);
+	__m128 det = _mm_sub_ps(
+		_mm_mul_ps(LINMATH_SHUF(c0, c2, 0, 2, 0, 2), LINMATH_SHUF(c1, c3, 1, 3, 1, 3)),
+		_mm_mul_ps(LINMATH_SHUF(c0, c2, 1, 3, 1, 3), LINMATH_SHUF(c1, c3, 0, 2, 0, 2)));
+	__m128 detA = LINMATH_SHUF(det, det, 0, 0, 0, 0);
+	__m128 detB = LINMATH_SHUF(det, det, 1, 1, 1, 1);
+	__m128 detC = LINMATH_SHUF(det, det, 2, 2, 2, 2);
+	__m128 detD = LINMATH_SHUF(det, det, 3, 3, 3, 3);
+	__m128 DC = mat2x2_adj_mul_sse(D, C);
+	__m128 AB = mat2x2_adj_mul_sse(A, B);
+	__m128 X = _mm_sub_ps(_mm_mul_ps(detD, A), mat2x2_mul_sse(B, DC));
+	__m128 W = _mm_sub_ps(_mm_mul_ps(detA, D), mat2x2_mul_sse(C, AB));
+	__m128 Y = _mm_sub_ps(_mm_mul_ps(detB, C), mat2x2_mul_adj_sse(D, AB));
+	__m128 Z = _mm_sub_ps(_mm_mul_ps(detC, B), mat2x2_mul_adj_sse(A, DC));
+	__m128 tr = _mm_mul_ps(AB, LINMATH_SHUF(DC, DC, 0, 2, 1, 3));
+	__m128 detM, idet;
+	tr = _mm_add_ps(tr, LINMATH_SHUF(tr, tr, 2, 3, 0, 1));
+	tr = _mm_add_ps(tr, LINMATH_SHUF(tr, tr, 1, 0, 3, 2));
+	detM = _mm_sub_ps(_mm_add_ps(_mm_mul_ps(detA, detD), _mm_mul_ps(detB, detC)), tr);
+	idet = _mm_div_ps(_mm_setr_ps(1.f, -1.f, -1.f, 1.f), detM);
+	X = _mm_mul_ps(X, idet);
+	Y = _mm_mul_ps(Y, idet);
+	Z = _mm_mul_ps(Z, idet);
+	W = _mm_mul_ps(W, idet);
+	_mm_storeu_ps(T[0], LINMATH_SHUF(X, Y, 3, 1, 3, 1));
+	_mm_storeu_ps(T[1], LINMATH_SHUF(X, Y, 2, 0, 2, 0));
+	_mm_storeu_ps(T[2], LINMATH_SHUF(Z, W, 3, 1, 3, 1));
+	_mm_storeu_ps(T[3], LINMATH_SHUF(Z, W, 2, 0, 2, 0));
+#else
 	float idet;
 	float s[6];
 	float c[6];
@@ -297,6 +436,7 @@ static inline void mat4x4_invert(mat4x4 T, mat4x4 M)
 	T[3][1] = ( M[0][0] * c[3] - M[0][1] * c[1] + M[0][2] * c[0]) * idet;
 	T[3][2] = (-M[3][0] * s[3] + M[3][1] * s[1] - M[3][2] * s[0]) * idet;
 	T[3][3] = ( M[2][0] * s[3] - M[2][1] * s[1] + M[2][2] * s[0]) * idet;
+#endif
 }
 static inline void mat4x4_orthonormalize(mat4x4 R, mat4x4 M)
 {
@@ -0,0 +1,208 @@
+#ifndef MIPMAP
+#define MIPMAP
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "ppmr.h"
+#include "ezpool.h"
+#include "ezmem.h"
+
+#define MIP_MAX_LEVELS 32
+#define MIP_GRAIN      16 // output rows per pool task
+
+#define MIP_NONE 0 // no mipmaps
+#define MIP_POW2 1 // only for power-of-two sizes, all plain GLES2 allows
+#define MIP_ANY  2 // for any size, with GL_OES_texture_npot
+
+// One level of a mipmap chain.
+typedef struct MipLevel {
+  Pixel *pixels;
+  int    width, height;
+} MipLevel;
+
+// Mipmap chain of an image, built on the CPU so it can be made next to the
+// decode, on any thread, and also serves the headless renderer. Level 0 is
+// the image itself and is not owned by the chain; every further level is
+// half the size of the one before, rounded down like GL's, to 1 x 1.
+typedef struct MipChain {
+  MipLevel levels[MIP_MAX_LEVELS];
+  int      count;
+} MipChain;
+
+/* Function Prototypes */
+static inline  void   mipDownsample(const Pixel *src, int sw, int sh,
+                                      Pixel *dst, int dw, int dh,
+                                      ezPool *pool);
+static inline  int    mipBuild(MipChain *chain, const Pixel *image,
+                                 int width, int height, ezPool *pool);
+static inline  int    mipAllowed(int mode, int width, int height);
+static inline  void   mipFree(MipChain *chain);
+
+// halve two source rows into one output row with a 2x2 box filter. Output
+// pixel x averages source columns 2x and 2x + 1, repeating the last column
+// where that runs off the edge.
+static inline void mipRow(const Pixel *r0, const Pixel *r1, int sw,
+                            Pixel *out, int dw)
+{
+  int x = 0;
+
+#ifdef PPMR_SSE2
+  // Four output pixels from 24 bytes of each row. The rows are summed as
+  // 16-bit lanes, each lane gets the lane 3 on (the same channel of the
+  // pixel to the right) added, and output pixel k is lanes 6k..6k+2 once
+  // they are rounded and packed back to bytes.
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i two = _mm_set1_epi16(2);
+  const __m128i m0 = _mm_setr_epi8(-1, -1, -1, 0, 0, 0, 0, 0,
+                                   0, 0, 0, 0, 0, 0, 0, 0);
+  const __m128i m2 = _mm_slli_si128(m0, 2);
+  const __m128i m6 = _mm_slli_si128(m0, 6);
+  const __m128i m12 = _mm_slli_si128(m0, 12);
+
+  for (; 2 * (x + 4) <= sw && x + 4 <= dw; x += 4)
+  {
+    const unsigned char *a = (const unsigned char *) (r0 + 2 * x);
+    const unsigned char *b = (const unsigned char *) (r1 + 2 * x);
+    __m128i a0 = _mm_loadu_si128((const __m128i *) a);
+    __m128i a1 = _mm_loadu_si128((const __m128i *) (a + 8));
+    __m128i b0 = _mm_loadu_si128((const __m128i *) b);
+    __m128i b1 = _mm_loadu_si128((const __m128i *) (b + 8));
+    __m128i v0 = _mm_add_epi16(_mm_unpacklo_epi8(a0, zero),
+                               _mm_unpacklo_epi8(b0, zero));
+    __m128i v1 = _mm_add_epi16(_mm_unpackhi_epi8(a0, zero),
+                               _mm_unpackhi_epi8(b0, zero));
+    __m128i v2 = _mm_add_epi16(_mm_unpackhi_epi8(a1, zero),
+                               _mm_unpackhi_epi8(b1, zero));
+    __m128i t0 = _mm_add_epi16(v0, _mm_or_si128(_mm_srli_si128(v0, 6),
+                                                _mm_slli_si128(v1, 10)));
+    __m128i t1 = _mm_add_epi16(v1, _mm_or_si128(_mm_srli_si128(v1, 6),
+                                                _mm_slli_si128(v2, 10)));
+    __m128i t2 = _mm_add_epi16(v2, _mm_srli_si128(v2, 6));
+    __m128i p0, p1, r;
+    int tail;
+
+    t0 = _mm_srli_epi16(_mm_add_epi16(t0, two), 2);
+    t1 = _mm_srli_epi16(_mm_add_epi16(t1, two), 2);
+    t2 = _mm_srli_epi16(_mm_add_epi16(t2, two), 2);
+    p0 = _mm_packus_epi16(t0, t1); // lanes 0..15
+    p1 = _mm_packus_epi16(t2, t2); // lanes 16..23
+
+    r = _mm_or_si128(_mm_and_si128(p0, m0),
+                     _mm_srli_si128(_mm_and_si128(p0, m6), 3));
+    r = _mm_or_si128(r, _mm_srli_si128(_mm_and_si128(p0, m12), 6));
+    r = _mm_or_si128(r, _mm_slli_si128(_mm_and_si128(p1, m2), 7));
+    _mm_storel_epi64((__m128i *) (out + x), r);
+    tail = _mm_cvtsi128_si32(_mm_srli_si128(r, 8));
+    memcpy((unsigned char *) (out + x) + 8, &tail, 4);
+  }
+#endif
+
+  for (; x < dw; x++)
+  {
+    int x0 = 2 * x < sw ? 2 * x : sw - 1;
+    int x1 = x0 + 1 < sw ? x0 + 1 : x0;
+
+    out[x].r = (r0[x0].r + r0[x1].r + r1[x0].r + r1[x1].r + 2) >> 2;
+    out[x].g = (r0[x0].g + r0[x1].g + r1[x0].g + r1[x1].g + 2) >> 2;
+    out[x].b = (r0[x0].b + r0[x1].b + r1[x0].b + r1[x1].b + 2) >> 2;
+  }
+}
+
+typedef struct MipJob {
+  const Pixel *src;
+  int    sw, sh;
+  Pixel *dst;
+  int    dw, dh;
+} MipJob;
+
+static inline void mipRows(void *ctx, int begin, int end)
+{
+  const MipJob *job = (const MipJob *) ctx;
+  int y;
+
+  for (y = begin; y < end; y++)
+  {
+    int y0 = 2 * y < job->sh ? 2 * y : job->sh - 1;
+    const Pixel *r0 = job->src + (size_t) y0 * job->sw;
+    const Pixel *r1 = y0 + 1 < job->sh ? r0 + job->sw : r0;
+
+    mipRow(r0, r1, job->sw, job->dst + (size_t) y * job->dw, job->dw);
+  }
+}
+
+// Halve src into dst with a 2x2 box filter, the rows spread over pool (NULL
+// runs on this thread). dw and dh may round either way: odd edges repeat
+// the last row or column when rounded up and drop it when rounded down.
+static inline void mipDownsample(const Pixel *src, int sw, int sh,
+                                   Pixel *dst, int dw, int dh, ezPool *pool)
+{
+  MipJob job;
+
+  job.src = src;
+  job.sw = sw;
+  job.sh = sh;
+  job.dst = dst;
+  job.dw = dw;
+  job.dh = dh;
+  ezPoolFor(pool, dh, MIP_GRAIN, mipRows, &job);
+}
+
+// build the chain over image, which must outlive it. Returns 1 when out of
+// memory, with nothing left allocated.
+static inline int mipBuild(MipChain *chain, const Pixel *image, int width,
+                             int height, ezPool *pool)
+{
+  memset(chain, 0, sizeof(MipChain));
+  chain->levels[0].pixels = (Pixel *) image;
+  chain->levels[0].width = width;
+  chain->levels[0].height = height;
+  chain->count = 1;
+
+  while (chain->count < MIP_MAX_LEVELS)
+  {
+    MipLevel *prev = &chain->levels[chain->count - 1];
+    MipLevel *next = &chain->levels[chain->count];
+
+    if (prev->width == 1 && prev->height == 1)
+    {
+      break;
+    }
+
+    next->width = prev->width > 1 ? prev->width / 2 : 1;
+    next->height = prev->height > 1 ? prev->height / 2 : 1;
+    next->pixels = ezBufferAlloc(sizeof(Pixel) * next->width * next->height);
+    if (next->pixels == NULL)
+    {
+      mipFree(chain);
+      return 1;
+    }
+    mipDownsample(prev->pixels, prev->width, prev->height, next->pixels,
+                  next->width, next->height, pool);
+    chain->count++;
+  }
+  return 0;
+}
+
+// whether a width x height texture can be mipmapped in mode, one of
+// MIP_NONE, MIP_POW2 or MIP_ANY
+static inline int mipAllowed(int mode, int width, int height)
+{
+  return mode == MIP_ANY ||
+         (mode == MIP_POW2 && (width & (width - 1)) == 0 &&
+          (height & (height - 1)) == 0);
+}
+
+// free the levels the chain built, not level 0
+static inline void mipFree(MipChain *chain)
+{
+  int i;
+
+  for (i = 1; i < chain->count; i++)
+  {
+    ezBufferFree(chain->levels[i].pixels);
+  }
+  memset(chain, 0, sizeof(MipChain));
+}
+
+#endif
@@ -0,0 +1,251 @@
+#ifndef MOTION
+#define MOTION
+
+#include <math.h>
+#include <string.h>
+
+// The viewer's transform, and how input moves it. Input doesn't change the
+// transform on screen directly: it moves a target, and motionStep eases the
+// shown transform toward it by the time since the last frame, so motion
+// looks the same at any frame rate. A key press steps the target as it
+// always has (0.1, 1.1x or a quarter turn), and a key held past MOTION_HOLD
+// goes on moving it at MOTION_RATE steps a second. Dragging pans with the
+// cursor, and letting go while it moves flings the image on, slowing down
+// by MOTION_FRICTION. The scroll wheel zooms about the point under the
+// cursor. Positions are in normalized device coordinates.
+
+#define MOTION_EASE     0.08f // seconds for the shown transform to close 63%
+#define MOTION_HOLD     0.25f // seconds a key is held before it repeats
+#define MOTION_RATE     8.0f  // steps a second while a key is held
+#define MOTION_FRICTION 0.3f  // seconds for a fling to lose 63% of its speed
+#define MOTION_FLING    0.1f  // a drag held still this long doesn't fling
+#define MOTION_SMOOTH   0.03f // seconds the drag speed is averaged over
+#define MOTION_STEP     0.1f  // translate and shear step
+#define MOTION_ZOOM     1.1f  // scale step
+#define MOTION_TURN     1.5707963f // rotate step
+
+typedef struct {
+  float scale;
+  float rotate;
+  float translate[2]; // 0 -> x, 1 -> y
+  float shear[2];     // 0 -> x, 1 -> y
+} transvals;
+
+// what a key moves
+enum {
+  MOTION_LEFT, MOTION_RIGHT, MOTION_UP, MOTION_DOWN,
+  MOTION_ZOOM_IN, MOTION_ZOOM_OUT,
+  MOTION_SHEAR_LEFT, MOTION_SHEAR_RIGHT, MOTION_SHEAR_UP, MOTION_SHEAR_DOWN,
+  MOTION_CONTROLS
+};
+
+typedef struct Motion {
+  transvals to;                 // where the shown transform is heading
+  float  held[MOTION_CONTROLS]; // seconds each control is held, < 0 when up
+  float  velocity[2];           // pan speed of a drag or fling, a second
+  int    dragging;
+  double cursor[2];             // cursor at the last drag motion
+  double moved;                 // time of the last drag motion
+  double last;                  // time of the last step
+  int    active;                // the last step was still moving
+} Motion;
+
+/* Function Prototypes */
+static inline void motionInit(Motion *m, const transvals *t);
+static inline void motionKey(Motion *m, int control, int down);
+static inline void motionTurn(Motion *m, int turns);
+static inline void motionGrab(Motion *m, transvals *t, double x, double y,
+                              int down, double now);
+static inline void motionDrag(Motion *m, transvals *t, double x, double y,
+                              double now);
+static inline void motionZoom(Motion *m, double x, double y, double steps);
+static inline int  motionStep(Motion *m, transvals *t, double now);
+
+static inline void motionInit(Motion *m, const transvals *t)
+{
+  int c;
+
+  memset(m, 0, sizeof(*m));
+  m->to = *t;
+  for (c = 0; c < MOTION_CONTROLS; c++)
+  {
+    m->held[c] = -1;
+  }
+}
+
+// move the target by steps of control
+static inline void motionNudge(transvals *to, int control, float steps)
+{
+  switch (control)
+  {
+    case MOTION_LEFT:        to->translate[0] -= MOTION_STEP * steps; break;
+    case MOTION_RIGHT:       to->translate[0] += MOTION_STEP * steps; break;
+    case MOTION_UP:          to->translate[1] += MOTION_STEP * steps; break;
+    case MOTION_DOWN:        to->translate[1] -= MOTION_STEP * steps; break;
+    case MOTION_ZOOM_IN:     to->scale *= powf(MOTION_ZOOM, steps); break;
+    case MOTION_ZOOM_OUT:    to->scale /= powf(MOTION_ZOOM, steps); break;
+    case MOTION_SHEAR_LEFT:  to->shear[0] -= MOTION_STEP * steps; break;
+    case MOTION_SHEAR_RIGHT: to->shear[0] += MOTION_STEP * steps; break;
+    case MOTION_SHEAR_UP:    to->shear[1] += MOTION_STEP * steps; break;
+    case MOTION_SHEAR_DOWN:  to->shear[1] -= MOTION_STEP * steps; break;
+  }
+}
+
+// a key went down or up, the system's key repeats are left out
+static inline void motionKey(Motion *m, int control, int down)
+{
+  if (down && m->held[control] < 0)
+  {
+    m->held[control] = 0;
+    motionNudge(&m->to, control, 1);
+  }
+  else if (!down)
+  {
+    m->held[control] = -1;
+  }
+}
+
+// rotate the target by quarter turns, counterclockwise
+static inline void motionTurn(Motion *m, int turns)
+{
+  m->to.rotate += MOTION_TURN * turns;
+}
+
+// the pan button went down at (x, y), or came up
+static inline void motionGrab(Motion *m, transvals *t, double x, double y,
+                              int down, double now)
+{
+  if (down)
+  {
+    // catch the image where it is
+    m->to.translate[0] = t->translate[0];
+    m->to.translate[1] = t->translate[1];
+    m->velocity[0] = m->velocity[1] = 0;
+    m->cursor[0] = x;
+    m->cursor[1] = y;
+    m->moved = now;
+    m->dragging = 1;
+  }
+  else if (m->dragging)
+  {
+    // held still before letting go, so no fling
+    if (now - m->moved > MOTION_FLING)
+    {
+      m->velocity[0] = m->velocity[1] = 0;
+    }
+    m->dragging = 0;
+  }
+}
+
+// the cursor moved to (x, y), panning the image with it while dragging
+static inline void motionDrag(Motion *m, transvals *t, double x, double y,
+                              double now)
+{
+  double dt = now - m->moved;
+  int i;
+
+  if (!m->dragging)
+  {
+    return;
+  }
+  for (i = 0; i < 2; i++)
+  {
+    float d = (float) ((i == 0 ? x : y) - m->cursor[i]);
+
+    t->translate[i] += d;
+    m->to.translate[i] += d;
+    // average the speed over time rather than over events, which come
+    // as fast as the mouse reports
+    if (dt > 0)
+    {
+      m->velocity[i] += (float) ((d / dt - m->velocity[i]) *
+                                 (1 - exp(-dt / MOTION_SMOOTH)));
+    }
+  }
+  m->cursor[0] = x;
+  m->cursor[1] = y;
+  if (dt > 0)
+  {
+    m->moved = now;
+  }
+}
+
+// zoom the target by steps about (x, y), which stays over the same point
+// of the image all the way, as scale and translate ease together
+static inline void motionZoom(Motion *m, double x, double y, double steps)
+{
+  float f = powf(MOTION_ZOOM, (float) steps);
+
+  m->to.translate[0] = (float) (x - f * (x - m->to.translate[0]));
+  m->to.translate[1] = (float) (y - f * (y - m->to.translate[1]));
+  m->to.scale *= f;
+}
+
+// ease value toward target by k, returns 1 while it hasn't arrived
+static inline int motionEase(float *value, float target, float k, float close)
+{
+  if (fabsf(target - *value) <= close)
+  {
+    *value = target;
+    return 0;
+  }
+  *value += (target - *value) * k;
+  return 1;
+}
+
+// Advance t to time now: run held keys and any fling, then ease t toward
+// the target. Returns 1 while something is still moving, so the caller
+// keeps drawing frames rather than waiting for input. The first step after
+// it returns 0 moves nothing, so time spent idle isn't counted.
+static inline int motionStep(Motion *m, transvals *t, double now)
+{
+  float dt = m->active ? (float) (now - m->last) : 0;
+  float k = 1 - expf(-dt / MOTION_EASE);
+  int moving = 0, c, i;
+
+  m->last = now;
+  for (c = 0; c < MOTION_CONTROLS; c++)
+  {
+    if (m->held[c] >= 0)
+    {
+      float before = fmaxf(m->held[c] - MOTION_HOLD, 0);
+
+      m->held[c] += dt;
+      motionNudge(&m->to, c,
+                  MOTION_RATE * (fmaxf(m->held[c] - MOTION_HOLD, 0) - before));
+      moving = 1;
+    }
+  }
+
+  // a fling coasts the exact distance its decaying speed covers in dt
+  if (!m->dragging && (m->velocity[0] != 0 || m->velocity[1] != 0))
+  {
+    float decay = expf(-dt / MOTION_FRICTION);
+
+    for (i = 0; i < 2; i++)
+    {
+      float d = m->velocity[i] * MOTION_FRICTION * (1 - decay);
+
+      t->translate[i] += d;
+      m->to.translate[i] += d;
+      m->velocity[i] *= decay;
+    }
+    if (fabsf(m->velocity[0]) + fabsf(m->velocity[1]) < 0.01f)
+    {
+      m->velocity[0] = m->velocity[1] = 0;
+    }
+    moving = 1;
+  }
+
+  moving |= motionEase(&t->scale, m->to.scale, k, 1e-4f * m->to.scale);
+  moving |= motionEase(&t->rotate, m->to.rotate, k, 1e-4f);
+  for (i = 0; i < 2; i++)
+  {
+    moving |= motionEase(&t->translate[i], m->to.translate[i], k, 1e-4f);
+    moving |= motionEase(&t->shear[i], m->to.shear[i], k, 1e-4f);
+  }
+  m->active = moving;
+  return moving;
+}
+
+#endif
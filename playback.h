@@ -0,0 +1,341 @@
+#ifndef PLAYBACK
+#define PLAYBACK
+
+#include <GLES2/gl2.h>
+
+#include "ppmr.h"
+#include "ezthread.h"
+#include "ezmem.h"
+#include "session.h"
+#include "trace.h"
+
+#define PLAY_AHEAD    8 // frames the decoders may run ahead of the screen
+#define PLAY_TEXTURES 3 // ring of textures frames are uploaded into
+#define PLAY_WORKERS  4 // most decoder threads
+
+// A decoded frame slot. Frame f always goes through slot f % PLAY_AHEAD:
+// a decoder may start on it once the consumer has moved free up to f, and
+// publishes it by storing f in done.
+typedef struct PlayFrame {
+  Pixel *pixels;            // NULL when the frame was skipped or bad
+  size_t capacity;          // pixels the buffer holds
+  int    width, height;
+  volatile long free;       // frame the slot is open for
+  volatile long done;       // last frame published in the slot
+} PlayFrame;
+
+// Flipbook playback of a session's images at a fixed rate, looping. Worker
+// threads decode frames ahead into a ring of slots, and the render loop
+// uploads them into a ring of textures ahead of when they are due, so a
+// due frame is just a texture bind. Frames that aren't ready in time are
+// dropped rather than held up: decoders skip frames whose time has already
+// passed, and the render loop shows the newest frame that is due.
+typedef struct Playback {
+  const Session *session;
+  double fps;
+  int    maxTexture;
+  void (*notify)(void);     // called when a frame is decoded, may be NULL
+  PlayFrame frames[PLAY_AHEAD];
+  ezThread threads[PLAY_WORKERS];
+  int    threadCount;
+  volatile long next;       // next frame a decoder will claim
+  volatile long due;        // frame that should be on screen now
+  volatile long cancel;
+  ezSignal freed;           // notified when slots are freed or on cancel
+  GLuint textures[PLAY_TEXTURES];
+  long   textureFrame[PLAY_TEXTURES]; // frame held, -1 for none
+  int    textureWidth[PLAY_TEXTURES], textureHeight[PLAY_TEXTURES];
+  long   uploaded;          // last frame taken off the decoders
+  long   shown;             // frame on screen, -1 before the first
+  double start;             // time frame 0 was due, < 0 until it is ready
+  long   dropped;           // frames that never made it to the screen
+} Playback;
+
+/* Function Prototypes */
+static inline  int    playStart(Playback *play, const Session *session,
+                                  double fps, int maxTexture,
+                                  void (*notify)(void));
+static inline  int    playUpdate(Playback *play, double now);
+static inline  double playNextTime(const Playback *play);
+static inline  void   playStop(Playback *play);
+
+// decode frame's image into the slot's buffer, growing it when needed.
+// Returns 1 on a bad file, when out of memory, or when it is too big for
+// one texture.
+static inline int playDecode(Playback *play, PlayFrame *slot, long frame)
+{
+  const SessionImage *image = &play->session->images[frame %
+                                                     play->session->count];
+  const char *path = image->path;
+  DiskCache *disk = image->index == 0 ? play->session->disk : NULL;
+  PpmReader reader;
+  PixelMap map;
+  size_t pixels;
+  int status = 1, width, height;
+  double start = traceBegin();
+  FILE *in = fopen(path, "rb");
+
+  if (in == NULL)
+  {
+    return 1;
+  }
+  if (!ppmOpenImage(&reader, in, image->index) &&
+      reader.width <= play->maxTexture &&
+      reader.height <= play->maxTexture)
+  {
+    pixels = (size_t) reader.width * reader.height;
+    if (slot->capacity < pixels)
+    {
+      ezBufferFree(slot->pixels);
+      slot->pixels = ezBufferAlloc(sizeof(Pixel) * pixels);
+      slot->capacity = slot->pixels != NULL ? pixels : 0;
+    }
+    slot->width = reader.width;
+    slot->height = reader.height;
+    if (slot->pixels == NULL)
+    {
+      status = 1;
+    }
+    else if (disk != NULL && diskCacheWorth(&reader) &&
+             !diskCacheLoad(disk, path, &map, &width, &height))
+    {
+      status = width != reader.width || height != reader.height;
+      if (!status)
+      {
+        memcpy(slot->pixels, map.pixels, sizeof(Pixel) * pixels);
+      }
+      unmapP6(&map);
+    }
+    else
+    {
+      status = ppmReadRows(&reader, slot->pixels, reader.height) !=
+               reader.height;
+      if (!status && disk != NULL && diskCacheWorth(&reader))
+      {
+        diskCacheStore(disk, path, slot->pixels, reader.width, reader.height);
+      }
+    }
+  }
+  ppmClose(&reader);
+  fclose(in);
+  traceEnd("decode frame", start);
+  if (status && frame < play->session->count) // once, not every loop
+  {
+    fprintf(stderr, "Error: Could not play %s\n", path);
+  }
+  return status;
+}
+
+static EZTHREAD_FUNC(playDecoder, arg)
+{
+  Playback *play = (Playback *) arg;
+
+  while (!ezAtomicLoad(&play->cancel))
+  {
+    long frame = ezAtomicAdd(&play->next, 1);
+    PlayFrame *slot = &play->frames[frame % PLAY_AHEAD];
+    int skip;
+
+    // wait for the consumer to let go of the slot
+    for (;;)
+    {
+      long seen = ezSignalPeek(&play->freed);
+
+      if (ezAtomicLoad(&play->cancel))
+      {
+        return EZTHREAD_RETURN;
+      }
+      if (ezAtomicLoad(&slot->free) == frame)
+      {
+        break;
+      }
+      ezSignalWait(&play->freed, seen);
+    }
+
+    // a frame that is already late would only be dropped
+    skip = frame < ezAtomicLoad(&play->due) || playDecode(play, slot, frame);
+    if (skip)
+    {
+      slot->width = slot->height = 0;
+    }
+    ezAtomicStore(&slot->done, frame);
+    if (play->notify != NULL)
+    {
+      play->notify();
+    }
+  }
+  return EZTHREAD_RETURN;
+}
+
+// start decoding session's images as a sequence played at fps, on the GL
+// thread. Returns 1 when no decoder thread could be started.
+static inline int playStart(Playback *play, const Session *session,
+                              double fps, int maxTexture,
+                              void (*notify)(void))
+{
+  int i, threads = ezCpuCount() - 1;
+
+  memset(play, 0, sizeof(Playback));
+  ezSignalInit(&play->freed);
+  play->session = session;
+  play->fps = fps;
+  play->maxTexture = maxTexture;
+  play->notify = notify;
+  play->uploaded = -1;
+  play->shown = -1;
+  play->start = -1;
+  for (i = 0; i < PLAY_AHEAD; i++)
+  {
+    play->frames[i].free = i;
+    play->frames[i].done = -1;
+  }
+
+  glGenTextures(PLAY_TEXTURES, play->textures);
+  for (i = 0; i < PLAY_TEXTURES; i++)
+  {
+    play->textureFrame[i] = -1;
+    glBindTexture(GL_TEXTURE_2D, play->textures[i]);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  }
+
+  // leave a core for the render loop
+  threads = threads < 1 ? 1 : threads > PLAY_WORKERS ? PLAY_WORKERS : threads;
+  for (i = 0; i < threads; i++)
+  {
+    if (ezThreadCreate(&play->threads[i], playDecoder, play))
+    {
+      break;
+    }
+    play->threadCount++;
+  }
+  return play->threadCount == 0;
+}
+
+// frame f is decoded (or was skipped) and waiting in its slot
+static inline int playReady(const Playback *play, long f)
+{
+  return ezAtomicLoad((volatile long *) &play->frames[f % PLAY_AHEAD].done) ==
+         f;
+}
+
+// Advance playback to time now (in seconds): upload what the decoders have
+// finished and bind the texture of the newest frame that is due. Must be
+// called on the GL thread. Returns 1 when the frame on screen changed.
+static inline int playUpdate(Playback *play, double now)
+{
+  long due, best = -1;
+  int i;
+
+  // the clock starts once the first frame is in
+  if (play->start < 0)
+  {
+    if (!playReady(play, 0))
+    {
+      return 0;
+    }
+    play->start = now;
+  }
+  due = (long) ((now - play->start) * play->fps);
+  ezAtomicStore(&play->due, due);
+
+  // Take frames off the decoders in order. Up to PLAY_TEXTURES - 1 frames
+  // are uploaded ahead of the one on screen; late frames are taken as soon
+  // as they are in, and skipped outright when a newer due frame is ready.
+  while (play->uploaded - play->shown < PLAY_TEXTURES - 1 ||
+         play->uploaded < due)
+  {
+    long f = play->uploaded + 1;
+    PlayFrame *slot = &play->frames[f % PLAY_AHEAD];
+    int t = (int) (f % PLAY_TEXTURES);
+
+    if (!playReady(play, f))
+    {
+      break;
+    }
+    if (slot->width > 0 && !(f < due && playReady(play, f + 1)))
+    {
+      double start = traceBegin();
+
+      glBindTexture(GL_TEXTURE_2D, play->textures[t]);
+      if (play->textureWidth[t] == slot->width &&
+          play->textureHeight[t] == slot->height)
+      {
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, slot->width, slot->height,
+                        GL_RGB, GL_UNSIGNED_BYTE, slot->pixels);
+      }
+      else
+      {
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, slot->width, slot->height, 0,
+                     GL_RGB, GL_UNSIGNED_BYTE, slot->pixels);
+        play->textureWidth[t] = slot->width;
+        play->textureHeight[t] = slot->height;
+      }
+      play->textureFrame[t] = f;
+      traceEnd("upload frame", start);
+    }
+
+    // the slot is free for the frame PLAY_AHEAD on
+    play->uploaded = f;
+    ezAtomicStore(&slot->free, f + PLAY_AHEAD);
+    ezSignalNotify(&play->freed);
+  }
+
+  for (i = 0; i < PLAY_TEXTURES; i++)
+  {
+    if (play->textureFrame[i] <= due && play->textureFrame[i] > play->shown &&
+        play->textureFrame[i] > best)
+    {
+      best = play->textureFrame[i];
+    }
+  }
+  if (best < 0)
+  {
+    if (play->shown >= 0)
+    {
+      glBindTexture(GL_TEXTURE_2D,
+                    play->textures[play->shown % PLAY_TEXTURES]);
+    }
+    return 0;
+  }
+
+  play->dropped += best - play->shown - 1;
+  play->shown = best;
+  glBindTexture(GL_TEXTURE_2D, play->textures[best % PLAY_TEXTURES]);
+  return 1;
+}
+
+// time the next frame is due, for sleeping until then, or -1 while the
+// first frame is still being decoded
+static inline double playNextTime(const Playback *play)
+{
+  if (play->start < 0)
+  {
+    return -1;
+  }
+  return play->start + (ezAtomicLoad((volatile long *) &play->due) + 1) /
+                       play->fps;
+}
+
+// stop the decoders and free the frames and textures
+static inline void playStop(Playback *play)
+{
+  int i;
+
+  ezAtomicStore(&play->cancel, 1);
+  ezSignalNotify(&play->freed);
+  for (i = 0; i < play->threadCount; i++)
+  {
+    ezThreadJoin(play->threads[i]);
+  }
+  play->threadCount = 0;
+  ezSignalDestroy(&play->freed);
+  for (i = 0; i < PLAY_AHEAD; i++)
+  {
+    ezBufferFree(play->frames[i].pixels);
+    play->frames[i].pixels = NULL;
+  }
+  glDeleteTextures(PLAY_TEXTURES, play->textures);
+}
+
+#endif
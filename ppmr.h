@@ -10,101 +10,2400 @@
 #include <ctype.h>
 #endif
 
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <errno.h>
+#define PPMR_WRITEV
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define PPMR_SSE2
+#include <emmintrin.h>
+#endif
+
+// AVX2 kernels are built alongside the baseline ones and only run when the
+// CPU has AVX2, see ppmrKernels. PPMR_NO_AVX2 leaves them out.
+#if defined(PPMR_SSE2) && !defined(PPMR_NO_AVX2) && \
+    (defined(_MSC_VER) || defined(__GNUC__))
+#define PPMR_AVX2
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define PPMR_TARGET_AVX2
+#else
+#define PPMR_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+#include "ezthread.h"
+#include "ezmem.h"
+
+#define PPMR_PAD          16        // readable slack after P3 text buffers
+#define PPMR_PARALLEL_MIN (1 << 20) // P3 text bytes before threads pay off
+#define PPMR_WINDOW       (1 << 16) // P3 text held by a PpmReader
+#define IMAGE_ALIGN       64        // Image base and plane alignment
+#define PPMR_DIRECT_MIN   (1 << 16) // P6 band bytes written past stdio
+#define PPMR_P3_LINE      5         // pixels per P3 line, 60 chars at most
+#define PPMR_HEADER_MAX   4096      // header bytes, comments included
+
+// Largest image a header may describe, checked before anything is
+// allocated for it. Can be lowered for services taking untrusted uploads.
+#ifndef PPMR_MAX_SIDE
+#define PPMR_MAX_SIDE     (1 << 20)
+#endif
+#ifndef PPMR_MAX_PIXELS
+#define PPMR_MAX_PIXELS   (1ull << 30)
+#endif
+
 
 typedef struct Pixel {
   unsigned char r, g, b;
 } Pixel;
 
+// Pixel has to match the P6 wire layout byte for byte so that a raster can
+// be read (or mapped) straight into a Pixel array.
+typedef char pixelIsPacked[sizeof(Pixel) == 3 ? 1 : -1];
+
+// A P6 raster viewed in place through a read-only file mapping.
+typedef struct PixelMap {
+  Pixel  *pixels;  // first pixel of the raster, inside the mapping
+  void   *base;    // start of the mapping (page aligned)
+  size_t  length;  // bytes mapped
+#ifdef _WIN32
+  HANDLE  mapping;
+#endif
+} PixelMap;
+
+// One slice of P3 text, decoded by one thread.
+typedef struct P3Chunk {
+  const unsigned char *begin, *end;
+  unsigned char *out;  // first sample this chunk writes
+  size_t tokens;       // samples found in the chunk
+  size_t want;         // samples to decode from it
+  int    status;       // 0 ok, 1 bad byte
+} P3Chunk;
+
+// Writes a P3 or P6 image a band of rows at a time, so a converter never
+// has to hold the whole raster. P6 bands of PPMR_DIRECT_MIN bytes or more
+// skip the stdio copy and go out in one writev, together with the header on
+// the first one. P3 rows are formatted through a table of each sample's
+// digits rather than printf.
+typedef struct PpmWriter {
+  FILE  *out;
+  int    width, height, version;
+  int    row;            // rows written so far
+  char   header[32];     // not yet written, header[0] is 0 once it is
+  unsigned char *text;   // P3: one row of text
+  unsigned char digits[256][4]; // P3: a sample's digits and a space
+  unsigned char length[256];    // P3: bytes of digits[sample] to keep
+} PpmWriter;
+
+// Conversion kernels. A PpmrExpand turns count pixels of one source format
+// into RGB samples of the same width, in place for gray and gray+alpha; a
+// PixelConvert writes count Pixels in one of the packed layouts.
+typedef void (*PpmrExpand)(const void *src, void *dst, size_t count);
+typedef void (*PixelConvert)(const Pixel *src, unsigned char *dst,
+                             size_t count);
+
+#define PPMR_ISA_SCALAR 0
+#define PPMR_ISA_SSE2   1
+#define PPMR_ISA_AVX2   2
+#define PPMR_ISA_COUNT  3
+
+// One kernel per (source format, destination layout) pair, for one
+// instruction set. Slots without a better kernel for the instruction set
+// hold the next best one, so every entry can be called.
+typedef struct PpmrKernels {
+  PpmrExpand   expand8[5];   // by depth, 8-bit samples; NULL for 3
+  PpmrExpand   expand16[5];  // by depth, 16-bit samples; NULL for 3
+  PixelConvert convert[5];   // by PixelLayout; NULL for LAYOUT_PLANAR
+  void (*planar)(const Pixel *src, unsigned char *r, unsigned char *g,
+                 unsigned char *b, size_t count);
+} PpmrKernels;
+
+// Incremental reader that hands an image out a few rows at a time, so only
+// the caller's row band and a fixed text window are ever in memory. Any
+// of the PNM family (P1 to P6) or PAM (P7) is read, always as RGB:
+// bitmaps and gray are spread to all three channels and alpha is dropped.
+// Samples are widened or narrowed to what the caller asks for: maxColor
+// below 255 is stretched to the full 8-bit range through a lookup table,
+// and 16-bit samples (maxColor above 255) are dithered down for 8-bit
+// callers.
+typedef struct PpmReader {
+  FILE  *in;
+  int    width, height, maxColor, version;
+  int    depth;          // samples per pixel in the file, 1 to 4
+  int    row;            // next row to be returned
+  unsigned char *text;   // P1-P3 window, PPMR_WINDOW + PPMR_PAD bytes
+  size_t pos, used;      // unread text is text[pos..used)
+  unsigned char *scratch;// P4: one packed row, depth 4: one raw row
+  PpmrExpand expand8;    // the file's depth to RGB, NULL for RGB files
+  PpmrExpand expand16;   //   the same for 16-bit samples
+  int    eof;
+  unsigned char  *scale; // maxColor < 255: sample to 0..255
+  unsigned short *fixed; // maxColor > 255: sample to 0..255 in 8.8 fixed
+  unsigned short *dither;// maxColor > 255: 4 rows of dither thresholds
+  unsigned short *wide;  // maxColor > 255: 16-bit rows for ppmReadRows
+  size_t wideSize;       // samples wide can hold
+} PpmReader;
+
+// Where a header parse is, fed one byte at a time so that a FILE and a
+// buffer in memory go through the same grammar: "P1" to "P6", width,
+// height and (but for the P1 and P4 bitmaps) maxColor separated by
+// whitespace and # comments (each running to the end of its line), then
+// exactly one whitespace byte before the raster. PAM's "P7" is followed by
+// WIDTH, HEIGHT, DEPTH, MAXVAL and TUPLTYPE lines up to ENDHDR.
+typedef struct PpmHeader {
+  int    width, height, maxColor, version;
+  int    depth;          // samples per pixel, 1 to 4
+  int    field;          // 0 'P', 1 version, 2 width, 3 height, 4 maxColor
+  int    digits;         // of the number being read
+  int    gap;            // whitespace or a comment since the last token
+  int    comment;        // inside a comment
+  unsigned long value;   // number being read
+  size_t bytes;          // fed so far
+  char   line[32];       // P7: start of the line being read
+  size_t lineLength;     // P7: bytes in the line so far
+} PpmHeader;
+
+// Memory layouts an image can be loaded into.
+typedef enum PixelLayout {
+  LAYOUT_RGB,     // packed 3-byte Pixels, the P6 wire layout
+  LAYOUT_RGBX,    // 4 bytes per pixel, X is 255 so rows upload as GL_RGBA
+  LAYOUT_PLANAR,  // separate R, G and B planes
+  LAYOUT_RGB_HALF,// packed half-float RGB, keeps 16-bit samples' precision
+  LAYOUT_GRAY     // one byte per pixel, for gray images as GL_LUMINANCE
+} PixelLayout;
+
+// A decoded raster in one of the layouts. Every plane starts on an
+// IMAGE_ALIGN boundary and rows are stride bytes apart, padded out to the
+// row alignment asked for at allocation.
+typedef struct Image {
+  PixelLayout layout;
+  int     width, height;
+  size_t  stride;
+  unsigned char *planes[3]; // R, G, B planes; packed layouts use planes[0]
+} Image;
+
 /* Function Prototypes */
-static inline  void   readP3(FILE *in, Pixel *buffer, int *width,
+static inline  int    readP3(FILE *in, Pixel *buffer, int *width,
                                int *height, int *maxColor);
-static inline  void   readP6(FILE *in, Pixel *buffer, int *width,
+static inline  int    readP3Threaded(FILE *in, Pixel *buffer, int *width,
+                                       int *height, int *maxColor,
+                                       int threads);
+static inline  int    decodeP3(const unsigned char *text, size_t len,
+                                 Pixel *buffer, size_t count, int threads);
+static inline  int    readP6(FILE *in, Pixel *buffer, int *width,
                                int *height, int *maxColor);
+static inline  int    mapP6(FILE *in, PixelMap *map, int *width,
+                              int *height);
+static inline  void   unmapP6(PixelMap *map);
+static inline  int    writeP3(FILE *out, const Pixel *buffer, int width,
+                                int height);
+static inline  int    writeP6(FILE *out, const Pixel *buffer, int width,
+                                int height);
+static inline  int    ppmWriterOpen(PpmWriter *writer, FILE *out,
+                                      int width, int height, int version);
+static inline  int    ppmWriteRows(PpmWriter *writer, const Pixel *rows,
+                                     int count);
+static inline  int    ppmWriterClose(PpmWriter *writer);
+static inline  int    ppmOpen(PpmReader *reader, FILE *in);
+static inline  int    ppmAttach(PpmReader *reader, FILE *in, int width,
+                                  int height, int maxColor, int version,
+                                  int depth);
+static inline  int    ppmNextImage(PpmReader *reader);
+static inline  int    ppmOpenImage(PpmReader *reader, FILE *in, int index);
+static inline  int    ppmCountImages(FILE *in);
+static inline  int    ppmReadRows(PpmReader *reader, Pixel *rows,
+                                    int count);
+static inline  int    ppmReadRows16(PpmReader *reader, unsigned short *rows,
+                                      int count);
+static inline  unsigned short *ppmrHalfTable(int maxColor);
+static inline  void   ppmClose(PpmReader *reader);
+static inline  int    imageAlloc(Image *image, int width, int height,
+                                   PixelLayout layout, size_t rowAlign);
+static inline  void   imageFree(Image *image);
+static inline  int    ppmrCpuIsa(void);
+static inline  const PpmrKernels *ppmrKernels(void);
+static inline  PixelConvert pixelConverter(PixelLayout layout);
+static inline  void   pixelsToRGBX(const Pixel *src, unsigned char *dst,
+                                     size_t count);
+static inline  void   pixelsToGray(const Pixel *src, unsigned char *dst,
+                                     size_t count);
+static inline  void   imageStoreRows(Image *image, int row, const Pixel *rows,
+                                       int count);
+static inline  int    ppmLoadImage(FILE *in, Image *image, PixelLayout layout,
+                                     size_t rowAlign);
 static inline  int    parseH(FILE *fr, int *width, int *height,
                                int *maxColor, int *version);
+static inline  size_t ppmParseHeader(const unsigned char *text, size_t len,
+                                       PpmHeader *header);
+static inline  long long ppmrTell(FILE *in);
+static inline  int    ppmrSeek(FILE *in, long long offset, int whence);
+
+static inline int ppmrIsSpace(unsigned char c)
+{
+  return c == ' ' || c == '\n' || c == '\r' || c == '\t' ||
+         c == '\v' || c == '\f';
+}
+
+// ftell and fseek with 64-bit offsets, long is 32 bits on Windows
+static inline long long ppmrTell(FILE *in)
+{
+#ifdef _WIN32
+  return _ftelli64(in);
+#else
+  return (long long) ftello(in);
+#endif
+}
+
+static inline int ppmrSeek(FILE *in, long long offset, int whence)
+{
+#ifdef _WIN32
+  return _fseeki64(in, offset, whence);
+#else
+  return fseeko(in, (off_t) offset, whence);
+#endif
+}
+
+#define PPMR_HEADER_MORE 0 // ppmrHeaderByte: go on
+#define PPMR_HEADER_BAD  1 //   not a PPM header, or too big an image
+#define PPMR_HEADER_DONE 2 //   c was the byte ending the header
+
+// the header ended on byte c, which has to be whitespace
+static inline int ppmrHeaderEnd(const PpmHeader *header, int space)
+{
+  return !space || (unsigned long long) header->width * header->height >
+                   PPMR_MAX_PIXELS ? PPMR_HEADER_BAD : PPMR_HEADER_DONE;
+}
+
+// read a PAM value, a number up to limit with nothing after it
+static inline int ppmrPamValue(const char *text, unsigned long limit,
+                                 int *value)
+{
+  unsigned long v = 0;
+
+  while (*text == ' ' || *text == '\t')
+    text++;
+  if (*text < '0' || *text > '9')
+  {
+    return 1;
+  }
+  while (*text >= '0' && *text <= '9' &&
+         (v = v * 10 + (*text - '0')) <= limit)
+  {
+    text++;
+  }
+  while (*text == ' ' || *text == '\t' || *text == '\r')
+    text++;
+  *value = (int) v;
+  return *text != '\0' || v == 0 || v > limit;
+}
+
+// take the next byte of a PAM header, a line at a time
+static inline int ppmrPamByte(PpmHeader *header, int c)
+{
+  const char *line = header->line, *value;
+  size_t keyLength;
+
+  if (c < 0)
+  {
+    return PPMR_HEADER_BAD;
+  }
+  if (c != '\n')
+  {
+    if (header->lineLength < sizeof(header->line) - 1)
+    {
+      header->line[header->lineLength] = (char) c;
+    }
+    header->lineLength++;
+    return PPMR_HEADER_MORE;
+  }
+
+  header->line[header->lineLength < sizeof(header->line) ?
+               header->lineLength : sizeof(header->line) - 1] = '\0';
+  while (*line == ' ' || *line == '\t')
+    line++;
+  for (keyLength = 0; line[keyLength] > ' '; keyLength++)
+    ;
+  value = line + keyLength;
+
+  // only TUPLTYPE lines, which are skipped, may be longer than line holds
+  if (keyLength == 8 && strncmp(line, "TUPLTYPE", 8) == 0)
+  {
+    header->lineLength = 0;
+    return PPMR_HEADER_MORE;
+  }
+  if (header->lineLength >= sizeof(header->line))
+  {
+    return PPMR_HEADER_BAD;
+  }
+  header->lineLength = 0;
+
+  if (keyLength == 0 || line[0] == '#')
+  {
+    return PPMR_HEADER_MORE;
+  }
+  if (keyLength == 6 && strncmp(line, "ENDHDR", 6) == 0)
+  {
+    return header->width == 0 || header->height == 0 ||
+           header->depth == 0 || header->maxColor == 0 ?
+           PPMR_HEADER_BAD : ppmrHeaderEnd(header, 1);
+  }
+  if (keyLength == 5 && strncmp(line, "WIDTH", 5) == 0)
+    return ppmrPamValue(value, PPMR_MAX_SIDE, &header->width);
+  if (keyLength == 6 && strncmp(line, "HEIGHT", 6) == 0)
+    return ppmrPamValue(value, PPMR_MAX_SIDE, &header->height);
+  if (keyLength == 5 && strncmp(line, "DEPTH", 5) == 0)
+    return ppmrPamValue(value, 4, &header->depth);
+  if (keyLength == 6 && strncmp(line, "MAXVAL", 6) == 0)
+    return ppmrPamValue(value, 65535, &header->maxColor);
+  return PPMR_HEADER_BAD;
+}
+
+// take the next header byte c
+static inline int ppmrHeaderByte(PpmHeader *header, int c)
+{
+  static const unsigned long limit[5] = {0, 0, PPMR_MAX_SIDE, PPMR_MAX_SIDE,
+                                         65535};
+  int space = c >= 0 && ppmrIsSpace((unsigned char) c);
+
+  if (++header->bytes > PPMR_HEADER_MAX)
+  {
+    return PPMR_HEADER_BAD;
+  }
+  if (header->comment)
+  {
+    header->comment = c != '\n' && c != '\r';
+    return c < 0 ? PPMR_HEADER_BAD : PPMR_HEADER_MORE;
+  }
+
+  switch (header->field)
+  {
+    case 0:
+      header->field = 1;
+      return c == 'P' ? PPMR_HEADER_MORE : PPMR_HEADER_BAD;
+    case 1:
+      header->field = 2;
+      header->version = c - '0';
+      header->depth = c == '3' || c == '6' ? 3 : c == '7' ? 0 : 1;
+      return c >= '1' && c <= '7' ? PPMR_HEADER_MORE : PPMR_HEADER_BAD;
+  }
+  if (header->version == 7)
+  {
+    return ppmrPamByte(header, c);
+  }
+
+  if (c >= '0' && c <= '9')
+  {
+    // numbers need something between them, and stay under their limit
+    if ((header->digits == 0 && !header->gap) ||
+        (header->value = header->value * 10 + (c - '0')) >
+        limit[header->field])
+    {
+      return PPMR_HEADER_BAD;
+    }
+    header->digits++;
+    return PPMR_HEADER_MORE;
+  }
+  if (!space && c != '#')
+  {
+    return PPMR_HEADER_BAD;
+  }
+
+  header->gap = 1;
+  header->comment = c == '#';
+  if (header->digits == 0)
+  {
+    return PPMR_HEADER_MORE;
+  }
+
+  // a number just ended
+  if (header->value == 0)
+  {
+    return PPMR_HEADER_BAD;
+  }
+  switch (header->field++)
+  {
+    case 2:
+      header->width = (int) header->value;
+      break;
+    case 3:
+      header->height = (int) header->value;
+      if (header->version == 1 || header->version == 4)
+      {
+        // bitmaps have no maxColor, the raster follows the height
+        header->maxColor = 1;
+        return ppmrHeaderEnd(header, space);
+      }
+      break;
+    default:
+      // the raster starts right after maxColor's one whitespace byte
+      header->maxColor = (int) header->value;
+      return ppmrHeaderEnd(header, space);
+  }
+  header->digits = 0;
+  header->value = 0;
+  return PPMR_HEADER_MORE;
+}
+
+// Parse a header already in memory. Returns its length, so the raster
+// starts at text + length, or 0 when text doesn't start with a complete,
+// valid header.
+static inline size_t ppmParseHeader(const unsigned char *text, size_t len,
+                                      PpmHeader *header)
+{
+  size_t i;
+
+  memset(header, 0, sizeof(PpmHeader));
+  for (i = 0; i < len; i++)
+  {
+    int status = ppmrHeaderByte(header, text[i]);
+
+    if (status != PPMR_HEADER_MORE)
+    {
+      return status == PPMR_HEADER_DONE ? i + 1 : 0;
+    }
+  }
+  return 0;
+}
+
+// whether what is left of in after the header, plus buffered bytes already
+// read from it, can hold the raster, so that a header claiming far more
+// than the file has is turned away before the raster is allocated. Pipes
+// and the like can't tell and always pass.
+static inline int ppmrRasterFits(FILE *in, const PpmHeader *header,
+                                   size_t buffered)
+{
+  unsigned long long pixels = (unsigned long long) header->width *
+                              header->height;
+  unsigned long long samples = pixels * header->depth, need;
+  long long here = ppmrTell(in);
+#ifdef _WIN32
+  struct _stat64 st;
+  if (here < 0 || _fstat64(_fileno(in), &st) != 0 ||
+      !(st.st_mode & _S_IFREG))
+#else
+  struct stat st;
+  if (here < 0 || fstat(fileno(in), &st) != 0 || !S_ISREG(st.st_mode))
+#endif
+  {
+    return 1;
+  }
+
+  // P2 and P3 samples are at least a digit and a space, P1 ones a digit
+  switch (header->version)
+  {
+    case 1:
+      need = pixels;
+      break;
+    case 2:
+    case 3:
+      need = samples * 2 - 1;
+      break;
+    case 4:
+      need = (unsigned long long) (header->width + 7) / 8 * header->height;
+      break;
+    default:
+      need = samples * (header->maxColor > 255 ? 2 : 1);
+  }
+  return (unsigned long long) st.st_size - here + buffered >= need;
+}
+
+// read a header from in, after bytes already taken out of it (next bytes
+// of buffered), skipping whitespace before it when skip is set. Returns 1 on
+// a bad header, or when in ends before one starts.
+static inline int ppmrReadHeader(FILE *in, PpmHeader *header,
+                                   const unsigned char *buffered, size_t *left,
+                                   int skip)
+{
+  size_t used = 0;
+  int status = PPMR_HEADER_MORE, c;
+
+  memset(header, 0, sizeof(PpmHeader));
+  do
+  {
+    c = used < *left ? buffered[used++] : getc(in);
+  }
+  while (skip && c >= 0 && ppmrIsSpace((unsigned char) c));
+
+  while (status == PPMR_HEADER_MORE)
+  {
+    status = ppmrHeaderByte(header, c);
+    if (status == PPMR_HEADER_MORE)
+    {
+      c = used < *left ? buffered[used++] : getc(in);
+    }
+  }
+  *left -= used;
+  return status != PPMR_HEADER_DONE ||
+         !ppmrRasterFits(in, header, *left);
+}
 
-//parse the header
+// Parse the header at the start of in, leaving in at the first raster byte.
+// Returns 1 on a malformed header, one over the PPMR_MAX_* limits, or a file
+// too short for the raster it describes.
 static inline int parseH(FILE *fr, int *width, int *height,
                            int *maxColor, int *version)
 {
-  char c; // Character value
+  PpmHeader header;
+  size_t left = 0;
 
-  fscanf(fr, "P%c\n", &c);
-  if (c != '3' && c != '6') //valid type?
+  if (ppmrReadHeader(fr, &header, NULL, &left, 0))
   {
-      return 1;
+    return 1;
+  }
+  *width = header.width;
+  *height = header.height;
+  *maxColor = header.maxColor;
+  *version = header.version;
+  return 0;
+}
+
+
+static inline int ppmrCountTrailingZeros(unsigned x)
+{
+#ifdef _MSC_VER
+  unsigned long i;
+  _BitScanForward(&i, x);
+  return (int) i;
+#else
+  return __builtin_ctz(x);
+#endif
+}
+
+static inline int ppmrPopcount(unsigned x)
+{
+  x = x - ((x >> 1) & 0x55555555u);
+  x = (x & 0x33333333u) + ((x >> 2) & 0x33333333u);
+  return (int) ((((x + (x >> 4)) & 0x0f0f0f0fu) * 0x01010101u) >> 24);
+}
+
+// bit i set when p[i] is a decimal digit, for the 16 bytes at p
+static inline unsigned ppmrDigitMask(const unsigned char *p)
+{
+#ifdef PPMR_SSE2
+  // shift '0'..'9' down to -128..-119 so one signed compare classifies them
+  __m128i v = _mm_loadu_si128((const __m128i *) p);
+  __m128i d = _mm_sub_epi8(v, _mm_set1_epi8('0' - 128));
+  return (unsigned) _mm_movemask_epi8(_mm_cmplt_epi8(d, _mm_set1_epi8(-118)));
+#else
+  unsigned m = 0;
+  int i;
+  for (i = 0; i < 16; i++)
+  {
+    m |= (unsigned) (p[i] - '0' < 10u) << i;
+  }
+  return m;
+#endif
+}
+
+// count the numbers in [p, end), 16 bytes per step
+static inline size_t countP3Tokens(const unsigned char *p,
+                                     const unsigned char *end)
+{
+  size_t tokens = 0;
+  unsigned carry = 0; // last byte of the previous block was a digit
+
+  while (p < end)
+  {
+    unsigned m = ppmrDigitMask(p);
+    if (end - p < 16)
+    {
+      m &= (1u << (end - p)) - 1;
+    }
+    tokens += ppmrPopcount(m & ~((m << 1) | carry));
+    carry = m >> 15;
+    p += 16;
   }
-  *version = atoi(&c); //store version
+  return tokens;
+}
+
+// decode up to want samples from [*pp, end) into out, leaving *pp just past
+// the last number used and the count in *got. The digit run of each number
+// is found with one 16-byte classification, so there must be PPMR_PAD
+// readable bytes past end. Returns 1 on a byte that is neither a digit nor
+// whitespace, a number of more than 5 digits, or a sample over maxColor.
+// Defined once for 8-bit (decodeP3Span) and once for 16-bit samples
+// (decodeP3Span16).
+#define PPMR_DEFINE_P3_SPAN(name, type) \
+static inline int name(const unsigned char **pp, const unsigned char *end, \
+                       type *out, size_t want, size_t *got, int maxColor) \
+{ \
+  const unsigned char *p = *pp; \
+  size_t n = 0; \
+  int status = 0; \
+\
+  while (n < want && p < end) \
+  { \
+    unsigned m; \
+    int len, value; \
+\
+    if (ppmrIsSpace(*p)) \
+    { \
+      p++; \
+      continue; \
+    } \
+\
+    m = ppmrDigitMask(p); \
+    len = ppmrCountTrailingZeros(~m); \
+    if (len == 0 || len > 5) \
+    { \
+      status = 1; \
+      break; \
+    } \
+\
+    switch (len) \
+    { \
+      case 1: \
+        value = p[0] - '0'; \
+        break; \
+      case 2: \
+        value = (p[0] - '0') * 10 + (p[1] - '0'); \
+        break; \
+      case 3: \
+        value = (p[0] - '0') * 100 + (p[1] - '0') * 10 + (p[2] - '0'); \
+        break; \
+      default: \
+      { \
+        int i; \
+        value = 0; \
+        for (i = 0; i < len; i++) \
+        { \
+          value = value * 10 + (p[i] - '0'); \
+        } \
+      } \
+    } \
+    if (value > maxColor) \
+    { \
+      status = 1; \
+      break; \
+    } \
+\
+    out[n++] = (type) value; \
+    p += len; \
+  } \
+\
+  *pp = p; \
+  *got = n; \
+  return status; \
+}
+
+PPMR_DEFINE_P3_SPAN(decodeP3Span, unsigned char)
+PPMR_DEFINE_P3_SPAN(decodeP3Span16, unsigned short)
+
+// decodeP3Span for P1 bitmaps, where every 0 or 1 is a sample, with or
+// without whitespace between them. 1 is black and comes out as 0, 0 as 255.
+static inline int decodeP1Span(const unsigned char **pp,
+                                 const unsigned char *end, unsigned char *out,
+                                 size_t want, size_t *got)
+{
+  const unsigned char *p = *pp;
+  size_t n = 0;
+  int status = 0;
 
-  c = getc(fr);   // handle comments
-  while (c == '#')
+  for (; n < want && p < end; p++)
   {
-    do
+    if (*p == '0' || *p == '1')
     {
-      c = getc(fr);
+      out[n++] = *p == '0' ? 255 : 0;
+    }
+    else if (!ppmrIsSpace(*p))
+    {
+      status = 1;
+      break;
     }
-    while (c != '\n');
-    c = getc(fr);
   }
+  *pp = p;
+  *got = n;
+  return status;
+}
+
+// decode exactly want samples from [p, end), returns 1 on bad or missing data.
+// decodeP3 only takes maxval 255 text.
+static inline int decodeP3Tokens(const unsigned char *p,
+                                   const unsigned char *end,
+                                   unsigned char *out, size_t want)
+{
+  size_t got;
 
-  //should be a number next
-  if (!isdigit(c))
+  if (decodeP3Span(&p, end, out, want, &got, 255))
   {
     return 1;
   }
-  ungetc(c, fr);
+  return got != want;
+}
+
+static EZTHREAD_FUNC(countP3Chunk, arg)
+{
+  P3Chunk *chunk = (P3Chunk *) arg;
+  chunk->tokens = countP3Tokens(chunk->begin, chunk->end);
+  return EZTHREAD_RETURN;
+}
 
+static EZTHREAD_FUNC(decodeP3Chunk, arg)
+{
+  P3Chunk *chunk = (P3Chunk *) arg;
+  chunk->status = decodeP3Tokens(chunk->begin, chunk->end, chunk->out,
+                                 chunk->want);
+  return EZTHREAD_RETURN;
+}
 
-  //grab values from header
-  fscanf(fr, "%d%d%d\n", width, height, maxColor);
+// run func over every chunk, one thread each. Chunks whose thread can't be
+// started run on the calling thread instead.
+static inline void runP3Chunks(P3Chunk *chunks, ezThread *ids, int threads,
+                                 ezThreadFunc func)
+{
+  int i, started;
 
-  return 0;
+  for (started = 0; started < threads; started++)
+  {
+    if (ezThreadCreate(&ids[started], func, &chunks[started]))
+    {
+      break;
+    }
+  }
+  for (i = started; i < threads; i++)
+  {
+    func(&chunks[i]);
+  }
+  for (i = 0; i < started; i++)
+  {
+    ezThreadJoin(ids[i]);
+  }
 }
 
+// decode count pixels of P3 text. The text is cut into one slice per thread
+// at whitespace, each slice is counted in parallel, a prefix sum gives every
+// slice its first sample, then the slices are decoded in parallel. text must
+// have PPMR_PAD readable bytes past len. Returns 1 on bad or missing data.
+static inline int decodeP3(const unsigned char *text, size_t len,
+                             Pixel *buffer, size_t count, int threads)
+{
+  unsigned char *samples = (unsigned char *) buffer;
+  size_t need = count * 3;
+  size_t offset = 0;
+  P3Chunk *chunks;
+  ezThread *ids;
+  int i, status = 0;
 
-static inline void readP3(FILE *in, Pixel *buffer, int *width, int *height, int *maxColor)
+  if (threads < 1 || len < PPMR_PARALLEL_MIN)
+  {
+    threads = 1;
+  }
+  if (threads == 1)
   {
-  int c;
-  int r, g, b;
-  int i = 0;
-  int arryMax = *width * *height;
+    return decodeP3Tokens(text, text + len, samples, need);
+  }
 
+  chunks = malloc(sizeof(P3Chunk) * threads);
+  ids = malloc(sizeof(ezThread) * threads);
+  if (chunks == NULL || ids == NULL)
+  {
+    free(chunks);
+    free(ids);
+    return decodeP3Tokens(text, text + len, samples, need);
+  }
 
-  while (i < arryMax) {
-      if ((c = fgetc(in)) != EOF) //if still values left
-      {
-        ungetc(c, in);
+  for (i = 0; i < threads; i++)
+  {
+    size_t cut = len / threads * i;
+    while (i > 0 && cut < len && !ppmrIsSpace(text[cut]))
+    {
+      cut++;
+    }
+    chunks[i].begin = text + cut;
+    if (i > 0)
+    {
+      chunks[i - 1].end = chunks[i].begin;
+    }
+  }
+  chunks[threads - 1].end = text + len;
 
-        //get pixel
-        if (fscanf(in, "%d%d%d", &r, &g, &b) == 3) {
-          buffer[i].r = (unsigned char) r;
-          buffer[i].g = (unsigned char) g;
-          buffer[i].b = (unsigned char) b;
-        }
-      i++;
+  runP3Chunks(chunks, ids, threads, countP3Chunk);
+
+  for (i = 0; i < threads; i++)
+  {
+    chunks[i].out = samples + offset;
+    chunks[i].want = offset >= need ? 0 :
+                     chunks[i].tokens < need - offset ? chunks[i].tokens :
+                     need - offset;
+    chunks[i].status = 0;
+    offset += chunks[i].want;
+  }
+
+  if (offset < need)
+  {
+    status = 1; // truncated
+  }
+  else
+  {
+    runP3Chunks(chunks, ids, threads, decodeP3Chunk);
+    for (i = 0; i < threads; i++)
+    {
+      status |= chunks[i].status;
+    }
+  }
+
+  free(chunks);
+  free(ids);
+  return status;
+}
+
+// slurp everything left in the file into one buffer with PPMR_PAD zero
+// bytes of slack at the end
+static inline unsigned char *readRest(FILE *in, size_t *len)
+{
+  size_t cap = 1 << 16, used = 0, got;
+  unsigned char *text, *grown;
+  long long here = ppmrTell(in);
+
+  if (here >= 0 && ppmrSeek(in, 0, SEEK_END) == 0)
+  {
+    long long end = ppmrTell(in);
+    if (end > here)
+    {
+      cap = (size_t) (end - here) + 1;
+    }
+    ppmrSeek(in, here, SEEK_SET);
+  }
+
+  text = malloc(cap + PPMR_PAD);
+  if (text == NULL)
+  {
+    return NULL;
+  }
+
+  while ((got = fread(text + used, 1, cap - used, in)) > 0)
+  {
+    used += got;
+    if (used == cap)
+    {
+      cap *= 2;
+      grown = realloc(text, cap + PPMR_PAD);
+      if (grown == NULL)
+      {
+        free(text);
+        return NULL;
+      }
+      text = grown;
     }
   }
+
+  memset(text + used, 0, PPMR_PAD);
+  *len = used;
+  return text;
+}
+
+// read a whole raster through a PpmReader, for rasters that need rescaling
+static inline int ppmrReadAll(FILE *in, Pixel *buffer, int width, int height,
+                                int maxColor, int version)
+{
+  PpmReader reader;
+  int status = 1;
+
+  if (!ppmAttach(&reader, in, width, height, maxColor, version, 3))
+  {
+    status = ppmReadRows(&reader, buffer, height) != height;
+  }
+  ppmClose(&reader);
+  return status;
+}
+
+static inline int readP3(FILE *in, Pixel *buffer, int *width, int *height,
+                           int *maxColor)
+{
+  return readP3Threaded(in, buffer, width, height, maxColor, 1);
+}
+
+// readP3, decoding with up to threads threads on large files
+static inline int readP3Threaded(FILE *in, Pixel *buffer, int *width,
+                                   int *height, int *maxColor, int threads)
+{
+  size_t len;
+  int status;
+  unsigned char *text;
+
+  if (*maxColor != 255)
+  {
+    return ppmrReadAll(in, buffer, *width, *height, *maxColor, 3);
+  }
+
+  text = readRest(in, &len);
+  if (text == NULL)
+  {
+    return 1;
+  }
+
+  status = decodeP3(text, len, buffer, (size_t) *width * (size_t) *height,
+                    threads);
+  free(text);
+  return status;
+}
+
+// read the whole raster with a single fread, returns 1 on a short file
+static inline int readP6(FILE *in, Pixel *buffer, int *width,
+                           int *height, int *maxColor) {
+  size_t arryMax = (size_t) *width * (size_t) *height;
+
+  if (*maxColor != 255)
+  {
+    return ppmrReadAll(in, buffer, *width, *height, *maxColor, 6);
+  }
+
+  if (fread(buffer, sizeof(Pixel), arryMax, in) != arryMax)
+  {
+    return 1;
+  }
+  return 0;
 }
 
-static inline void readP6(FILE *in, Pixel *buffer, int *width,
-                            int *height, int *maxColor) {
-  unsigned char *charBuffer = malloc(sizeof(unsigned char));
-  int i = 0;
-  int color;
-  int arryMax = (*width) * (*height);
+// map the raster that follows the header just parsed from in, so it can be
+// handed to glTexImage2D with no intermediate copy. Returns 1 when the file
+// can't be mapped (pipes, truncated files), the caller should fall back to
+// readP6 in that case.
+static inline int mapP6(FILE *in, PixelMap *map, int *width, int *height)
+{
+  long long offset = ppmrTell(in);
+  size_t rasterSize = (size_t) *width * (size_t) *height * sizeof(Pixel);
 
-  while (fread(charBuffer, 1, 1, in) && i < arryMax) //add pixels to rgb
+  memset(map, 0, sizeof(PixelMap));
+  if (offset < 0)
   {
-    color = *charBuffer;
-    buffer[i].r = (unsigned char) color;
-    fread(charBuffer, 1, 1, in);
-    color = *charBuffer;
-    buffer[i].g = (unsigned char) color;
-    fread(charBuffer, 1, 1, in);
-    color = *charBuffer;
-    buffer[i].b = (unsigned char) color;
-    i++;
+    return 1;
   }
+
+#ifdef _WIN32
+  {
+    HANDLE file = (HANDLE) _get_osfhandle(_fileno(in));
+    LARGE_INTEGER size;
+
+    if (file == INVALID_HANDLE_VALUE || !GetFileSizeEx(file, &size) ||
+        (unsigned long long) size.QuadPart < (unsigned long long) offset + rasterSize)
+    {
+      return 1;
+    }
+
+    map->mapping = CreateFileMapping(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (map->mapping == NULL)
+    {
+      return 1;
+    }
+
+    map->base = MapViewOfFile(map->mapping, FILE_MAP_READ, 0, 0, 0);
+    if (map->base == NULL)
+    {
+      CloseHandle(map->mapping);
+      map->mapping = NULL;
+      return 1;
+    }
+    map->length = (size_t) size.QuadPart;
+  }
+#else
+  {
+    struct stat st;
+
+    if (fstat(fileno(in), &st) != 0 || !S_ISREG(st.st_mode) ||
+        (unsigned long long) st.st_size < (unsigned long long) offset + rasterSize)
+    {
+      return 1;
+    }
+
+    map->base = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE,
+                     fileno(in), 0);
+    if (map->base == MAP_FAILED)
+    {
+      map->base = NULL;
+      return 1;
+    }
+    map->length = (size_t) st.st_size;
+#ifdef MADV_SEQUENTIAL
+    madvise(map->base, map->length, MADV_SEQUENTIAL);
+#endif
+  }
+#endif
+
+  map->pixels = (Pixel *) ((unsigned char *) map->base + offset);
+  return 0;
+}
+
+static inline void unmapP6(PixelMap *map)
+{
+  if (map->base == NULL)
+  {
+    return;
+  }
+#ifdef _WIN32
+  UnmapViewOfFile(map->base);
+  CloseHandle(map->mapping);
+#else
+  munmap(map->base, map->length);
+#endif
+  memset(map, 0, sizeof(PixelMap));
+}
+
+// write a complete P3 image, returns 1 on a write error
+static inline int writeP3(FILE *out, const Pixel *buffer, int width,
+                            int height)
+{
+  PpmWriter writer;
+  int status;
+
+  status = ppmWriterOpen(&writer, out, width, height, 3) ||
+           ppmWriteRows(&writer, buffer, height);
+  return ppmWriterClose(&writer) || status;
+}
+
+// write a complete P6 image, returns 1 on a write error
+static inline int writeP6(FILE *out, const Pixel *buffer, int width,
+                            int height)
+{
+  PpmWriter writer;
+  int status;
+
+  status = ppmWriterOpen(&writer, out, width, height, 6) ||
+           ppmWriteRows(&writer, buffer, height);
+  return ppmWriterClose(&writer) || status;
+}
+
+// Get ready to write a width x height image as P3 or P6 (version 3 or 6),
+// returns 1 on a bad version or when out of memory. The caller keeps
+// ownership of out and must call ppmWriterClose either way.
+static inline int ppmWriterOpen(PpmWriter *writer, FILE *out, int width,
+                                  int height, int version)
+{
+  int i;
+
+  memset(writer, 0, sizeof(PpmWriter));
+  writer->out = out;
+  writer->width = width;
+  writer->height = height;
+  writer->version = version;
+  sprintf(writer->header, "P%d\n%d %d\n255\n", version, width, height);
+  if (version == 6)
+  {
+    return 0;
+  }
+  if (version != 3)
+  {
+    return 1;
+  }
+
+  // the 4 bytes are copied whole and only length of them kept
+  for (i = 0; i < 256; i++)
+  {
+    unsigned char *d = writer->digits[i];
+    int n = 0;
+
+    if (i >= 100)
+      d[n++] = (unsigned char) ('0' + i / 100);
+    if (i >= 10)
+      d[n++] = (unsigned char) ('0' + i / 10 % 10);
+    d[n++] = (unsigned char) ('0' + i % 10);
+    d[n++] = ' ';
+    writer->length[i] = (unsigned char) n;
+  }
+
+  // "255 " per sample, plus the 4 bytes the last copy may run over
+  writer->text = malloc((size_t) width * 12 + 4);
+  return writer->text == NULL;
+}
+
+#ifdef PPMR_WRITEV
+// write all of iov to fd, going on after short writes
+static inline int ppmWriteAll(int fd, struct iovec *iov, int count)
+{
+  while (count > 0)
+  {
+    ssize_t n = writev(fd, iov, count);
+
+    if (n < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      return 1;
+    }
+    while (count > 0 && (size_t) n >= iov->iov_len)
+    {
+      n -= iov->iov_len;
+      iov++;
+      count--;
+    }
+    if (count > 0)
+    {
+      iov->iov_base = (char *) iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+  return 0;
+}
+#endif
+
+// write the header if it hasn't gone out yet
+static inline int ppmWriteHeader(PpmWriter *writer)
+{
+  size_t length = strlen(writer->header);
+
+  if (length > 0 && fwrite(writer->header, 1, length, writer->out) != length)
+  {
+    return 1;
+  }
+  writer->header[0] = '\0';
+  return 0;
+}
+
+// format one row as P3 text into the writer's row buffer, returns its length
+static inline size_t ppmFormatRow(PpmWriter *writer, const Pixel *row)
+{
+  const unsigned char *c = &row->r;
+  unsigned char *p = writer->text;
+  int x, k;
+
+  for (x = 0; x < writer->width; x++, c += 3)
+  {
+    for (k = 0; k < 3; k++)
+    {
+      memcpy(p, writer->digits[c[k]], 4);
+      p += writer->length[c[k]];
+    }
+    if ((x + 1) % PPMR_P3_LINE == 0 || x + 1 == writer->width)
+    {
+      p[-1] = '\n';
+    }
+  }
+  return (size_t) (p - writer->text);
+}
+
+// append count rows, returns 1 on a write error or past the last row
+static inline int ppmWriteRows(PpmWriter *writer, const Pixel *rows,
+                                 int count)
+{
+  size_t pixels = (size_t) writer->width * (size_t) count;
+  int y;
+
+  if (count < 0 || count > writer->height - writer->row)
+  {
+    return 1;
+  }
+
+  if (writer->version == 3)
+  {
+    if (ppmWriteHeader(writer))
+    {
+      return 1;
+    }
+    for (y = 0; y < count; y++)
+    {
+      size_t length = ppmFormatRow(writer, rows + (size_t) y * writer->width);
+
+      if (fwrite(writer->text, 1, length, writer->out) != length)
+      {
+        return 1;
+      }
+    }
+  }
+#ifdef PPMR_WRITEV
+  else if (sizeof(Pixel) * pixels >= PPMR_DIRECT_MIN)
+  {
+    struct iovec iov[2];
+    int n = 0;
+
+    // whatever stdio holds has to go first
+    if (fflush(writer->out) != 0)
+    {
+      return 1;
+    }
+    if (writer->header[0] != '\0')
+    {
+      iov[n].iov_base = writer->header;
+      iov[n++].iov_len = strlen(writer->header);
+    }
+    iov[n].iov_base = (void *) rows;
+    iov[n++].iov_len = sizeof(Pixel) * pixels;
+    if (ppmWriteAll(fileno(writer->out), iov, n))
+    {
+      return 1;
+    }
+    writer->header[0] = '\0';
+  }
+#endif
+  else if (ppmWriteHeader(writer) ||
+           fwrite(rows, sizeof(Pixel), pixels, writer->out) != pixels)
+  {
+    return 1;
+  }
+  writer->row += count;
+  return 0;
+}
+
+// Finish the image and free the writer. Returns 1 when rows are missing or
+// out couldn't be flushed.
+static inline int ppmWriterClose(PpmWriter *writer)
+{
+  int status = ppmWriteHeader(writer);
+
+  free(writer->text);
+  writer->text = NULL;
+  return status || writer->row != writer->height ||
+         fflush(writer->out) != 0;
+}
+
+// parse the header of in and get ready to hand out rows, returns 1 on a bad
+// header. The caller keeps ownership of in.
+static inline int ppmOpen(PpmReader *reader, FILE *in)
+{
+  PpmHeader header;
+  size_t left = 0;
+
+  memset(reader, 0, sizeof(PpmReader));
+  if (ppmrReadHeader(in, &header, NULL, &left, 0))
+  {
+    return 1;
+  }
+  return ppmAttach(reader, in, header.width, header.height, header.maxColor,
+                   header.version, header.depth);
+}
+
+// Move on to the next image of a multi-image stream (several images one
+// after the other in one file), skipping what is left of the current one.
+// Returns 1 at the end of the stream, on bad data or when out of memory.
+static inline int ppmNextImage(PpmReader *reader)
+{
+  FILE *in = reader->in;
+  unsigned char *text = reader->text;
+  size_t pos = reader->pos, left = reader->used - reader->pos;
+  size_t end;
+  int eof = reader->eof, status;
+  PpmHeader header;
+
+  // binary rasters are seeked over when the stream allows it
+  if (reader->row < reader->height && reader->version >= 4)
+  {
+    long long rowBytes = reader->version == 4 ? (reader->width + 7) / 8 :
+                         (long long) reader->width * reader->depth *
+                         (reader->maxColor > 255 ? 2 : 1);
+    if (ppmrSeek(in, rowBytes * (reader->height - reader->row),
+                 SEEK_CUR) == 0)
+    {
+      reader->row = reader->height;
+    }
+  }
+  if (reader->row < reader->height)
+  {
+    Pixel *row = malloc(sizeof(Pixel) * reader->width);
+    int rows = 1;
+
+    while (row != NULL && rows > 0)
+    {
+      rows = ppmReadRows(reader, row, 1);
+    }
+    free(row);
+    if (rows != 0)
+    {
+      return 1;
+    }
+    text = reader->text;
+    pos = reader->pos;
+    left = reader->used - reader->pos;
+    eof = reader->eof;
+  }
+
+  // text the window read past the end of the image starts the next one
+  end = pos + left;
+  reader->text = NULL;
+  ppmClose(reader);
+  status = ppmrReadHeader(in, &header, text != NULL ? text + pos : NULL,
+                          &left, 1) ||
+           ppmAttach(reader, in, header.width, header.height,
+                     header.maxColor, header.version, header.depth);
+  if (!status && reader->text != NULL)
+  {
+    if (left > 0)
+      memcpy(reader->text, text + end - left, left);
+    memset(reader->text + left, 0, PPMR_PAD);
+    reader->used = left;
+    reader->eof = eof;
+  }
+  else if (!status && left > 0)
+  {
+    // a binary raster right after text, back up to it
+    status = ppmrSeek(in, -(long long) left, SEEK_CUR) != 0;
+  }
+  free(text);
+  return status;
+}
+
+// open in and move on to image index of its stream, returns 1 when there is
+// no such image or it is bad
+static inline int ppmOpenImage(PpmReader *reader, FILE *in, int index)
+{
+  int i;
+
+  if (ppmOpen(reader, in))
+  {
+    return 1;
+  }
+  for (i = 0; i < index; i++)
+  {
+    if (ppmNextImage(reader))
+    {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Count the images of the stream in, cheaply: binary images are seeked
+// over, and a plain text image ends the count since finding where it ends
+// means decoding it. Returns 0 when in doesn't start with an image.
+static inline int ppmCountImages(FILE *in)
+{
+  PpmReader reader;
+  int count = 0;
+
+  if (!ppmOpen(&reader, in))
+  {
+    count = 1;
+    while (reader.version >= 4 && !ppmNextImage(&reader))
+    {
+      count++;
+    }
+  }
+  ppmClose(&reader);
+  return count;
+}
+
+// get ready to hand out the raster that follows an already parsed header.
+// Returns 1 when out of memory.
+static inline int ppmAttach(PpmReader *reader, FILE *in, int width,
+                              int height, int maxColor, int version,
+                              int depth)
+{
+  // 4x4 ordered dither, in 1/16ths of an output step
+  static const unsigned char bayer[4][4] = {
+    {0, 8, 2, 10}, {12, 4, 14, 6}, {3, 11, 1, 9}, {15, 7, 13, 5}
+  };
+  size_t v, i, rowLen = (size_t) 3 * width;
+
+  memset(reader, 0, sizeof(PpmReader));
+  reader->in = in;
+  reader->width = width;
+  reader->height = height;
+  reader->maxColor = maxColor;
+  reader->version = version;
+  reader->depth = depth;
+  reader->expand8 = ppmrKernels()->expand8[depth];
+  reader->expand16 = ppmrKernels()->expand16[depth];
+
+  if (version <= 3)
+  {
+    reader->text = malloc(PPMR_WINDOW + PPMR_PAD);
+    if (reader->text == NULL)
+    {
+      return 1;
+    }
+    memset(reader->text, 0, PPMR_PAD);
+  }
+  if (version == 4 || depth == 4)
+  {
+    reader->scratch = malloc(version == 4 ? (size_t) (width + 7) / 8 :
+                             (size_t) 8 * width);
+    if (reader->scratch == NULL)
+    {
+      return 1;
+    }
+  }
+
+  // bitmaps come out of the decoder as 0 and 255 already
+  if (maxColor < 255 && version != 1 && version != 4)
+  {
+    reader->scale = malloc(256);
+    if (reader->scale == NULL)
+    {
+      return 1;
+    }
+    for (v = 0; v < 256; v++)
+    {
+      reader->scale[v] = (int) v >= maxColor ? 255 :
+          (unsigned char) ((v * 255 + maxColor / 2) / maxColor);
+    }
+  }
+  else if (maxColor > 255)
+  {
+    reader->fixed = malloc(sizeof(unsigned short) * 65536);
+    reader->dither = malloc(sizeof(unsigned short) * 4 * rowLen);
+    if (reader->fixed == NULL || reader->dither == NULL)
+    {
+      return 1;
+    }
+    for (v = 0; v < 65536; v++)
+    {
+      reader->fixed[v] = (int) v >= maxColor ? 65280 :
+          (unsigned short) ((v * 65280 + maxColor / 2) / maxColor);
+    }
+    for (v = 0; v < 4; v++)
+    {
+      for (i = 0; i < rowLen; i++)
+      {
+        reader->dither[v * rowLen + i] = bayer[v][(i / 3) & 3] * 16 + 8;
+      }
+    }
+  }
+  return 0;
+}
+
+// read want P1, P2 or P3 samples into out, 16-bit when wide is set.
+// Returns 1 on bad or truncated data.
+static inline int ppmrReadText(PpmReader *reader, void *out, size_t want,
+                                 int wide)
+{
+  size_t have = 0;
+
+  while (have < want)
+  {
+    const unsigned char *p = reader->text + reader->pos;
+    const unsigned char *safe = reader->text + reader->used;
+    size_t got;
+    int status;
+
+    // a number touching the end of the window may continue in the file,
+    // P1 samples are a single digit each
+    if (!reader->eof && reader->version != 1)
+    {
+      while (safe > p && !ppmrIsSpace(safe[-1]))
+      {
+        safe--;
+      }
+    }
+
+    status = reader->version == 1 ?
+      decodeP1Span(&p, safe, (unsigned char *) out + have, want - have,
+                   &got) :
+      wide ?
+      decodeP3Span16(&p, safe, (unsigned short *) out + have, want - have,
+                     &got, reader->maxColor) :
+      decodeP3Span(&p, safe, (unsigned char *) out + have, want - have, &got,
+                   reader->maxColor);
+    if (status)
+    {
+      return 1;
+    }
+    have += got;
+    reader->pos = p - reader->text;
+
+    if (have == want)
+    {
+      break;
+    }
+    if (reader->eof)
+    {
+      return 1;
+    }
+
+    // keep the partial number and refill the rest of the window
+    memmove(reader->text, reader->text + reader->pos,
+            reader->used - reader->pos);
+    reader->used -= reader->pos;
+    reader->pos = 0;
+    if (reader->used == PPMR_WINDOW)
+    {
+      return 1; // no whitespace in a whole window
+    }
+
+    got = fread(reader->text + reader->used, 1, PPMR_WINDOW - reader->used,
+                reader->in);
+    if (got == 0)
+    {
+      reader->eof = 1;
+    }
+    reader->used += got;
+    memset(reader->text + reader->used, 0, PPMR_PAD);
+  }
+  return 0;
+}
+
+// swap the bytes of count 16-bit values, P6 stores them big-endian
+static inline void ppmrSwap16(unsigned short *values, size_t count)
+{
+  size_t i = 0;
+
+#ifdef PPMR_SSE2
+  for (; i + 8 <= count; i += 8)
+  {
+    __m128i v = _mm_loadu_si128((const __m128i *) (values + i));
+    v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+    _mm_storeu_si128((__m128i *) (values + i), v);
+  }
+#endif
+  for (; i < count; i++)
+  {
+    values[i] = (unsigned short) ((values[i] << 8) | (values[i] >> 8));
+  }
+}
+
+// Unpack a row of P4 bits to one byte a pixel, 0 for a set (black) bit and
+// 255 for a clear one. Each byte of bits is spread over eight bytes with a
+// multiply and mask, sixteen at a time with SSE2.
+static inline void ppmrUnpackBits(const unsigned char *bits, unsigned char *out,
+                                    int width)
+{
+  const unsigned long long spread = 0x0101010101010101ull;
+  const unsigned long long select = 0x0102040810204080ull; // MSB first
+  const unsigned long long high = 0x8080808080808080ull;
+  int x = 0;
+
+#ifdef PPMR_SSE2
+  const __m128i mask = _mm_set_epi64x((long long) select, (long long) select);
+  const __m128i zero = _mm_setzero_si128();
+
+  for (; x + 16 <= width; x += 16)
+  {
+    __m128i v = _mm_set_epi64x((long long) (bits[x / 8 + 1] * spread),
+                               (long long) (bits[x / 8] * spread));
+    _mm_storeu_si128((__m128i *) (out + x),
+                     _mm_cmpeq_epi8(_mm_and_si128(v, mask), zero));
+  }
+#endif
+  for (; x + 8 <= width; x += 8)
+  {
+    // 0x80 in every byte whose bit is set, then 0x00 / 0xff the other way
+    unsigned long long v = (bits[x / 8] * spread) & select;
+    v = ((v | (v + 0x7f7f7f7f7f7f7f7full)) & high) >> 7;
+    v = ~(v * 0xff);
+    memcpy(out + x, &v, 8);
+  }
+  for (; x < width; x++)
+  {
+    out[x] = bits[x / 8] & (0x80 >> (x & 7)) ? 0 : 255;
+  }
+}
+
+// read count rows of the file's own samples (depth a pixel), 16-bit when
+// wide is set
+static inline int ppmrReadRaw(PpmReader *reader, void *out, int count,
+                                int wide)
+{
+  size_t n = (size_t) count * reader->width * reader->depth;
+  size_t rowBytes = (size_t) (reader->width + 7) / 8;
+  unsigned char *bytes = (unsigned char *) out;
+  unsigned short *values = (unsigned short *) out;
+  size_t i;
+  int y;
+
+  switch (reader->version)
+  {
+    case 2:
+    case 3:
+      return ppmrReadText(reader, out, n, wide);
+    case 1:
+      if (ppmrReadText(reader, out, n, 0))
+      {
+        return 1;
+      }
+      break;
+    case 4:
+      for (y = 0; y < count; y++)
+      {
+        if (fread(reader->scratch, 1, rowBytes, reader->in) != rowBytes)
+        {
+          return 1;
+        }
+        ppmrUnpackBits(reader->scratch, bytes + (size_t) y * reader->width,
+                       reader->width);
+      }
+      break;
+    default:
+      if (reader->maxColor > 255)
+      {
+        if (fread(values, 2, n, reader->in) != n)
+        {
+          return 1;
+        }
+        ppmrSwap16(values, n);
+        return 0;
+      }
+      if (fread(bytes, 1, n, reader->in) != n)
+      {
+        return 1;
+      }
+  }
+
+  // one byte per sample, widen in place from the back
+  if (wide)
+  {
+    for (i = n; i-- > 0;)
+    {
+      values[i] = bytes[i];
+    }
+  }
+  return 0;
+}
+
+// read count rows as RGB samples, 16-bit when wide is set, without moving
+// reader->row
+static inline int ppmrReadSamples(PpmReader *reader, void *rows, int count,
+                                    int wide)
+{
+  PpmrExpand expand = wide ? reader->expand16 : reader->expand8;
+  size_t size = wide ? 2 : 1;
+  int y;
+
+  if (reader->depth == 4)
+  {
+    // RGB and alpha doesn't fit the rows, take it a row at a time
+    for (y = 0; y < count; y++)
+    {
+      unsigned char *out = (unsigned char *) rows +
+                           (size_t) 3 * size * reader->width * y;
+
+      if (ppmrReadRaw(reader, reader->scratch, 1, wide))
+      {
+        return 1;
+      }
+      expand(reader->scratch, out, reader->width);
+    }
+    return 0;
+  }
+
+  if (ppmrReadRaw(reader, rows, count, wide))
+  {
+    return 1;
+  }
+  if (expand != NULL)
+  {
+    expand(rows, rows, (size_t) count * reader->width);
+  }
+  return 0;
+}
+
+// bring count rows of 16-bit samples down to 8 bits with an ordered dither,
+// so smooth 16-bit gradients don't band
+static inline void ppmrDither(PpmReader *reader, unsigned short *src,
+                                unsigned char *dst, int count)
+{
+  size_t rowLen = (size_t) 3 * reader->width;
+  size_t i;
+  int y;
+
+  for (y = 0; y < count; y++)
+  {
+    unsigned short *s = src + rowLen * y;
+    unsigned char *d = dst + rowLen * y;
+    const unsigned short *t = reader->dither +
+                              rowLen * ((reader->row + y) & 3);
+
+    for (i = 0; i < rowLen; i++)
+    {
+      s[i] = reader->fixed[s[i]];
+    }
+
+    // 8.8 fixed plus threshold never passes 0xffff, so no saturation
+    i = 0;
+#ifdef PPMR_SSE2
+    for (; i + 8 <= rowLen; i += 8)
+    {
+      __m128i v = _mm_add_epi16(_mm_loadu_si128((const __m128i *) (s + i)),
+                                _mm_loadu_si128((const __m128i *) (t + i)));
+      v = _mm_srli_epi16(v, 8);
+      _mm_storel_epi64((__m128i *) (d + i), _mm_packus_epi16(v, v));
+    }
+#endif
+    for (; i < rowLen; i++)
+    {
+      d[i] = (unsigned char) ((s[i] + t[i]) >> 8);
+    }
+  }
+}
+
+// decode the next count rows (fewer at the bottom of the image) into rows.
+// Returns the number of rows decoded, 0 once the image is done, -1 on bad or
+// truncated data.
+static inline int ppmReadRows(PpmReader *reader, Pixel *rows, int count)
+{
+  unsigned char *out = (unsigned char *) rows;
+  size_t n, i;
+
+  if (count > reader->height - reader->row)
+  {
+    count = reader->height - reader->row;
+  }
+  if (count <= 0)
+  {
+    return 0;
+  }
+  n = (size_t) count * reader->width * 3;
+
+  if (reader->maxColor > 255)
+  {
+    if (reader->wideSize < n)
+    {
+      free(reader->wide);
+      reader->wide = malloc(sizeof(unsigned short) * n);
+      reader->wideSize = reader->wide != NULL ? n : 0;
+      if (reader->wide == NULL)
+      {
+        return -1;
+      }
+    }
+    if (ppmrReadSamples(reader, reader->wide, count, 1))
+    {
+      return -1;
+    }
+    ppmrDither(reader, reader->wide, out, count);
+  }
+  else
+  {
+    if (ppmrReadSamples(reader, out, count, 0))
+    {
+      return -1;
+    }
+    if (reader->scale != NULL)
+    {
+      for (i = 0; i < n; i++)
+      {
+        out[i] = reader->scale[out[i]];
+      }
+    }
+  }
+
+  reader->row += count;
+  return count;
+}
+
+// decode the next count rows as raw 16-bit samples, 3 per pixel, in the
+// range 0..maxColor. Returns like ppmReadRows.
+static inline int ppmReadRows16(PpmReader *reader, unsigned short *rows,
+                                  int count)
+{
+  if (count > reader->height - reader->row)
+  {
+    count = reader->height - reader->row;
+  }
+  if (count <= 0)
+  {
+    return 0;
+  }
+  if (ppmrReadSamples(reader, rows, count, 1))
+  {
+    return -1;
+  }
+  reader->row += count;
+  return count;
+}
+
+static inline void ppmClose(PpmReader *reader)
+{
+  free(reader->text);
+  free(reader->scale);
+  free(reader->fixed);
+  free(reader->dither);
+  free(reader->wide);
+  free(reader->scratch);
+  reader->text = NULL;
+  reader->scale = NULL;
+  reader->fixed = NULL;
+  reader->dither = NULL;
+  reader->wide = NULL;
+  reader->scratch = NULL;
+  reader->wideSize = 0;
+}
+
+// IEEE half float nearest to f, for 0 <= f <= 1
+static inline unsigned short ppmrToHalf(float f)
+{
+  union { float f; unsigned u; } bits;
+
+  if (f < 6.103515625e-05f)
+  {
+    return (unsigned short) (f * 16777216.0f + 0.5f); // subnormal
+  }
+  bits.f = f;
+  return (unsigned short) (((bits.u >> 13) - (112 << 10)) +
+                           ((bits.u >> 12) & 1));
+}
+
+// table from any 16-bit sample to the half float of sample / maxColor,
+// clamped at 1. The caller frees it, NULL when out of memory.
+static inline unsigned short *ppmrHalfTable(int maxColor)
+{
+  unsigned short *table = malloc(sizeof(unsigned short) * 65536);
+  int v;
+
+  if (table != NULL)
+  {
+    for (v = 0; v < 65536; v++)
+    {
+      table[v] = ppmrToHalf(v >= maxColor ? 1.f : (float) v / maxColor);
+    }
+  }
+  return table;
+}
+
+// pool buffers are aligned at least as far as images need
+typedef char ppmrImageAlignFits[IMAGE_ALIGN <= EZMEM_ALIGN ? 1 : -1];
+
+// allocate an image with rows padded to a multiple of rowAlign bytes (a
+// power of two up to IMAGE_ALIGN), from the buffer pool. Returns 1 when out
+// of memory.
+static inline int imageAlloc(Image *image, int width, int height,
+                               PixelLayout layout, size_t rowAlign)
+{
+  size_t bytesPerPixel = layout == LAYOUT_RGB ? 3 :
+                         layout == LAYOUT_RGBX ? 4 :
+                         layout == LAYOUT_RGB_HALF ? 6 : 1;
+  size_t planeSize;
+  int planes = layout == LAYOUT_PLANAR ? 3 : 1;
+  int i;
+
+  memset(image, 0, sizeof(Image));
+  if (rowAlign < 1)
+  {
+    rowAlign = 1;
+  }
+
+  image->layout = layout;
+  image->width = width;
+  image->height = height;
+  image->stride = (bytesPerPixel * width + rowAlign - 1) & ~(rowAlign - 1);
+
+  planeSize = (image->stride * height + IMAGE_ALIGN - 1) &
+              ~(size_t) (IMAGE_ALIGN - 1);
+  image->planes[0] = ezBufferAlloc(planeSize * planes);
+  if (image->planes[0] == NULL)
+  {
+    return 1;
+  }
+  for (i = 1; i < planes; i++)
+  {
+    image->planes[i] = image->planes[0] + planeSize * i;
+  }
+  return 0;
+}
+
+static inline void imageFree(Image *image)
+{
+  ezBufferFree(image->planes[0]);
+  memset(image, 0, sizeof(Image));
+}
+
+// Source kernels, one per depth and sample size. The depth is a constant in
+// every copy, so each loop is straight-line code the compiler can unroll
+// and vectorize. Gray and gray+alpha spread in place from the back, where
+// every sample is read before the RGB written over it.
+#define PPMR_DEFINE_EXPAND(name, type, depth) \
+static void name(const void *src, void *dst, size_t count) \
+{ \
+  const type *s = (const type *) src; \
+  type *d = (type *) dst; \
+  size_t i; \
+\
+  if (depth < 3) \
+  { \
+    for (i = count; i-- > 0;) \
+    { \
+      type v = s[i * depth]; \
+      d[3 * i] = v; \
+      d[3 * i + 1] = v; \
+      d[3 * i + 2] = v; \
+    } \
+  } \
+  else \
+  { \
+    for (i = 0; i < count; i++) \
+    { \
+      d[3 * i] = s[4 * i]; \
+      d[3 * i + 1] = s[4 * i + 1]; \
+      d[3 * i + 2] = s[4 * i + 2]; \
+    } \
+  } \
+}
+
+PPMR_DEFINE_EXPAND(ppmrExpandGray, unsigned char, 1)
+PPMR_DEFINE_EXPAND(ppmrExpandGrayAlpha, unsigned char, 2)
+PPMR_DEFINE_EXPAND(ppmrExpandRGBA, unsigned char, 4)
+PPMR_DEFINE_EXPAND(ppmrExpandGray16, unsigned short, 1)
+PPMR_DEFINE_EXPAND(ppmrExpandGrayAlpha16, unsigned short, 2)
+PPMR_DEFINE_EXPAND(ppmrExpandRGBA16, unsigned short, 4)
+
+// Destination kernels, scalar
+static void ppmrConvertRGB(const Pixel *src, unsigned char *dst, size_t count)
+{
+  memcpy(dst, src, sizeof(Pixel) * count);
+}
+
+static void ppmrConvertRGBX(const Pixel *src, unsigned char *dst,
+                            size_t count)
+{
+  size_t i;
+
+  for (i = 0; i < count; i++)
+  {
+    dst[4 * i] = src[i].r;
+    dst[4 * i + 1] = src[i].g;
+    dst[4 * i + 2] = src[i].b;
+    dst[4 * i + 3] = 255;
+  }
+}
+
+// the Rec. 601 luma, which is the gray itself for pixels read from a gray
+// image
+static void ppmrConvertGray(const Pixel *src, unsigned char *dst,
+                            size_t count)
+{
+  size_t i;
+
+  for (i = 0; i < count; i++)
+  {
+    dst[i] = (unsigned char) ((src[i].r * 77 + src[i].g * 150 +
+                               src[i].b * 29 + 128) >> 8);
+  }
+}
+
+static void ppmrConvertHalf(const Pixel *src, unsigned char *dst,
+                            size_t count)
+{
+  const unsigned char *s = (const unsigned char *) src;
+  unsigned short *h = (unsigned short *) dst;
+  size_t i;
+
+  for (i = 0; i < 3 * count; i++)
+  {
+    h[i] = ppmrToHalf(s[i] / 255.f);
+  }
+}
+
+static void ppmrConvertPlanar(const Pixel *src, unsigned char *r,
+                              unsigned char *g, unsigned char *b,
+                              size_t count)
+{
+  size_t i;
+
+  for (i = 0; i < count; i++)
+  {
+    r[i] = src[i].r;
+    g[i] = src[i].g;
+    b[i] = src[i].b;
+  }
+}
+
+#ifdef PPMR_SSE2
+// four pixels as the low three bytes of each 32-bit lane, reading one byte
+// past the fourth pixel
+static inline __m128i ppmrLoad4(const Pixel *src)
+{
+  int a, b, c, d;
+
+  memcpy(&a, src, 4);
+  memcpy(&b, src + 1, 4);
+  memcpy(&c, src + 2, 4);
+  memcpy(&d, src + 3, 4);
+  return _mm_setr_epi32(a, b, c, d);
+}
+
+static void ppmrConvertRGBXSse2(const Pixel *src, unsigned char *dst,
+                                size_t count)
+{
+  const __m128i alpha = _mm_set1_epi32((int) 0xff000000);
+  size_t i = 0;
+
+  for (; i + 5 <= count; i += 4)
+  {
+    _mm_storeu_si128((__m128i *) (dst + 4 * i),
+                     _mm_or_si128(ppmrLoad4(src + i), alpha));
+  }
+  ppmrConvertRGBX(src + i, dst + 4 * i, count - i);
+}
+
+// the luma of four pixels at a time: the weights multiply and pair up the
+// samples, and the pairs are added across
+static void ppmrConvertGraySse2(const Pixel *src, unsigned char *dst,
+                                size_t count)
+{
+  const __m128i weights = _mm_setr_epi16(77, 150, 29, 0, 77, 150, 29, 0);
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i half = _mm_set1_epi32(128);
+  size_t i = 0;
+
+  for (; i + 5 <= count; i += 4)
+  {
+    __m128i v = ppmrLoad4(src + i);
+    __m128 lo = _mm_castsi128_ps(
+        _mm_madd_epi16(_mm_unpacklo_epi8(v, zero), weights));
+    __m128 hi = _mm_castsi128_ps(
+        _mm_madd_epi16(_mm_unpackhi_epi8(v, zero), weights));
+    __m128i sum = _mm_add_epi32(
+        _mm_castps_si128(_mm_shuffle_ps(lo, hi, _MM_SHUFFLE(2, 0, 2, 0))),
+        _mm_castps_si128(_mm_shuffle_ps(lo, hi, _MM_SHUFFLE(3, 1, 3, 1))));
+    int out;
+
+    sum = _mm_srli_epi32(_mm_add_epi32(sum, half), 8);
+    sum = _mm_packs_epi32(sum, sum);
+    out = _mm_cvtsi128_si32(_mm_packus_epi16(sum, sum));
+    memcpy(dst + i, &out, 4);
+  }
+  ppmrConvertGray(src + i, dst + i, count - i);
+}
+#endif
+
+#ifdef PPMR_AVX2
+// eight pixels as the low three bytes of each 32-bit lane, reading 32 bytes
+static PPMR_TARGET_AVX2 __m256i ppmrLoad8(const Pixel *src)
+{
+  const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 0, 3, 4, 5, 0);
+  const __m256i spread = _mm256_setr_epi8(
+      0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1,
+      0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+  __m256i v = _mm256_loadu_si256((const __m256i *) src);
+
+  return _mm256_shuffle_epi8(_mm256_permutevar8x32_epi32(v, lanes), spread);
+}
+
+static PPMR_TARGET_AVX2 void ppmrConvertRGBXAvx2(const Pixel *src,
+                                                 unsigned char *dst,
+                                                 size_t count)
+{
+  const __m256i alpha = _mm256_set1_epi32((int) 0xff000000);
+  size_t i = 0;
+
+  for (; i + 11 <= count; i += 8)
+  {
+    _mm256_storeu_si256((__m256i *) (dst + 4 * i),
+                        _mm256_or_si256(ppmrLoad8(src + i), alpha));
+  }
+  ppmrConvertRGBX(src + i, dst + 4 * i, count - i);
+}
+
+static PPMR_TARGET_AVX2 void ppmrConvertGrayAvx2(const Pixel *src,
+                                                 unsigned char *dst,
+                                                 size_t count)
+{
+  const __m256i weights = _mm256_setr_epi16(77, 150, 29, 0, 77, 150, 29, 0,
+                                            77, 150, 29, 0, 77, 150, 29, 0);
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i half = _mm256_set1_epi32(128);
+  size_t i = 0;
+
+  for (; i + 11 <= count; i += 8)
+  {
+    __m256i v = ppmrLoad8(src + i);
+    __m256i sum = _mm256_hadd_epi32(
+        _mm256_madd_epi16(_mm256_unpacklo_epi8(v, zero), weights),
+        _mm256_madd_epi16(_mm256_unpackhi_epi8(v, zero), weights));
+    int a, b;
+
+    sum = _mm256_srli_epi32(_mm256_add_epi32(sum, half), 8);
+    sum = _mm256_packs_epi32(sum, sum);
+    sum = _mm256_packus_epi16(sum, sum);
+    a = _mm_cvtsi128_si32(_mm256_castsi256_si128(sum));
+    b = _mm_cvtsi128_si32(_mm256_extracti128_si256(sum, 1));
+    memcpy(dst + i, &a, 4);
+    memcpy(dst + i + 4, &b, 4);
+  }
+  ppmrConvertGray(src + i, dst + i, count - i);
+}
+
+// sixteen gray samples out to 48 bytes of RGB
+static PPMR_TARGET_AVX2 void ppmrSpread16Avx2(__m128i gray,
+                                              unsigned char *dst)
+{
+  const __m256i first = _mm256_setr_epi8(
+      0, 0, 0, 1, 1, 1, 2, 2, 2, 3, 3, 3, 4, 4, 4, 5,
+      5, 5, 6, 6, 6, 7, 7, 7, 8, 8, 8, 9, 9, 9, 10, 10);
+  const __m128i last = _mm_setr_epi8(
+      10, 11, 11, 11, 12, 12, 12, 13, 13, 13, 14, 14, 14, 15, 15, 15);
+
+  _mm256_storeu_si256((__m256i *) dst,
+      _mm256_shuffle_epi8(_mm256_broadcastsi128_si256(gray), first));
+  _mm_storeu_si128((__m128i *) (dst + 32), _mm_shuffle_epi8(gray, last));
+}
+
+// in place from the back like the scalar kernel: the tail first, then
+// blocks of sixteen, each loaded before it is written over
+static PPMR_TARGET_AVX2 void ppmrExpandGrayAvx2(const void *src, void *dst,
+                                                size_t count)
+{
+  const unsigned char *s = (const unsigned char *) src;
+  unsigned char *d = (unsigned char *) dst;
+  size_t blocks = count / 16;
+
+  ppmrExpandGray(s + 16 * blocks, d + 48 * blocks, count - 16 * blocks);
+  while (blocks-- > 0)
+  {
+    ppmrSpread16Avx2(_mm_loadu_si128((const __m128i *) (s + 16 * blocks)),
+                     d + 48 * blocks);
+  }
+}
+
+static PPMR_TARGET_AVX2 void ppmrExpandGrayAlphaAvx2(const void *src,
+                                                     void *dst, size_t count)
+{
+  const __m256i pick = _mm256_setr_epi8(
+      0, 2, 4, 6, 8, 10, 12, 14, -1, -1, -1, -1, -1, -1, -1, -1,
+      0, 2, 4, 6, 8, 10, 12, 14, -1, -1, -1, -1, -1, -1, -1, -1);
+  const unsigned char *s = (const unsigned char *) src;
+  unsigned char *d = (unsigned char *) dst;
+  size_t blocks = count / 16;
+
+  ppmrExpandGrayAlpha(s + 32 * blocks, d + 48 * blocks, count - 16 * blocks);
+  while (blocks-- > 0)
+  {
+    __m256i v = _mm256_loadu_si256((const __m256i *) (s + 32 * blocks));
+    v = _mm256_permute4x64_epi64(_mm256_shuffle_epi8(v, pick),
+                                 _MM_SHUFFLE(3, 1, 2, 0));
+    ppmrSpread16Avx2(_mm256_castsi256_si128(v), d + 48 * blocks);
+  }
+}
+
+static PPMR_TARGET_AVX2 void ppmrExpandRGBAAvx2(const void *src, void *dst,
+                                                size_t count)
+{
+  const __m256i pack = _mm256_setr_epi8(
+      0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+      0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+  const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7);
+  const unsigned char *s = (const unsigned char *) src;
+  unsigned char *d = (unsigned char *) dst;
+  size_t i = 0;
+
+  for (; i + 8 <= count; i += 8)
+  {
+    __m256i v = _mm256_loadu_si256((const __m256i *) (s + 4 * i));
+    v = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(v, pack), lanes);
+    _mm_storeu_si128((__m128i *) (d + 3 * i), _mm256_castsi256_si128(v));
+    _mm_storel_epi64((__m128i *) (d + 3 * i + 16),
+                     _mm256_extracti128_si256(v, 1));
+  }
+  ppmrExpandRGBA(s + 4 * i, d + 3 * i, count - i);
+}
+#endif
+
+// Every kernel by instruction set. The 16-bit and planar kernels are left
+// to the compiler's vectorizer at every level.
+static const PpmrKernels ppmrKernelTable[PPMR_ISA_COUNT] = {
+  {
+    {NULL, ppmrExpandGray, ppmrExpandGrayAlpha, NULL, ppmrExpandRGBA},
+    {NULL, ppmrExpandGray16, ppmrExpandGrayAlpha16, NULL, ppmrExpandRGBA16},
+    {ppmrConvertRGB, ppmrConvertRGBX, NULL, ppmrConvertHalf, ppmrConvertGray},
+    ppmrConvertPlanar
+  },
+#ifdef PPMR_SSE2
+  {
+    {NULL, ppmrExpandGray, ppmrExpandGrayAlpha, NULL, ppmrExpandRGBA},
+    {NULL, ppmrExpandGray16, ppmrExpandGrayAlpha16, NULL, ppmrExpandRGBA16},
+    {ppmrConvertRGB, ppmrConvertRGBXSse2, NULL, ppmrConvertHalf,
+     ppmrConvertGraySse2},
+    ppmrConvertPlanar
+  },
+#else
+  {{NULL}, {NULL}, {NULL}, NULL},
+#endif
+#ifdef PPMR_AVX2
+  {
+    {NULL, ppmrExpandGrayAvx2, ppmrExpandGrayAlphaAvx2, NULL,
+     ppmrExpandRGBAAvx2},
+    {NULL, ppmrExpandGray16, ppmrExpandGrayAlpha16, NULL, ppmrExpandRGBA16},
+    {ppmrConvertRGB, ppmrConvertRGBXAvx2, NULL, ppmrConvertHalf,
+     ppmrConvertGrayAvx2},
+    ppmrConvertPlanar
+  }
+#else
+  {{NULL}, {NULL}, {NULL}, NULL}
+#endif
+};
+
+// the best instruction set both this build and the CPU have, looked up once
+static inline int ppmrCpuIsa(void)
+{
+  static volatile long isa = -1;
+  long found = ezAtomicLoad(&isa);
+
+  if (found >= 0)
+  {
+    return (int) found;
+  }
+  found = PPMR_ISA_SCALAR;
+#ifdef PPMR_SSE2
+  found = PPMR_ISA_SSE2;
+#endif
+#ifdef PPMR_AVX2
+#ifdef _MSC_VER
+  {
+    int info[4];
+
+    // AVX2 needs the OS to save the YMM registers as well
+    __cpuid(info, 0);
+    if (info[0] >= 7)
+    {
+      __cpuid(info, 1);
+      if ((info[2] & (1 << 27)) && (info[2] & (1 << 28)) &&
+          (_xgetbv(0) & 6) == 6)
+      {
+        __cpuidex(info, 7, 0);
+        if (info[1] & (1 << 5))
+        {
+          found = PPMR_ISA_AVX2;
+        }
+      }
+    }
+  }
+#else
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+  {
+    found = PPMR_ISA_AVX2;
+  }
+#endif
+#endif
+  ezAtomicStore(&isa, found);
+  return (int) found;
+}
+
+// the kernels for this CPU; callers pick theirs once per image
+static inline const PpmrKernels *ppmrKernels(void)
+{
+  return &ppmrKernelTable[ppmrCpuIsa()];
+}
+
+// the kernel writing Pixels in a packed layout, NULL for LAYOUT_PLANAR
+static inline PixelConvert pixelConverter(PixelLayout layout)
+{
+  return ppmrKernels()->convert[layout];
+}
+
+// widen packed pixels to RGBX, X = 255
+static inline void pixelsToRGBX(const Pixel *src, unsigned char *dst,
+                                  size_t count)
+{
+  ppmrKernels()->convert[LAYOUT_RGBX](src, dst, count);
+}
+
+// pixels to one byte each, the Rec. 601 luma, which is the gray itself for
+// pixels read from a gray image
+static inline void pixelsToGray(const Pixel *src, unsigned char *dst,
+                                  size_t count)
+{
+  ppmrKernels()->convert[LAYOUT_GRAY](src, dst, count);
+}
+
+// copy count decoded rows into image starting at row, converting them to
+// the image's layout with a kernel picked once for the whole call
+static inline void imageStoreRows(Image *image, int row, const Pixel *rows,
+                                    int count)
+{
+  const PpmrKernels *kernels = ppmrKernels();
+  PixelConvert convert = kernels->convert[image->layout];
+  int y;
+
+  for (y = 0; y < count; y++)
+  {
+    const Pixel *src = rows + (size_t) y * image->width;
+    size_t offset = image->stride * (row + y);
+
+    if (convert != NULL)
+    {
+      convert(src, image->planes[0] + offset, image->width);
+    }
+    else
+    {
+      kernels->planar(src, image->planes[0] + offset,
+                      image->planes[1] + offset, image->planes[2] + offset,
+                      image->width);
+    }
+  }
+}
+
+// read the rest of reader into a LAYOUT_RGB_HALF image at full sample
+// precision, bandRows rows at a time through band. Returns the last
+// ppmReadRows16 result.
+static inline int ppmrLoadHalf(PpmReader *reader, Image *image,
+                                 unsigned short *band, int bandRows)
+{
+  unsigned short *half = ppmrHalfTable(reader->maxColor);
+  size_t rowLen = (size_t) 3 * reader->width;
+  size_t i;
+  int rows, y;
+
+  if (half == NULL)
+  {
+    return -1;
+  }
+  while ((rows = ppmReadRows16(reader, band, bandRows)) > 0)
+  {
+    for (y = 0; y < rows; y++)
+    {
+      unsigned short *dst = (unsigned short *)
+          (image->planes[0] + image->stride * (reader->row - rows + y));
+      const unsigned short *src = band + rowLen * y;
+      for (i = 0; i < rowLen; i++)
+      {
+        dst[i] = half[src[i]];
+      }
+    }
+  }
+  free(half);
+  return rows;
+}
+
+// read a whole PNM or PAM file into a freshly allocated image in the given
+// layout. Returns 1 on a bad file or when out of memory.
+static inline int ppmLoadImage(FILE *in, Image *image, PixelLayout layout,
+                                 size_t rowAlign)
+{
+  PpmReader reader;
+  Pixel *band;
+  int bandRows, rows;
+
+  memset(image, 0, sizeof(Image));
+  if (ppmOpen(&reader, in))
+  {
+    ppmClose(&reader);
+    return 1;
+  }
+
+  bandRows = PPMR_WINDOW / (int) (sizeof(Pixel) * reader.width);
+  if (bandRows < 1)
+  {
+    bandRows = 1;
+  }
+  // LAYOUT_RGB_HALF reads 16-bit samples, twice the size of a Pixel
+  band = ezBufferAlloc(2 * sizeof(Pixel) * reader.width * (size_t) bandRows);
+  if (band == NULL ||
+      imageAlloc(image, reader.width, reader.height, layout, rowAlign))
+  {
+    ezBufferFree(band);
+    ppmClose(&reader);
+    return 1;
+  }
+
+  if (layout == LAYOUT_RGB_HALF)
+  {
+    rows = ppmrLoadHalf(&reader, image, (unsigned short *) band, bandRows);
+  }
+  else
+  {
+    while ((rows = ppmReadRows(&reader, band, bandRows)) > 0)
+    {
+      imageStoreRows(image, reader.row - rows, band, rows);
+    }
+  }
+
+  ezBufferFree(band);
+  ppmClose(&reader);
+  if (rows < 0 || reader.row != reader.height)
+  {
+    imageFree(image);
+    return 1;
+  }
+  return 0;
 }
 
 #endif
@@ -0,0 +1,547 @@
+#ifndef SESSION
+#define SESSION
+
+#include <GLES2/gl2.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <dirent.h>
+#include <sys/stat.h>
+#endif
+
+#include "ppmr.h"
+#include "ezthread.h"
+#include "ezmem.h"
+#include "trace.h"
+#include "diskcache.h"
+#include "mipmap.h"
+
+#define SESSION_BUDGET (512 << 20) // default cache budget, see -c
+
+#define IMAGE_EMPTY    0 // nothing cached
+#define IMAGE_DECODING 1 // the prefetch thread is reading it
+#define IMAGE_READY    2 // pixels and/or texture are cached
+#define IMAGE_FAILED   3 // bad file, not retried
+
+// One image of the session. Once uploaded the texture replaces the decoded
+// pixels and mipmaps, except for images too big for one texture, which keep
+// their pixels for the tile cache.
+typedef struct SessionImage {
+  const char *path;
+  int     index;            // image within the file's stream, from 0
+  Pixel  *pixels;
+  int     width, height;
+  MipChain mips;            // levels 1 and up, until uploaded
+  GLuint  texture;          // 0 until uploaded
+  int     mipmapped;        // the texture has the whole chain
+  int     state;            // IMAGE_EMPTY ... IMAGE_FAILED
+  unsigned long lastUsed;   // session clock when last shown
+} SessionImage;
+
+// A list of images paged through in one window. Decoded pixels and
+// textures are kept in an LRU cache under a byte budget, and a prefetch
+// thread decodes the images next to the current one so that paging to
+// them doesn't wait on the disk. state, pixels and used are guarded by
+// lock; textures are only touched on the GL thread.
+typedef struct Session {
+  SessionImage *images;
+  int     count;
+  int     current;
+  size_t  budget, used;     // bytes of cached pixels and textures
+  unsigned long clock;
+  int     maxTexture;
+  void  (*notify)(void);    // called when an image is decoded, may be NULL
+  DiskCache *disk;          // decoded images kept across runs, may be NULL
+  int     mipmaps;          // MIP_NONE, MIP_POW2 or MIP_ANY
+  ezMutex lock;
+  ezCond  wake;             // current moved, or quit
+  ezThread thread;
+  int     running;          // thread needs joining
+  int     quit;
+} Session;
+
+/* Function Prototypes */
+static inline  int    sessionAddPath(Session *session, const char *path);
+static inline  int    sessionStart(Session *session, size_t budget,
+                                     int maxTexture, void (*notify)(void));
+static inline  void   sessionShow(Session *session, int index);
+static inline  SessionImage *sessionUpdate(Session *session);
+static inline  void   sessionStop(Session *session);
+
+// append the images of the file at path to the list, one for every image
+// of a multi-image stream. A file that can't be read still gets one entry,
+// which fails when shown. Returns 1 when out of memory, with none of the
+// file's images added.
+static inline int sessionAddImage(Session *session, const char *path)
+{
+  FILE *in = fopen(path, "rb");
+  SessionImage *images;
+  int count = 1, i;
+
+  if (in != NULL)
+  {
+    count = ppmCountImages(in);
+    count = count < 1 ? 1 : count;
+    fclose(in);
+  }
+
+  images = realloc(session->images, sizeof(SessionImage) *
+                   (session->count + count));
+  if (images == NULL)
+  {
+    return 1;
+  }
+  session->images = images;
+  for (i = 0; i < count; i++)
+  {
+    char *copy = malloc(strlen(path) + 1);
+    if (copy == NULL)
+    {
+      // take back the images of this file already added
+      while (i-- > 0)
+      {
+        free((char *) images[--session->count].path);
+      }
+      return 1;
+    }
+    strcpy(copy, path);
+    memset(&images[session->count], 0, sizeof(SessionImage));
+    images[session->count].path = copy;
+    images[session->count++].index = i;
+  }
+  return 0;
+}
+
+static inline int sessionComparePaths(const void *a, const void *b)
+{
+  const SessionImage *x = (const SessionImage *) a;
+  const SessionImage *y = (const SessionImage *) b;
+  int order = strcmp(x->path, y->path);
+
+  return order != 0 ? order : x->index - y->index;
+}
+
+// true for names ending in .ppm, .pgm, .pbm, .pnm or .pam, any case
+static inline int sessionIsPpm(const char *name)
+{
+  size_t len = strlen(name);
+  char a, b;
+
+  if (len <= 4 || name[len - 4] != '.' ||
+      tolower((unsigned char) name[len - 3]) != 'p')
+  {
+    return 0;
+  }
+  a = (char) tolower((unsigned char) name[len - 2]);
+  b = (char) tolower((unsigned char) name[len - 1]);
+  return (b == 'm' && (a == 'p' || a == 'g' || a == 'b' || a == 'n')) ||
+         (a == 'a' && b == 'm');
+}
+
+// add path to the session: a file as is, a directory as its PNM and PAM
+// files in name order. Returns 1 when out of memory or the directory can't
+// be read.
+static inline int sessionAddPath(Session *session, const char *path)
+{
+  size_t len = strlen(path);
+  int first = session->count;
+  char *name = malloc(len + 262);
+#ifdef _WIN32
+  WIN32_FIND_DATAA found;
+  HANDLE find;
+  DWORD attributes = GetFileAttributesA(path);
+
+  if (attributes == INVALID_FILE_ATTRIBUTES ||
+      !(attributes & FILE_ATTRIBUTE_DIRECTORY))
+  {
+    free(name);
+    return sessionAddImage(session, path);
+  }
+  if (name == NULL)
+  {
+    return 1;
+  }
+  sprintf(name, "%s\\*", path);
+  find = FindFirstFileA(name, &found);
+  if (find == INVALID_HANDLE_VALUE)
+  {
+    free(name);
+    return 1;
+  }
+  do
+  {
+    if (!(found.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) &&
+        sessionIsPpm(found.cFileName) && strlen(found.cFileName) < 260)
+    {
+      sprintf(name, "%s\\%s", path, found.cFileName);
+      if (sessionAddImage(session, name))
+      {
+        break;
+      }
+    }
+  } while (FindNextFileA(find, &found));
+  FindClose(find);
+#else
+  struct stat info;
+  struct dirent *entry;
+  DIR *dir;
+
+  if (stat(path, &info) != 0 || !S_ISDIR(info.st_mode))
+  {
+    free(name);
+    return sessionAddImage(session, path);
+  }
+  dir = opendir(path);
+  if (name == NULL || dir == NULL)
+  {
+    free(name);
+    if (dir != NULL)
+    {
+      closedir(dir);
+    }
+    return 1;
+  }
+  while ((entry = readdir(dir)) != NULL)
+  {
+    if (sessionIsPpm(entry->d_name) && strlen(entry->d_name) < 260)
+    {
+      sprintf(name, "%s/%s", path, entry->d_name);
+      if (stat(name, &info) == 0 && !S_ISDIR(info.st_mode) &&
+          sessionAddImage(session, name))
+      {
+        break;
+      }
+    }
+  }
+  closedir(dir);
+#endif
+  free(name);
+
+  // directory listings come in no particular order
+  qsort(session->images + first, session->count - first,
+        sizeof(SessionImage), sessionComparePaths);
+  return 0;
+}
+
+// bytes an image holds in the cache
+static inline size_t sessionImageBytes(const SessionImage *image)
+{
+  size_t pixels = (size_t) image->width * image->height;
+
+  // a mip chain adds about a third
+  if (image->mips.count > 1 || image->mipmapped)
+  {
+    pixels += pixels / 3;
+  }
+  return (image->pixels != NULL ? sizeof(Pixel) * pixels : 0) +
+         (image->texture != 0 ? 4 * pixels : 0); // drivers pad RGB to RGBA
+}
+
+// index of the image offset steps from the current one, wrapping around
+static inline int sessionNeighbour(const Session *session, int offset)
+{
+  return ((session->current + offset) % session->count + session->count) %
+         session->count;
+}
+
+// true for the current image and the ones next to it, which are never
+// evicted
+static inline int sessionInWindow(const Session *session, int index)
+{
+  return index == session->current ||
+         index == sessionNeighbour(session, 1) ||
+         index == sessionNeighbour(session, -1);
+}
+
+// decode image index of the file at path, returns NULL on a bad file or
+// when out of memory. The disk cache only holds a file's first image.
+static inline Pixel *sessionDecode(const char *path, int index,
+                                     DiskCache *disk, int *width,
+                                     int *height)
+{
+  PpmReader reader;
+  PixelMap map;
+  Pixel *pixels = NULL;
+  double start = traceBegin();
+  FILE *in = fopen(path, "rb");
+
+  if (in == NULL)
+  {
+    return NULL;
+  }
+  if (index > 0)
+  {
+    disk = NULL;
+  }
+  if (!ppmOpenImage(&reader, in, index))
+  {
+    size_t size = sizeof(Pixel) * (size_t) reader.width * reader.height;
+    int cached = disk != NULL && diskCacheWorth(&reader) &&
+                 !diskCacheLoad(disk, path, &map, width, height);
+
+    if (cached && (*width != reader.width || *height != reader.height))
+    {
+      unmapP6(&map);
+      cached = 0;
+    }
+    pixels = ezBufferAlloc(size);
+    if (cached)
+    {
+      if (pixels != NULL)
+      {
+        memcpy(pixels, map.pixels, size);
+      }
+      unmapP6(&map);
+    }
+    else if (pixels != NULL &&
+             ppmReadRows(&reader, pixels, reader.height) != reader.height)
+    {
+      ezBufferFree(pixels);
+      pixels = NULL;
+    }
+    else if (pixels != NULL && disk != NULL && diskCacheWorth(&reader))
+    {
+      diskCacheStore(disk, path, pixels, reader.width, reader.height);
+    }
+    *width = reader.width;
+    *height = reader.height;
+  }
+  ppmClose(&reader);
+  fclose(in);
+  traceEnd("decode image", start);
+  return pixels;
+}
+
+// Decodes the current image first, then the next and the previous one.
+// Sleeps until sessionShow moves the window when all three are cached.
+static EZTHREAD_FUNC(sessionPrefetch, arg)
+{
+  static const int order[3] = {0, 1, -1};
+  Session *session = (Session *) arg;
+
+  ezMutexLock(&session->lock);
+  while (!session->quit)
+  {
+    SessionImage *image = NULL;
+    Pixel *pixels;
+    MipChain mips;
+    int i, width = 0, height = 0;
+
+    for (i = 0; i < 3 && image == NULL; i++)
+    {
+      SessionImage *next =
+          &session->images[sessionNeighbour(session, order[i])];
+      if (next->state == IMAGE_EMPTY)
+      {
+        image = next;
+      }
+    }
+    if (image == NULL)
+    {
+      ezCondWait(&session->wake, &session->lock);
+      continue;
+    }
+
+    image->state = IMAGE_DECODING;
+    ezMutexUnlock(&session->lock);
+    pixels = sessionDecode(image->path, image->index, session->disk, &width,
+                           &height);
+
+    // the mipmaps are made here too, next to the decode rather than on the
+    // GL thread
+    memset(&mips, 0, sizeof(MipChain));
+    if (pixels != NULL && width <= session->maxTexture &&
+        height <= session->maxTexture &&
+        mipAllowed(session->mipmaps, width, height))
+    {
+      double start = traceBegin();
+      mipBuild(&mips, pixels, width, height, NULL);
+      traceEnd("build mipmaps", start);
+    }
+    ezMutexLock(&session->lock);
+
+    image->pixels = pixels;
+    image->mips = mips;
+    image->width = width;
+    image->height = height;
+    image->state = pixels != NULL ? IMAGE_READY : IMAGE_FAILED;
+    session->used += sessionImageBytes(image);
+    if (pixels == NULL)
+    {
+      fprintf(stderr, "Error: Could not read %s\n", image->path);
+    }
+    if (session->notify != NULL)
+    {
+      session->notify();
+    }
+  }
+  ezMutexUnlock(&session->lock);
+  return EZTHREAD_RETURN;
+}
+
+// start prefetching around image 0, keeping about budget bytes cached.
+// Images wider or taller than maxTexture are left to the caller's tile
+// cache. Returns 1 when there are no images or no thread could be started.
+static inline int sessionStart(Session *session, size_t budget,
+                                 int maxTexture, void (*notify)(void))
+{
+  if (session->count == 0)
+  {
+    return 1;
+  }
+  session->current = 0;
+  session->budget = budget;
+  session->maxTexture = maxTexture;
+  session->notify = notify;
+  ezMutexInit(&session->lock);
+  ezCondInit(&session->wake);
+  if (ezThreadCreate(&session->thread, sessionPrefetch, session))
+  {
+    return 1;
+  }
+  session->running = 1;
+  return 0;
+}
+
+// make index (wrapped into range) the current image
+static inline void sessionShow(Session *session, int index)
+{
+  ezMutexLock(&session->lock);
+  session->current = (index % session->count + session->count) %
+                     session->count;
+  ezCondBroadcast(&session->wake);
+  ezMutexUnlock(&session->lock);
+}
+
+// drop the least recently shown images outside the window until the cache
+// fits the budget. Called with the lock held.
+static inline void sessionTrim(Session *session)
+{
+  while (session->used > session->budget)
+  {
+    SessionImage *oldest = NULL;
+    int i;
+
+    for (i = 0; i < session->count; i++)
+    {
+      SessionImage *image = &session->images[i];
+      if (image->state == IMAGE_READY && !sessionInWindow(session, i) &&
+          (oldest == NULL || image->lastUsed < oldest->lastUsed))
+      {
+        oldest = image;
+      }
+    }
+    if (oldest == NULL)
+    {
+      break;
+    }
+
+    session->used -= sessionImageBytes(oldest);
+    ezBufferFree(oldest->pixels);
+    oldest->pixels = NULL;
+    mipFree(&oldest->mips);
+    if (oldest->texture != 0)
+    {
+      glDeleteTextures(1, &oldest->texture);
+      oldest->texture = 0;
+    }
+    oldest->mipmapped = 0;
+    oldest->state = IMAGE_EMPTY;
+  }
+}
+
+// Upload the decoded images around the current one and trim the cache.
+// Must be called on the GL thread; leaves GL_TEXTURE_2D bound to whatever
+// it was. Returns the current image once it is cached, NULL while it is
+// still being decoded or if it failed.
+static inline SessionImage *sessionUpdate(Session *session)
+{
+  SessionImage *current;
+  int i;
+
+  ezMutexLock(&session->lock);
+  for (i = -1; i <= 1; i++)
+  {
+    SessionImage *image = &session->images[sessionNeighbour(session, i)];
+
+    if (image->state == IMAGE_READY && image->texture == 0 &&
+        image->width <= session->maxTexture &&
+        image->height <= session->maxTexture)
+    {
+      GLint bound;
+      int level;
+      double start = traceBegin();
+
+      session->used -= sessionImageBytes(image);
+      glGetIntegerv(GL_TEXTURE_BINDING_2D, &bound);
+      glGenTextures(1, &image->texture);
+      glBindTexture(GL_TEXTURE_2D, image->texture);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+      glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, image->width, image->height, 0,
+                   GL_RGB, GL_UNSIGNED_BYTE, image->pixels);
+      for (level = 1; level < image->mips.count; level++)
+      {
+        const MipLevel *mip = &image->mips.levels[level];
+        glTexImage2D(GL_TEXTURE_2D, level, GL_RGB, mip->width, mip->height, 0,
+                     GL_RGB, GL_UNSIGNED_BYTE, mip->pixels);
+      }
+      if (image->mips.count > 1)
+      {
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER,
+                        GL_LINEAR_MIPMAP_LINEAR);
+        image->mipmapped = 1;
+      }
+      glBindTexture(GL_TEXTURE_2D, (GLuint) bound);
+      traceEnd("upload texture", start);
+
+      // the texture has it now
+      ezBufferFree(image->pixels);
+      image->pixels = NULL;
+      mipFree(&image->mips);
+      session->used += sessionImageBytes(image);
+    }
+  }
+
+  current = &session->images[session->current];
+  current->lastUsed = ++session->clock;
+  sessionTrim(session);
+  ezMutexUnlock(&session->lock);
+  return current->state == IMAGE_READY ? current : NULL;
+}
+
+// stop prefetching and free every cached image and texture
+static inline void sessionStop(Session *session)
+{
+  int i;
+
+  if (session->running)
+  {
+    ezMutexLock(&session->lock);
+    session->quit = 1;
+    ezCondBroadcast(&session->wake);
+    ezMutexUnlock(&session->lock);
+    ezThreadJoin(session->thread);
+    ezCondDestroy(&session->wake);
+    ezMutexDestroy(&session->lock);
+    session->running = 0;
+  }
+  for (i = 0; i < session->count; i++)
+  {
+    ezBufferFree(session->images[i].pixels);
+    mipFree(&session->images[i].mips);
+    if (session->images[i].texture != 0)
+    {
+      glDeleteTextures(1, &session->images[i].texture);
+    }
+    free((char *) session->images[i].path);
+  }
+  free(session->images);
+  memset(session, 0, sizeof(Session));
+}
+
+#endif
@@ -0,0 +1,353 @@
+#ifndef TILECACHE
+#define TILECACHE
+
+#include <GLES2/gl2.h>
+#include <math.h>
+
+#include "linmath.h"
+#include "ppmr.h"
+#include "mipmap.h"
+#include "ezmem.h"
+#include "trace.h"
+
+#define TILE_SIZE        512 // texels per tile edge, shrunk to the GL limit
+#define TILE_MAX_LEVELS  32
+#define TILE_UPLOADS     4   // tile uploads per frame, keeps frames short
+
+// One level of the image pyramid, level 0 is the image itself.
+typedef struct TileLevel {
+  Pixel *pixels;
+  int    width, height;
+  int    cols, rows;        // tiles across and down
+} TileLevel;
+
+// A resident tile texture.
+typedef struct Tile {
+  GLuint texture;
+  int    level, col, row;   // level is -1 while the slot is free
+  unsigned long lastUsed;   // frame the tile was last drawn in
+} Tile;
+
+// Multi-resolution tile cache. Only tiles that intersect the view, at the
+// level the current zoom needs, are uploaded, and the least recently drawn
+// tiles are recycled once the memory budget is used up. The coarsest level
+// always fits in one tile and is drawn underneath as a placeholder.
+typedef struct TileCache {
+  TileLevel levels[TILE_MAX_LEVELS];
+  int    levelCount;
+  int    tileSize;
+  Tile  *tiles;
+  int    capacity;          // tiles that fit in the budget
+  unsigned long frame;
+  Pixel *scratch;           // one tile, repacked for upload
+} TileCache;
+
+/* Function Prototypes */
+static inline  int    tileCacheInit(TileCache *cache, Pixel *image, int width,
+                                      int height, int maxTexture,
+                                      size_t budget);
+static inline  int    tileCacheDraw(TileCache *cache, mat4x4 mvp,
+                                      GLint mvp_location, int fbWidth,
+                                      int fbHeight);
+static inline  void   tileCacheFree(TileCache *cache);
+
+// build the pyramid over image (which must outlive the cache) and size the
+// cache to budget bytes of tile textures. Returns 1 when out of memory.
+static inline int tileCacheInit(TileCache *cache, Pixel *image, int width,
+                                  int height, int maxTexture, size_t budget)
+{
+  int i;
+  size_t tileBytes;
+  double start = traceBegin();
+
+  memset(cache, 0, sizeof(TileCache));
+  cache->tileSize = maxTexture < TILE_SIZE ? maxTexture : TILE_SIZE;
+
+  cache->levels[0].pixels = image;
+  cache->levels[0].width = width;
+  cache->levels[0].height = height;
+  cache->levelCount = 1;
+
+  while (cache->levelCount < TILE_MAX_LEVELS)
+  {
+    TileLevel *prev = &cache->levels[cache->levelCount - 1];
+    TileLevel *next = &cache->levels[cache->levelCount];
+
+    if (prev->width <= cache->tileSize && prev->height <= cache->tileSize)
+    {
+      break;
+    }
+
+    next->width = (prev->width + 1) / 2;
+    next->height = (prev->height + 1) / 2;
+    next->pixels = ezBufferAlloc(sizeof(Pixel) * next->width * next->height);
+    if (next->pixels == NULL)
+    {
+      tileCacheFree(cache);
+      return 1;
+    }
+    mipDownsample(prev->pixels, prev->width, prev->height, next->pixels,
+                  next->width, next->height, NULL);
+    cache->levelCount++;
+  }
+
+  for (i = 0; i < cache->levelCount; i++)
+  {
+    TileLevel *level = &cache->levels[i];
+    level->cols = (level->width + cache->tileSize - 1) / cache->tileSize;
+    level->rows = (level->height + cache->tileSize - 1) / cache->tileSize;
+  }
+
+  // the placeholder plus a screenful of tiles is the least that works
+  tileBytes = sizeof(Pixel) * cache->tileSize * cache->tileSize;
+  cache->capacity = (int) (budget / tileBytes);
+  if (cache->capacity < 5)
+  {
+    cache->capacity = 5;
+  }
+
+  cache->tiles = malloc(sizeof(Tile) * cache->capacity);
+  cache->scratch = ezBufferAlloc(tileBytes);
+  if (cache->tiles == NULL || cache->scratch == NULL)
+  {
+    tileCacheFree(cache);
+    return 1;
+  }
+  for (i = 0; i < cache->capacity; i++)
+  {
+    cache->tiles[i].texture = 0;
+    cache->tiles[i].level = -1;
+    cache->tiles[i].lastUsed = 0;
+  }
+  traceEnd("build pyramid", start);
+  return 0;
+}
+
+// find a resident tile, NULL if it isn't loaded
+static inline Tile *tileFind(TileCache *cache, int level, int col, int row)
+{
+  int i;
+
+  for (i = 0; i < cache->capacity; i++)
+  {
+    Tile *tile = &cache->tiles[i];
+    if (tile->level == level && tile->col == col && tile->row == row)
+    {
+      return tile;
+    }
+  }
+  return NULL;
+}
+
+// upload a tile into a free slot, or over the least recently drawn one.
+// Returns NULL when every slot is in use this frame.
+static inline Tile *tileLoad(TileCache *cache, int level, int col, int row)
+{
+  TileLevel *src = &cache->levels[level];
+  Tile *victim = NULL;
+  int i, y, x0, y0, w, h;
+  double start;
+
+  for (i = 0; i < cache->capacity; i++)
+  {
+    Tile *tile = &cache->tiles[i];
+    if (tile->level < 0)
+    {
+      victim = tile;
+      break;
+    }
+    if (tile->lastUsed != cache->frame &&
+        (victim == NULL || tile->lastUsed < victim->lastUsed))
+    {
+      victim = tile;
+    }
+  }
+  if (victim == NULL)
+  {
+    return NULL;
+  }
+
+  start = traceBegin();
+  x0 = col * cache->tileSize;
+  y0 = row * cache->tileSize;
+  w = src->width - x0 < cache->tileSize ? src->width - x0 : cache->tileSize;
+  h = src->height - y0 < cache->tileSize ? src->height - y0 : cache->tileSize;
+
+  // GLES2 has no GL_UNPACK_ROW_LENGTH, so repack the rows first
+  for (y = 0; y < h; y++)
+  {
+    memcpy(cache->scratch + (size_t) y * w,
+           src->pixels + (size_t) (y0 + y) * src->width + x0,
+           sizeof(Pixel) * w);
+  }
+
+  if (victim->texture == 0)
+  {
+    glGenTextures(1, &victim->texture);
+  }
+  glBindTexture(GL_TEXTURE_2D, victim->texture);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, w, h, 0, GL_RGB, GL_UNSIGNED_BYTE,
+               cache->scratch);
+  traceEnd("upload tile", start);
+
+  victim->level = level;
+  victim->col = col;
+  victim->row = row;
+  return victim;
+}
+
+// draw one tile with the image quad, scaled down to the tile's rectangle
+static inline void tileDraw(TileCache *cache, Tile *tile, mat4x4 mvp,
+                              GLint mvp_location)
+{
+  TileLevel *level = &cache->levels[tile->level];
+  float x0 = (float) (tile->col * cache->tileSize) / level->width;
+  float y0 = (float) (tile->row * cache->tileSize) / level->height;
+  float x1 = (float) ((tile->col + 1) * cache->tileSize) / level->width;
+  float y1 = (float) ((tile->row + 1) * cache->tileSize) / level->height;
+  mat4x4 model, tileMvp;
+
+  if (x1 > 1)
+    x1 = 1;
+  if (y1 > 1)
+    y1 = 1;
+
+  // image quad spans -1..1, with row 0 at the top
+  mat4x4_identity(model);
+  model[0][0] = x1 - x0;
+  model[1][1] = y1 - y0;
+  model[3][0] = x0 + x1 - 1;
+  model[3][1] = 1 - (y0 + y1);
+  mat4x4_mul(tileMvp, mvp, model);
+
+  tile->lastUsed = cache->frame;
+  glBindTexture(GL_TEXTURE_2D, tile->texture);
+  glUniformMatrix4fv(mvp_location, 1, GL_FALSE, (const GLfloat*) tileMvp);
+  glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_BYTE, 0);
+}
+
+// draw the part of the image inside the view at the level mvp calls for.
+// Returns 1 when some tiles are still waiting to be uploaded, so the caller
+// knows to draw another frame.
+static inline int tileCacheDraw(TileCache *cache, mat4x4 mvp,
+                                  GLint mvp_location, int fbWidth,
+                                  int fbHeight)
+{
+  TileLevel *base = &cache->levels[0];
+  int top = cache->levelCount - 1;
+  int uploads = 0, pending = 0;
+  int i, level, col, row, c0, c1, r0, r1;
+  float minX = 1, maxX = -1, minY = 1, maxY = -1;
+  float det, ratio;
+  mat4x4 inv;
+  Tile *tile;
+
+  cache->frame++;
+
+  // on-screen pixels per image pixel picks the level
+  det = fabsf(mvp[0][0] * mvp[1][1] - mvp[0][1] * mvp[1][0]);
+  ratio = sqrtf(det * ((float) fbWidth / base->width) *
+                      ((float) fbHeight / base->height));
+  level = ratio > 0 ? (int) floorf(log2f(1 / ratio)) : top;
+  if (level < 0)
+    level = 0;
+  if (level > top)
+    level = top;
+
+  // the coarsest level is one tile and always goes underneath
+  tile = tileFind(cache, top, 0, 0);
+  if (tile == NULL)
+  {
+    tile = tileLoad(cache, top, 0, 0);
+    uploads++;
+  }
+  if (tile != NULL)
+  {
+    tileDraw(cache, tile, mvp, mvp_location);
+  }
+  if (level == top)
+  {
+    return 0;
+  }
+
+  // bounding box of the view in image space
+  mat4x4_invert(inv, mvp);
+  for (i = 0; i < 4; i++)
+  {
+    vec4 corner = {i & 1 ? 1.f : -1.f, i & 2 ? 1.f : -1.f, 0, 1};
+    vec4 p;
+    mat4x4_mul_vec4(p, inv, corner);
+    minX = p[0] < minX ? p[0] : minX;
+    maxX = p[0] > maxX ? p[0] : maxX;
+    minY = p[1] < minY ? p[1] : minY;
+    maxY = p[1] > maxY ? p[1] : maxY;
+  }
+
+  {
+    TileLevel *l = &cache->levels[level];
+    float span = (float) cache->tileSize;
+    c0 = (int) floorf((minX + 1) / 2 * l->width / span);
+    c1 = (int) floorf((maxX + 1) / 2 * l->width / span);
+    r0 = (int) floorf((1 - maxY) / 2 * l->height / span);
+    r1 = (int) floorf((1 - minY) / 2 * l->height / span);
+    c0 = c0 < 0 ? 0 : c0;
+    r0 = r0 < 0 ? 0 : r0;
+    c1 = c1 >= l->cols ? l->cols - 1 : c1;
+    r1 = r1 >= l->rows ? l->rows - 1 : r1;
+  }
+
+  for (row = r0; row <= r1; row++)
+  {
+    for (col = c0; col <= c1; col++)
+    {
+      tile = tileFind(cache, level, col, row);
+      if (tile == NULL)
+      {
+        if (uploads >= TILE_UPLOADS)
+        {
+          pending = 1;
+          continue;
+        }
+        tile = tileLoad(cache, level, col, row);
+        uploads++;
+        if (tile == NULL)
+        {
+          continue; // over budget, the placeholder shows through
+        }
+      }
+      tileDraw(cache, tile, mvp, mvp_location);
+    }
+  }
+  return pending;
+}
+
+// release the textures and the levels the cache built, not level 0
+static inline void tileCacheFree(TileCache *cache)
+{
+  int i;
+
+  for (i = 1; i < cache->levelCount; i++)
+  {
+    ezBufferFree(cache->levels[i].pixels);
+  }
+  if (cache->tiles != NULL)
+  {
+    for (i = 0; i < cache->capacity; i++)
+    {
+      if (cache->tiles[i].texture != 0)
+      {
+        glDeleteTextures(1, &cache->tiles[i].texture);
+      }
+    }
+  }
+  free(cache->tiles);
+  ezBufferFree(cache->scratch);
+  memset(cache, 0, sizeof(TileCache));
+}
+
+#endif
@@ -0,0 +1,223 @@
+#ifndef TRACE
+#define TRACE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ezthread.h"
+
+#define TRACE_PHASES     32        // distinct phase names
+#define TRACE_MAX_EVENTS (1 << 20) // events kept for the trace file
+
+// Timing of the viewer's phases. Code brackets a phase with traceBegin and
+// traceEnd; while tracing is off that is one branch. Every phase keeps
+// running statistics for the stats view, and with a trace file every event
+// is also kept to be written out in Chrome's trace event format (load it in
+// chrome://tracing or Perfetto). There is one tracer per program, the
+// viewer being a single translation unit, and any thread may record.
+
+typedef struct TraceEvent {
+  const char   *name;
+  double        start, duration; // seconds
+  unsigned long thread;
+} TraceEvent;
+
+// Statistics of one phase since the stats were last taken.
+typedef struct TracePhase {
+  const char *name;
+  long        count;
+  double      total, max;
+} TracePhase;
+
+typedef struct Trace {
+  int         enabled;
+  int         keepEvents;
+  ezMutex     lock;
+  double      origin;            // time trace timestamps count from
+  TraceEvent *events;
+  size_t      count, capacity;
+  long        lost;              // events past TRACE_MAX_EVENTS
+  TracePhase  phases[TRACE_PHASES];
+  int         phaseCount;
+} Trace;
+
+static Trace tracer;
+
+/* Function Prototypes */
+static inline  void   traceStart(int keepEvents);
+static inline  double traceBegin(void);
+static inline  void   traceEnd(const char *name, double start);
+static inline  void   traceAdd(const char *name, double start,
+                                 double duration);
+static inline  int    traceStats(char *text, size_t size);
+static inline  int    traceWrite(const char *path);
+static inline  void   traceStop(void);
+
+// start recording. Without keepEvents only the statistics are kept.
+static inline void traceStart(int keepEvents)
+{
+  memset(&tracer, 0, sizeof(Trace));
+  ezMutexInit(&tracer.lock);
+  tracer.keepEvents = keepEvents;
+  tracer.origin = ezSeconds();
+  tracer.enabled = 1;
+}
+
+// time a phase starts, pass it to traceEnd
+static inline double traceBegin(void)
+{
+  return tracer.enabled ? ezSeconds() : 0;
+}
+
+static inline void traceEnd(const char *name, double start)
+{
+  if (tracer.enabled)
+  {
+    traceAdd(name, start, ezSeconds() - start);
+  }
+}
+
+// record a phase timed some other way, such as on the GPU. name must be a
+// string constant, phases are told apart by pointer.
+static inline void traceAdd(const char *name, double start, double duration)
+{
+  TracePhase *phase = NULL;
+  int i;
+
+  if (!tracer.enabled)
+  {
+    return;
+  }
+
+  ezMutexLock(&tracer.lock);
+  for (i = 0; i < tracer.phaseCount; i++)
+  {
+    if (tracer.phases[i].name == name)
+    {
+      phase = &tracer.phases[i];
+      break;
+    }
+  }
+  if (phase == NULL && tracer.phaseCount < TRACE_PHASES)
+  {
+    phase = &tracer.phases[tracer.phaseCount++];
+    phase->name = name;
+  }
+  if (phase != NULL)
+  {
+    phase->count++;
+    phase->total += duration;
+    if (duration > phase->max)
+    {
+      phase->max = duration;
+    }
+  }
+
+  if (tracer.keepEvents)
+  {
+    if (tracer.count == tracer.capacity && tracer.capacity < TRACE_MAX_EVENTS)
+    {
+      size_t capacity = tracer.capacity ? 2 * tracer.capacity : 1024;
+      TraceEvent *events = realloc(tracer.events,
+                                   sizeof(TraceEvent) * capacity);
+      if (events != NULL)
+      {
+        tracer.events = events;
+        tracer.capacity = capacity;
+      }
+    }
+    if (tracer.count < tracer.capacity)
+    {
+      TraceEvent *event = &tracer.events[tracer.count++];
+      event->name = name;
+      event->start = start;
+      event->duration = duration;
+      event->thread = ezThreadId();
+    }
+    else
+    {
+      tracer.lost++;
+    }
+  }
+  ezMutexUnlock(&tracer.lock);
+}
+
+// Print the mean and worst time of every phase seen since the last call,
+// "name mean/max ms", into text and start a new interval. Returns 0 when
+// nothing was recorded.
+static inline int traceStats(char *text, size_t size)
+{
+  size_t used = 0;
+  int i, any = 0;
+
+  text[0] = '\0';
+  if (!tracer.enabled)
+  {
+    return 0;
+  }
+
+  ezMutexLock(&tracer.lock);
+  for (i = 0; i < tracer.phaseCount; i++)
+  {
+    TracePhase *phase = &tracer.phases[i];
+    int n;
+
+    if (phase->count == 0)
+    {
+      continue;
+    }
+    n = snprintf(text + used, size - used, "%s%s %.2f/%.2f", any ? ", " : "",
+                 phase->name, phase->total / phase->count * 1e3,
+                 phase->max * 1e3);
+    if (n < 0 || (size_t) n >= size - used)
+    {
+      break;
+    }
+    used += n;
+    any = 1;
+    phase->count = 0;
+    phase->total = phase->max = 0;
+  }
+  ezMutexUnlock(&tracer.lock);
+  return any;
+}
+
+// write the recorded events as a Chrome trace, returns 1 on failure
+static inline int traceWrite(const char *path)
+{
+  FILE *out = fopen(path, "w");
+  size_t i;
+
+  if (out == NULL)
+  {
+    return 1;
+  }
+
+  ezMutexLock(&tracer.lock);
+  fprintf(out, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [");
+  for (i = 0; i < tracer.count; i++)
+  {
+    const TraceEvent *event = &tracer.events[i];
+    fprintf(out, "%s\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, "
+                 "\"tid\": %lu, \"ts\": %.3f, \"dur\": %.3f}",
+            i ? "," : "", event->name, event->thread,
+            (event->start - tracer.origin) * 1e6, event->duration * 1e6);
+  }
+  fprintf(out, "\n], \"otherData\": {\"lostEvents\": %ld}}\n", tracer.lost);
+  ezMutexUnlock(&tracer.lock);
+
+  return fclose(out) != 0;
+}
+
+static inline void traceStop(void)
+{
+  if (tracer.enabled)
+  {
+    ezMutexDestroy(&tracer.lock);
+    free(tracer.events);
+    memset(&tracer, 0, sizeof(Trace));
+  }
+}
+
+#endif
@@ -0,0 +1,452 @@
+#ifndef WARP
+#define WARP
+
+#include <math.h>
+
+#include "linmath.h"
+#include "ppmr.h"
+#include "ezpool.h"
+#include "ezmem.h"
+#include "mipmap.h"
+
+#define WARP_GRAIN 8  // output rows per pool task
+#define WARP_FRAC  32 // fraction bits of the fixed-point source positions
+#define WARP_ONE   4294967296.0
+#define WARP_LIMIT 1073741824.f // texel positions must stay within +-2^30
+
+typedef long long WarpFixed;
+
+// CPU stand-in for drawing the textured image quad. Every output pixel is
+// mapped back through the inverse MVP onto the quad and the image is
+// sampled there with bilinear filtering, like GL_LINEAR with clamp-to-edge.
+// Pixels that miss the quad are black, like the cleared framebuffer. Rows
+// can be spread over an ezPool. Given a mip chain, minified frames are
+// blended from the two nearest levels like GL_LINEAR_MIPMAP_LINEAR.
+
+/* Function Prototypes */
+static inline  void   warpImage(const Pixel *src, int sw, int sh, Pixel *dst,
+                                  int dw, int dh, mat4x4 mvp);
+static inline  void   warpImagePool(const Pixel *src, int sw, int sh,
+                                      Pixel *dst, int dw, int dh, mat4x4 mvp,
+                                      ezPool *pool);
+static inline  int    warpImageMip(const MipChain *chain, Pixel *dst,
+                                     int dw, int dh, mat4x4 mvp,
+                                     ezPool *pool);
+static inline  int    warpRender(const Pixel *src, int sw, int sh,
+                                   Pixel *dst, int dw, int dh, mat4x4 mvp,
+                                   int mipmaps, ezPool *pool);
+static inline  void   warpSample(const Pixel *src, int sw, int sh, float u,
+                                   float v, Pixel *out);
+
+// bilinear sample at texture coordinate (u, v), both 0..1
+static inline void warpSample(const Pixel *src, int sw, int sh, float u,
+                                float v, Pixel *out)
+{
+  float x = u * sw - 0.5f;
+  float y = v * sh - 0.5f;
+  int x0 = (int) floorf(x);
+  int y0 = (int) floorf(y);
+  float fx = x - x0;
+  float fy = y - y0;
+  int x1 = x0 + 1;
+  int y1 = y0 + 1;
+  const Pixel *a, *b, *c, *d;
+
+  x0 = x0 < 0 ? 0 : x0 >= sw ? sw - 1 : x0;
+  x1 = x1 < 0 ? 0 : x1 >= sw ? sw - 1 : x1;
+  y0 = y0 < 0 ? 0 : y0 >= sh ? sh - 1 : y0;
+  y1 = y1 < 0 ? 0 : y1 >= sh ? sh - 1 : y1;
+
+  a = src + (size_t) y0 * sw + x0;
+  b = src + (size_t) y0 * sw + x1;
+  c = src + (size_t) y1 * sw + x0;
+  d = src + (size_t) y1 * sw + x1;
+
+  out->r = (unsigned char) ((a->r + (b->r - a->r) * fx) * (1 - fy) +
+                            (c->r + (d->r - c->r) * fx) * fy + 0.5f);
+  out->g = (unsigned char) ((a->g + (b->g - a->g) * fx) * (1 - fy) +
+                            (c->g + (d->g - c->g) * fx) * fy + 0.5f);
+  out->b = (unsigned char) ((a->b + (b->b - a->b) * fx) * (1 - fy) +
+                            (c->b + (d->b - c->b) * fx) * fy + 0.5f);
+}
+
+// Texel position of every output pixel is affine in its column and row, so
+// a warp is described by a few coefficients instead of a 4x4 per pixel.
+typedef struct WarpJob {
+  const Pixel *src;
+  int    sw, sh;
+  Pixel *dst;
+  int    dw, dh;
+  float  ax, ay;  // texel step per output column
+  float  bx, by;  // texel step per output row
+  float  cx, cy;  // texel under the center of output pixel (0, 0)
+} WarpJob;
+
+// Work out the texel coefficients of the quad drawn with mvp. Returns 1
+// when the quad can't be drawn: mvp is singular (a scale of 0) or so close
+// to it that texel positions leave the fixed-point range.
+static inline int warpSetup(WarpJob *job, mat4x4 mvp)
+{
+  mat4x4 inv;
+  float ox, oy, rx, ry;
+
+  mat4x4_invert(inv, mvp);
+
+  // quad space position of output pixel (0, 0)
+  ox = inv[0][0] * (1.f / job->dw - 1) + inv[1][0] * (1 - 1.f / job->dh) +
+       inv[3][0];
+  oy = inv[0][1] * (1.f / job->dw - 1) + inv[1][1] * (1 - 1.f / job->dh) +
+       inv[3][1];
+
+  // quad x -1..1 covers texels -0.5..sw-0.5, quad y 1..-1 rows -0.5..sh-0.5
+  job->ax = inv[0][0] * job->sw / job->dw;
+  job->bx = -inv[1][0] * job->sw / job->dh;
+  job->cx = (ox + 1) / 2 * job->sw - 0.5f;
+  job->ay = -inv[0][1] * job->sh / job->dw;
+  job->by = inv[1][1] * job->sh / job->dh;
+  job->cy = (1 - oy) / 2 * job->sh - 0.5f;
+
+  // farthest texel position of any output pixel, NaN when mvp is singular
+  rx = fabsf(job->cx) + fabsf(job->ax) * job->dw + fabsf(job->bx) * job->dh;
+  ry = fabsf(job->cy) + fabsf(job->ay) * job->dw + fabsf(job->by) * job->dh;
+  return !(isfinite(rx) && isfinite(ry) && rx < WARP_LIMIT &&
+           ry < WARP_LIMIT);
+}
+
+// narrow [*begin, *end) to the columns whose texel coordinate
+// start + step * i lies within [lo, hi]
+static inline void warpClip(float start, float step, float lo, float hi,
+                              int *begin, int *end)
+{
+  float a, b;
+
+  if (step == 0)
+  {
+    if (start < lo || start > hi)
+    {
+      *end = *begin;
+    }
+    return;
+  }
+
+  a = (lo - start) / step;
+  b = (hi - start) / step;
+  if (step < 0)
+  {
+    float t = a;
+    a = b;
+    b = t;
+  }
+
+  // keep the float to int conversions in range
+  a = a < -1 ? -1 : a > (float) *end ? (float) *end : a;
+  b = b < -1 ? -1 : b > (float) *end ? (float) *end : b;
+
+  if ((int) ceilf(a) > *begin)
+  {
+    *begin = (int) ceilf(a);
+  }
+  if ((int) floorf(b) + 1 < *end)
+  {
+    *end = (int) floorf(b) + 1;
+  }
+  if (*end < *begin)
+  {
+    *end = *begin;
+  }
+}
+
+static inline WarpFixed warpToFixed(float v)
+{
+  return (WarpFixed) ((double) v * WARP_ONE);
+}
+
+// all four taps of column i are inside the image, no clamping needed
+static inline int warpInterior(const WarpJob *job, WarpFixed x, WarpFixed y)
+{
+  return x >= 0 && y >= 0 && (x >> WARP_FRAC) < job->sw - 1 &&
+         (y >> WARP_FRAC) < job->sh - 1;
+}
+
+// bilinear blend of one channel with 8-bit weights
+#define WARP_BLEND(c) \
+  ((((r0[0].c * (256 - wx) + r0[1].c * wx) * (256 - wy) + \
+     (r1[0].c * (256 - wx) + r1[1].c * wx) * wy) + 32768) >> 16)
+
+#ifdef PPMR_SSE2
+// WARP_BLEND of all channels of one pixel, returned as 32-bit lanes r g b x.
+// The rows are blended first, which fits unsigned 16 bits; flipping the sign
+// bit lets madd take the columns as signed pairs, and the bias comes back
+// off with the rounding.
+static inline __m128i warpBlendSSE2(const Pixel *r0, const Pixel *r1, int wx,
+                                      int wy)
+{
+  const __m128i zero = _mm_setzero_si128();
+  int a, b, c, d;
+  __m128i top, bottom, v;
+
+  // left and right taps as 16-bit pairs, r r g g b b x x, without reading
+  // past the right tap
+  memcpy(&a, r0, 4);
+  memcpy(&b, (const unsigned char *) r0 + 2, 4);
+  memcpy(&c, r1, 4);
+  memcpy(&d, (const unsigned char *) r1 + 2, 4);
+  top = _mm_unpacklo_epi8(_mm_cvtsi32_si128(a),
+                          _mm_srli_epi32(_mm_cvtsi32_si128(b), 8));
+  bottom = _mm_unpacklo_epi8(_mm_cvtsi32_si128(c),
+                             _mm_srli_epi32(_mm_cvtsi32_si128(d), 8));
+  top = _mm_unpacklo_epi8(top, zero);
+  bottom = _mm_unpacklo_epi8(bottom, zero);
+
+  v = _mm_add_epi16(_mm_mullo_epi16(top, _mm_set1_epi16((short) (256 - wy))),
+                    _mm_mullo_epi16(bottom, _mm_set1_epi16((short) wy)));
+  v = _mm_xor_si128(v, _mm_set1_epi16((short) 0x8000));
+  v = _mm_madd_epi16(v, _mm_set1_epi32(wx << 16 | (256 - wx)));
+  return _mm_srli_epi32(_mm_add_epi32(v, _mm_set1_epi32(128 * 65536 + 32768)),
+                        16);
+}
+#endif
+
+// one output row. The row is clipped against the image up front: columns
+// that miss it are cleared in bulk, the thin border where a tap would fall
+// off the edge takes the clamped path, and the interior steps its source
+// position with one fixed-point add per pixel and samples without checks,
+// four pixels at a time with SSE2.
+static inline void warpRow(const WarpJob *job, int j)
+{
+  Pixel *out = job->dst + (size_t) j * job->dw;
+  const Pixel *src = job->src;
+  float rx = job->cx + job->bx * j;
+  float ry = job->cy + job->by * j;
+  WarpFixed x, y, dx, dy;
+  int i, i0 = 0, i1 = job->dw, k0, k1;
+
+  // columns that land on the image at all
+  warpClip(rx, job->ax, -0.5f, job->sw - 0.5f, &i0, &i1);
+  warpClip(ry, job->ay, -0.5f, job->sh - 0.5f, &i0, &i1);
+
+  // columns whose taps are all inside. The float clip is only a guess, the
+  // ends are checked against the exact fixed-point positions.
+  x = warpToFixed(rx);
+  y = warpToFixed(ry);
+  dx = warpToFixed(job->ax);
+  dy = warpToFixed(job->ay);
+  k0 = i0;
+  k1 = i1;
+  warpClip(rx, job->ax, 0, job->sw - 1.f, &k0, &k1);
+  warpClip(ry, job->ay, 0, job->sh - 1.f, &k0, &k1);
+  while (k0 < k1 && !warpInterior(job, x + dx * k0, y + dy * k0))
+  {
+    k0++;
+  }
+  while (k1 > k0 && !warpInterior(job, x + dx * (k1 - 1), y + dy * (k1 - 1)))
+  {
+    k1--;
+  }
+  if (k0 == k1)
+  {
+    k0 = k1 = i1;
+  }
+
+  memset(out, 0, sizeof(Pixel) * i0);
+  memset(out + i1, 0, sizeof(Pixel) * (job->dw - i1));
+
+  for (i = i0; i < k0; i++)
+  {
+    warpSample(src, job->sw, job->sh,
+               (rx + job->ax * i + 0.5f) / job->sw,
+               (ry + job->ay * i + 0.5f) / job->sh, &out[i]);
+  }
+
+  x += dx * k0;
+  y += dy * k0;
+  i = k0;
+
+#ifdef PPMR_SSE2
+  for (; i + 4 <= k1; i += 4)
+  {
+    const __m128i m0 = _mm_setr_epi8(-1, -1, -1, 0, 0, 0, 0, 0,
+                                     0, 0, 0, 0, 0, 0, 0, 0);
+    const __m128i m4 = _mm_slli_si128(m0, 4);
+    const __m128i m8 = _mm_slli_si128(m0, 8);
+    const __m128i m12 = _mm_slli_si128(m0, 12);
+    __m128i p[4], v, r;
+    int k, tail;
+
+    for (k = 0; k < 4; k++)
+    {
+      const Pixel *r0 = src + (size_t) (y >> WARP_FRAC) * job->sw +
+                        (size_t) (x >> WARP_FRAC);
+
+      p[k] = warpBlendSSE2(r0, r0 + job->sw,
+                           (int) (x >> (WARP_FRAC - 8)) & 0xff,
+                           (int) (y >> (WARP_FRAC - 8)) & 0xff);
+      x += dx;
+      y += dy;
+    }
+
+    // r g b x of the four pixels, packed down to 12 bytes
+    v = _mm_packus_epi16(_mm_packs_epi32(p[0], p[1]),
+                         _mm_packs_epi32(p[2], p[3]));
+    r = _mm_or_si128(_mm_and_si128(v, m0),
+                     _mm_srli_si128(_mm_and_si128(v, m4), 1));
+    r = _mm_or_si128(r, _mm_srli_si128(_mm_and_si128(v, m8), 2));
+    r = _mm_or_si128(r, _mm_srli_si128(_mm_and_si128(v, m12), 3));
+    _mm_storel_epi64((__m128i *) (out + i), r);
+    tail = _mm_cvtsi128_si32(_mm_srli_si128(r, 8));
+    memcpy((unsigned char *) (out + i) + 8, &tail, 4);
+  }
+#endif
+
+  for (; i < k1; i++)
+  {
+    const Pixel *r0 = src + (size_t) (y >> WARP_FRAC) * job->sw +
+                      (size_t) (x >> WARP_FRAC);
+    const Pixel *r1 = r0 + job->sw;
+    int wx = (int) (x >> (WARP_FRAC - 8)) & 0xff;
+    int wy = (int) (y >> (WARP_FRAC - 8)) & 0xff;
+
+    out[i].r = (unsigned char) WARP_BLEND(r);
+    out[i].g = (unsigned char) WARP_BLEND(g);
+    out[i].b = (unsigned char) WARP_BLEND(b);
+    x += dx;
+    y += dy;
+  }
+
+  for (i = k1; i < i1; i++)
+  {
+    warpSample(src, job->sw, job->sh,
+               (rx + job->ax * i + 0.5f) / job->sw,
+               (ry + job->ay * i + 0.5f) / job->sh, &out[i]);
+  }
+}
+
+static inline void warpRows(void *ctx, int begin, int end)
+{
+  const WarpJob *job = (const WarpJob *) ctx;
+  int j;
+
+  for (j = begin; j < end; j++)
+  {
+    warpRow(job, j);
+  }
+}
+
+// render the image quad transformed by mvp into a dw x dh frame, row 0 at
+// the top, with the rows spread over pool (NULL runs on this thread)
+static inline void warpImagePool(const Pixel *src, int sw, int sh, Pixel *dst,
+                                   int dw, int dh, mat4x4 mvp, ezPool *pool)
+{
+  WarpJob job;
+
+  job.src = src;
+  job.sw = sw;
+  job.sh = sh;
+  job.dst = dst;
+  job.dw = dw;
+  job.dh = dh;
+  if (warpSetup(&job, mvp))
+  {
+    // nothing of the quad is drawn, like GL with a degenerate transform
+    memset(dst, 0, sizeof(Pixel) * (size_t) dw * dh);
+    return;
+  }
+
+  ezPoolFor(pool, dh, WARP_GRAIN, warpRows, &job);
+}
+
+static inline void warpImage(const Pixel *src, int sw, int sh, Pixel *dst,
+                               int dw, int dh, mat4x4 mvp)
+{
+  warpImagePool(src, sw, sh, dst, dw, dh, mvp, NULL);
+}
+
+// level of detail GL would pick for an sw x sh texture drawn with mvp
+// into a dw x dh frame, 0 when it isn't zoomed out
+static inline float warpLod(int sw, int sh, int dw, int dh, mat4x4 mvp)
+{
+  WarpJob job;
+  float rho;
+
+  job.sw = sw;
+  job.sh = sh;
+  job.dw = dw;
+  job.dh = dh;
+  if (warpSetup(&job, mvp))
+  {
+    return 0;
+  }
+  rho = sqrtf(job.ax * job.ax + job.ay * job.ay);
+  if (sqrtf(job.bx * job.bx + job.by * job.by) > rho)
+  {
+    rho = sqrtf(job.bx * job.bx + job.by * job.by);
+  }
+  return rho > 1 ? log2f(rho) : 0;
+}
+
+// Render like warpImagePool, sampling chain's levels the way GL picks them:
+// the level of detail is log2 of the most level 0 texels one output pixel
+// spans, and the frame is blended from the levels either side of it.
+// Returns 1 when out of memory.
+static inline int warpImageMip(const MipChain *chain, Pixel *dst, int dw,
+                                 int dh, mat4x4 mvp, ezPool *pool)
+{
+  const MipLevel *levels = chain->levels;
+  float lod = warpLod(levels[0].width, levels[0].height, dw, dh, mvp);
+  unsigned char *a, *b;
+  size_t i, bytes = sizeof(Pixel) * (size_t) dw * dh;
+  int level, weight;
+
+  level = (int) lod;
+  if (level >= chain->count - 1)
+  {
+    level = chain->count - 1;
+    lod = (float) level;
+  }
+  weight = (int) ((lod - level) * 256 + 0.5f);
+  warpImagePool(levels[level].pixels, levels[level].width,
+                levels[level].height, dst, dw, dh, mvp, pool);
+  if (weight == 0)
+  {
+    return 0;
+  }
+
+  b = ezBufferAlloc(bytes);
+  if (b == NULL)
+  {
+    return 1;
+  }
+  warpImagePool(levels[level + 1].pixels, levels[level + 1].width,
+                levels[level + 1].height, (Pixel *) b, dw, dh, mvp, pool);
+  a = (unsigned char *) dst;
+  for (i = 0; i < bytes; i++)
+  {
+    a[i] = (unsigned char) ((a[i] * (256 - weight) + b[i] * weight + 128) >>
+                            8);
+  }
+  ezBufferFree(b);
+  return 0;
+}
+
+// Render the image the way the viewer draws it: from mipmaps when they are
+// asked for and the frame is zoomed out, else from the image alone.
+// Returns 1 when out of memory.
+static inline int warpRender(const Pixel *src, int sw, int sh, Pixel *dst,
+                               int dw, int dh, mat4x4 mvp, int mipmaps,
+                               ezPool *pool)
+{
+  MipChain chain;
+  int status;
+
+  if (!mipmaps || warpLod(sw, sh, dw, dh, mvp) == 0 ||
+      mipBuild(&chain, src, sw, sh, pool))
+  {
+    warpImagePool(src, sw, sh, dst, dw, dh, mvp, pool);
+    return 0;
+  }
+  status = warpImageMip(&chain, dst, dw, dh, mvp, pool);
+  mipFree(&chain);
+  return status;
+}
+
+#endif